@@ -3,6 +3,8 @@
 #include <string>
 #include <thread>
 #include <vector>
+#include <deque>
+#include <map>
 #include <atomic>
 #include <algorithm>
 #include <cstring>
@@ -10,6 +12,12 @@
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <unistd.h>
+#ifdef LB_WITH_TLS
+#include <poll.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#endif
+#include "hpack.h"
 
 using namespace std;
 
@@ -43,30 +51,17 @@ static bool read_n(int fd, string& out, size_t n) {
     return true;
 }
 
-static bool read_until_headers(int fd, string& headers) {
-    // Read until we find \r\n\r\n
-    string acc;
-    vector<char> buf(1024);
-    while (true) {
-        ssize_t r = ::recv(fd, buf.data(), buf.size(), 0);
+// Reads until buf holds a complete head. buf may already contain bytes of
+// a pipelined request that arrived with the previous one.
+static bool read_until_headers(int fd, string& buf) {
+    vector<char> chunk(1024);
+    while (buf.find("\r\n\r\n") == string::npos) {
+        if (buf.size() > 64 * 1024) return false; // avoid header abuse
+        ssize_t r = ::recv(fd, chunk.data(), chunk.size(), 0);
         if (r <= 0) return false;
-        acc.append(buf.data(), buf.data() + r);
-        size_t pos = acc.find("\r\n\r\n");
-        if (pos != string::npos) {
-            headers = acc.substr(0, pos + 4);
-            // put the rest (possible body already received) into headers' tail marker using a delimiter
-            // instead of extra buffer, just keep acc beyond headers in headers (we'll parse length and account for it)
-            // Better approach: return both, but to keep code short, we'll track remaining separately.
-            // We'll store the remainder length in a global static (not ideal) — instead do this:
-            // We'll pass remainder back via reference param:
-            // Simpler: stash remainder in a global static? Not nice.
-            // We'll modify function to return the full acc; caller splits.
-            // To avoid complexity, just return acc and let caller split.
-            headers = acc; // return full acc; caller splits
-            return true;
-        }
-        if (acc.size() > 64 * 1024) return false; // avoid header abuse
+        buf.append(chunk.data(), chunk.data() + r);
     }
+    return true;
 }
 
 struct Request {
@@ -76,6 +71,7 @@ struct Request {
     string body;
     int content_length = 0;
     bool keep_alive = false;
+    bool expect_continue = false;
 };
 
 static bool parse_request_from_buffer(const string& buf, Request& req, size_t& consumed) {
@@ -122,6 +118,9 @@ static bool parse_request_from_buffer(const string& buf, Request& req, size_t& c
     // Connection keep-alive?
     req.keep_alive = (lower.find("\r\nconnection: keep-alive") != string::npos);
 
+    // Client waits for an interim 100 before sending the body
+    req.expect_continue = (lower.find("\r\nexpect: 100-continue") != string::npos);
+
     // Body that might already be present in buf
     size_t body_start = hdr_end + 4;
     size_t already = (buf.size() > body_start) ? (buf.size() - body_start) : 0;
@@ -137,14 +136,218 @@ static bool parse_request_from_buffer(const string& buf, Request& req, size_t& c
     }
 }
 
+// h2c with prior knowledge (what the load balancer's --upstream-h2c and
+// curl --http2-prior-knowledge send). Streams are answered as soon as
+// their request is complete, with the same routes as HTTP/1.1; response
+// DATA is paced by the client's flow-control windows.
+class H2Session {
+    enum : uint8_t { DATA = 0x0, HEADERS = 0x1, RST_STREAM = 0x3, SETTINGS = 0x4, PING = 0x6, GOAWAY = 0x7,
+                     WINDOW_UPDATE = 0x8, CONTINUATION = 0x9 };
+    enum : uint8_t { END_STREAM = 0x1, ACK = 0x1, END_HEADERS = 0x4, PADDED = 0x8, PRIORITY_FLAG = 0x20 };
+
+    struct Stream {
+        string method, path, body;
+        string out;  // response body still to send
+        int64_t window = 0;
+        bool responded = false;
+    };
+
+    int fd;
+    int port;
+    string in;
+    map<uint32_t, Stream> streams;
+    Hpack::Decoder decoder;
+    int64_t send_window = 65535;
+    int64_t initial_window = 65535;
+    size_t max_frame = 16384;
+    uint32_t last_stream = 0;
+
+    static string frame(uint8_t type, uint8_t flags, uint32_t stream, const string& payload) {
+        size_t len = payload.size();
+        char h[9] = {(char)(len >> 16), (char)(len >> 8), (char)len, (char)type, (char)flags,
+                     (char)(stream >> 24), (char)(stream >> 16), (char)(stream >> 8), (char)stream};
+        return string(h, 9) + payload;
+    }
+
+    static string u32(uint32_t v) {
+        char b[4] = {(char)(v >> 24), (char)(v >> 16), (char)(v >> 8), (char)v};
+        return string(b, 4);
+    }
+
+    static uint32_t get_u32(const string& s, size_t off) {
+        return ((uint32_t)(uint8_t)s[off] << 24) | ((uint32_t)(uint8_t)s[off + 1] << 16) |
+               ((uint32_t)(uint8_t)s[off + 2] << 8) | (uint32_t)(uint8_t)s[off + 3];
+    }
+
+    bool write(const string& data) { return send_all(fd, data.data(), data.size()); }
+
+    bool read_frame(uint8_t& type, uint8_t& flags, uint32_t& id, string& payload) {
+        while (true) {
+            if (in.size() >= 9) {
+                size_t len = ((size_t)(uint8_t)in[0] << 16) | ((size_t)(uint8_t)in[1] << 8) | (uint8_t)in[2];
+                if (len > 16384) return false;
+                if (in.size() >= 9 + len) {
+                    type = (uint8_t)in[3];
+                    flags = (uint8_t)in[4];
+                    id = get_u32(in, 5) & 0x7fffffff;
+                    payload = in.substr(9, len);
+                    in.erase(0, 9 + len);
+                    return true;
+                }
+            }
+            char buf[16384];
+            ssize_t n = ::recv(fd, buf, sizeof(buf), 0);
+            if (n <= 0) return false;
+            in.append(buf, (size_t)n);
+        }
+    }
+
+    void respond(uint32_t id, Stream& s) {
+        string body;
+        if (s.method == "GET" && s.path == "/health") body = "OK";
+        else body = "Echo from port: " + to_string(port) + ":\n" + s.body;
+        string block;
+        Hpack::encode_field(block, ":status", "200", 8);
+        Hpack::encode_field(block, "content-type", "text/plain", 31);
+        Hpack::encode_field(block, "content-length", to_string(body.size()), 28);
+        s.out = move(body);
+        s.responded = true;
+        write(frame(HEADERS, END_HEADERS | (s.out.empty() ? END_STREAM : 0), id, block));
+        if (s.out.empty()) streams.erase(id);
+    }
+
+    // Sends pending response data within the windows; streams are served
+    // in id order.
+    bool flush() {
+        for (auto it = streams.begin(); it != streams.end();) {
+            Stream& s = it->second;
+            while (s.responded && !s.out.empty() && send_window > 0 && s.window > 0) {
+                size_t n = (size_t)min<int64_t>({(int64_t)s.out.size(), send_window, s.window, (int64_t)max_frame});
+                bool last = n == s.out.size();
+                if (!write(frame(DATA, last ? END_STREAM : 0, it->first, s.out.substr(0, n)))) return false;
+                s.out.erase(0, n);
+                send_window -= (int64_t)n;
+                s.window -= (int64_t)n;
+            }
+            if (s.responded && s.out.empty()) it = streams.erase(it);
+            else ++it;
+        }
+        return true;
+    }
+
+public:
+    H2Session(int client_fd, int listen_port, string buffered) : fd(client_fd), port(listen_port), in(move(buffered)) {}
+
+    void run() {
+        static const string PREFACE = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+        char buf[64];
+        while (in.size() < PREFACE.size()) {
+            ssize_t n = ::recv(fd, buf, sizeof(buf), 0);
+            if (n <= 0) return;
+            in.append(buf, (size_t)n);
+        }
+        if (in.compare(0, PREFACE.size(), PREFACE) != 0) return;
+        in.erase(0, PREFACE.size());
+        // MAX_CONCURRENT_STREAMS = 100
+        if (!write(frame(SETTINGS, 0, 0, string("\0\x3", 2) + u32(100)))) return;
+
+        string block;
+        bool in_block = false;
+        uint32_t block_stream = 0;
+        uint8_t block_flags = 0;
+        uint8_t type, flags;
+        uint32_t id;
+        string p;
+        while (read_frame(type, flags, id, p)) {
+            if (in_block != (type == CONTINUATION) || (in_block && id != block_stream)) break;
+            size_t start = 0, end = p.size();
+            if ((type == DATA || type == HEADERS) && (flags & PADDED)) {
+                if (p.empty() || (uint8_t)p[0] >= p.size()) break;
+                start = 1;
+                end = p.size() - (uint8_t)p[0];
+            }
+            if (type == HEADERS && (flags & PRIORITY_FLAG)) start += 5;
+            if (start > end) break;
+
+            if (type == HEADERS || type == CONTINUATION) {
+                if (type == HEADERS) {
+                    block_stream = id;
+                    block_flags = flags;
+                }
+                block.append(p, start, end - start);
+                in_block = !(flags & END_HEADERS);
+                if (in_block) continue;
+                Hpack::Fields fields;
+                if (!decoder.decode(block, fields)) break;
+                block.clear();
+                if (block_stream > last_stream) {
+                    last_stream = block_stream;
+                    Stream& s = streams[block_stream];
+                    s.window = initial_window;
+                    for (const auto& f : fields) {
+                        if (f.first == ":method") s.method = f.second;
+                        else if (f.first == ":path") s.path = f.second;
+                    }
+                }
+                auto it = streams.find(block_stream);
+                if (it != streams.end() && !it->second.responded && (block_flags & END_STREAM))
+                    respond(block_stream, it->second);
+            } else if (type == DATA) {
+                // Credit the whole frame back at once; the body is buffered
+                if (!p.empty() && !write(frame(WINDOW_UPDATE, 0, 0, u32((uint32_t)p.size())) +
+                                         frame(WINDOW_UPDATE, 0, id, u32((uint32_t)p.size()))))
+                    break;
+                auto it = streams.find(id);
+                if (it != streams.end() && !it->second.responded) {
+                    it->second.body.append(p, start, end - start);
+                    if (flags & END_STREAM) respond(id, it->second);
+                }
+            } else if (type == SETTINGS && !(flags & ACK)) {
+                for (size_t off = 0; off + 6 <= p.size(); off += 6) {
+                    uint16_t key = (uint16_t)(((uint8_t)p[off] << 8) | (uint8_t)p[off + 1]);
+                    uint32_t v = get_u32(p, off + 2);
+                    if (key == 0x4) {
+                        for (auto& s : streams) s.second.window += (int64_t)v - initial_window;
+                        initial_window = v;
+                    } else if (key == 0x5) {
+                        max_frame = min<size_t>(v, 16384);
+                    }
+                }
+                if (!write(frame(SETTINGS, ACK, 0, ""))) break;
+            } else if (type == WINDOW_UPDATE && p.size() >= 4) {
+                int64_t inc = get_u32(p, 0) & 0x7fffffff;
+                if (id == 0) send_window += inc;
+                else if (streams.count(id)) streams[id].window += inc;
+            } else if (type == PING && !(flags & ACK)) {
+                if (!write(frame(PING, ACK, 0, p))) break;
+            } else if (type == RST_STREAM) {
+                streams.erase(id);
+            } else if (type == GOAWAY) {
+                break;
+            }
+            if (!flush()) break;
+        }
+        // Idle timeout or error: streams above last_stream were not
+        // processed and may be retried by the client
+        write(frame(GOAWAY, 0, 0, u32(last_stream) + u32(0)));
+    }
+};
+
 static void handle_client(int client_fd, int listen_port) {
     set_timeouts(client_fd, 5);
 
     bool done = false;
+    string buf;
     while (!done) {
-        // Read headers (and possibly some body) into a buffer
-        string buf;
+        // Read headers (and possibly some body, or the next pipelined
+        // request) into a buffer
         if (!read_until_headers(client_fd, buf)) break;
+        if (buf.rfind("PRI * HTTP/2.0\r\n\r\n", 0) == 0) {
+            // Long-lived multiplexed connection: idle for a minute before GOAWAY
+            set_timeouts(client_fd, 60);
+            H2Session(client_fd, listen_port, buf).run();
+            break;
+        }
 
         Request req;
         size_t consumed = 0;
@@ -153,12 +356,17 @@ static void handle_client(int client_fd, int listen_port) {
             // Need to read the remainder of the body
             size_t need = (req.content_length > 0) ? (req.content_length - req.body.size()) : 0;
             if (need > 0) {
+                if (req.expect_continue && req.body.empty()) {
+                    const string cont = "HTTP/1.1 100 Continue\r\n\r\n";
+                    if (!send_all(client_fd, cont.c_str(), cont.size())) break;
+                }
                 string more;
                 if (!read_n(client_fd, more, need)) break;
                 req.body += more;
                 consumed += need;
             }
         }
+        buf.erase(0, min(consumed, buf.size()));
 
         // Route: /health
         if (req.method == "GET" && req.path == "/health") {
@@ -192,11 +400,81 @@ static void handle_client(int client_fd, int listen_port) {
     ::close(client_fd);
 }
 
+#ifdef LB_WITH_TLS
+// HTTPS mode: the handshake is done here, then handle_client runs unchanged
+// on either the kTLS socket itself or the app end of a socketpair that this
+// thread pumps through SSL_read/SSL_write.
+static void handle_tls_client(int client_fd, int listen_port, SSL_CTX* ctx) {
+    set_timeouts(client_fd);
+    SSL* ssl = SSL_new(ctx);
+    SSL_set_fd(ssl, client_fd);
+    if (SSL_accept(ssl) != 1) {
+        ERR_clear_error();
+        SSL_free(ssl);
+        ::close(client_fd);
+        return;
+    }
+#ifndef OPENSSL_NO_KTLS
+    if (BIO_get_ktls_send(SSL_get_wbio(ssl)) && BIO_get_ktls_recv(SSL_get_rbio(ssl))) {
+        SSL_free(ssl);
+        handle_client(client_fd, listen_port);
+        return;
+    }
+#endif
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == -1) {
+        SSL_free(ssl);
+        ::close(client_fd);
+        return;
+    }
+    SSL_clear_mode(ssl, SSL_MODE_AUTO_RETRY);
+    std::thread(handle_client, pair[0], listen_port).detach();
+
+    char buf[16384];
+    bool open = true;
+    while (open) {
+        pollfd pfd[2] = {{client_fd, POLLIN, 0}, {pair[1], POLLIN, 0}};
+        if (SSL_pending(ssl) == 0 && ::poll(pfd, 2, -1) == -1) break;
+        if (SSL_pending(ssl) > 0 || (pfd[0].revents & (POLLIN | POLLHUP | POLLERR))) {
+            int n = SSL_read(ssl, buf, sizeof(buf));
+            if (n > 0) open = send_all(pair[1], buf, (size_t)n);
+            else open = SSL_get_error(ssl, n) == SSL_ERROR_WANT_READ;
+        }
+        if (open && (pfd[1].revents & (POLLIN | POLLHUP | POLLERR))) {
+            ssize_t n = ::recv(pair[1], buf, sizeof(buf), 0);
+            open = n > 0 && SSL_write(ssl, buf, (int)n) == (int)n;
+        }
+    }
+    SSL_shutdown(ssl);
+    SSL_free(ssl);
+    ::close(client_fd);
+    ::close(pair[1]);
+}
+#endif
+
 int main(int argc, char* argv[]) {
+#ifdef LB_WITH_TLS
+    if (argc != 2 && argc != 4) {
+        cerr << "usage: ./backend_server <port> [cert.pem key.pem]\n";
+        return 1;
+    }
+    SSL_CTX* ctx = nullptr;
+    if (argc == 4) {
+        ctx = SSL_CTX_new(TLS_server_method());
+        SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+        SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+        if (SSL_CTX_use_certificate_chain_file(ctx, argv[2]) != 1 ||
+            SSL_CTX_use_PrivateKey_file(ctx, argv[3], SSL_FILETYPE_PEM) != 1) {
+            ERR_print_errors_fp(stderr);
+            return 1;
+        }
+    }
+#else
     if (argc != 2) {
         cerr << "usage: ./backend_server <port>\n";
         return 1;
     }
+#endif
     int port = stoi(argv[1]);
 
     int server_fd = ::socket(AF_INET, SOCK_STREAM, 0);
@@ -225,7 +503,11 @@ int main(int argc, char* argv[]) {
         return 1;
     }
 
+#ifdef LB_WITH_TLS
+    cout << "Backend server listening on port: " << port << (ctx ? " (TLS)" : "") << endl;
+#else
     cout << "Backend server listening on port: " << port << endl;
+#endif
 
     while (true) {
         sockaddr_in caddr{};
@@ -235,6 +517,12 @@ int main(int argc, char* argv[]) {
             perror("accept");
             continue;
         }
+#ifdef LB_WITH_TLS
+        if (ctx) {
+            std::thread(handle_tls_client, cfd, port, ctx).detach();
+            continue;
+        }
+#endif
         std::thread(handle_client, cfd, port).detach();
     }
 }
@@ -0,0 +1,266 @@
+// HPACK (RFC 7541) header compression, shared by the load balancer's h2c
+// upstream and the backend server's h2c listener. The encoder writes
+// literals without indexing and without Huffman coding, so the peer's
+// decoder keeps no state for us. The decoder handles the whole format,
+// including the dynamic table and Huffman-coded strings (curl and nghttp2
+// use both).
+#ifndef HPACK_H
+#define HPACK_H
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <utility>
+#include <vector>
+
+static const char* const HPACK_STATIC_TABLE[61][2] = {
+    {":authority", ""}, {":method", "GET"}, {":method", "POST"}, {":path", "/"}, {":path", "/index.html"},
+    {":scheme", "http"}, {":scheme", "https"}, {":status", "200"}, {":status", "204"}, {":status", "206"},
+    {":status", "304"}, {":status", "400"}, {":status", "404"}, {":status", "500"}, {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"}, {"accept-language", ""}, {"accept-ranges", ""}, {"accept", ""},
+    {"access-control-allow-origin", ""}, {"age", ""}, {"allow", ""}, {"authorization", ""}, {"cache-control", ""},
+    {"content-disposition", ""}, {"content-encoding", ""}, {"content-language", ""}, {"content-length", ""},
+    {"content-location", ""}, {"content-range", ""}, {"content-type", ""}, {"cookie", ""}, {"date", ""},
+    {"etag", ""}, {"expect", ""}, {"expires", ""}, {"from", ""}, {"host", ""}, {"if-match", ""},
+    {"if-modified-since", ""}, {"if-none-match", ""}, {"if-range", ""}, {"if-unmodified-since", ""},
+    {"last-modified", ""}, {"link", ""}, {"location", ""}, {"max-forwards", ""}, {"proxy-authenticate", ""},
+    {"proxy-authorization", ""}, {"range", ""}, {"referer", ""}, {"refresh", ""}, {"retry-after", ""},
+    {"server", ""}, {"set-cookie", ""}, {"strict-transport-security", ""}, {"transfer-encoding", ""},
+    {"user-agent", ""}, {"vary", ""}, {"via", ""}, {"www-authenticate", ""},
+};
+
+// Canonical Huffman code from RFC 7541 Appendix B; symbol 256 is EOS
+static const uint32_t HPACK_HUFFMAN_CODES[257] = {
+    0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6, 0xfffffe7,
+    0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec,
+    0xfffffed, 0xfffffee, 0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+    0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb,
+    0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa,
+    0x3fa, 0x3fb, 0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+    0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d,
+    0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc,
+    0x1ffa, 0x21, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+    0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+    0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72,
+    0xfc, 0x73, 0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+    0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5, 0x25, 0x26,
+    0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a, 0x7,
+    0x2b, 0x76, 0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+    0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd, 0x1ffd, 0xffffffc,
+    0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9,
+    0x3fffd6, 0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+    0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3,
+    0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef,
+    0x3fffda, 0x1fffdd, 0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+    0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec,
+    0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef,
+    0xfffea, 0x3fffe2, 0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+    0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2, 0x3fffe8, 0x1ffffec,
+    0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde, 0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed,
+    0x7fff2, 0x1fffe3, 0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+    0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5,
+    0xfffec, 0xfffff3, 0xfffed, 0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3,
+    0x3fffea, 0x3fffeb, 0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+    0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8, 0x7ffffe9, 0x7ffffea,
+    0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+    0x3fffffff,
+};
+static const uint8_t HPACK_HUFFMAN_BITS[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30,
+};
+
+class Hpack {
+public:
+    using Fields = std::vector<std::pair<std::string, std::string>>;
+
+    static void encode_int(std::string& out, uint8_t first, int prefix_bits, uint64_t v) {
+        uint64_t max_prefix = (1u << prefix_bits) - 1;
+        if (v < max_prefix) {
+            out += (char)(first | v);
+            return;
+        }
+        out += (char)(first | max_prefix);
+        v -= max_prefix;
+        while (v >= 128) {
+            out += (char)(0x80 | (v & 0x7f));
+            v >>= 7;
+        }
+        out += (char)v;
+    }
+
+    static void encode_string(std::string& out, const std::string& s) {
+        encode_int(out, 0x00, 7, s.size());
+        out += s;
+    }
+
+    // Literal header field without indexing; static_index names the field
+    // by its static table entry when non-zero.
+    static void encode_field(std::string& out, const std::string& name, const std::string& value, int static_index = 0) {
+        encode_int(out, 0x00, 4, (uint64_t)static_index);
+        if (!static_index) encode_string(out, name);
+        encode_string(out, value);
+    }
+
+    class Decoder {
+        std::deque<std::pair<std::string, std::string>> dynamic;  // newest first
+        size_t size = 0;
+        size_t max_size = 4096;
+        size_t limit = 4096;  // our SETTINGS_HEADER_TABLE_SIZE
+
+        struct Node {
+            int child[2] = {-1, -1};
+            int symbol = -1;
+        };
+
+        static const std::vector<Node>& huffman_tree() {
+            static const std::vector<Node> tree = []() {
+                std::vector<Node> t(1);
+                for (int sym = 0; sym < 257; ++sym) {
+                    int node = 0;
+                    for (int b = HPACK_HUFFMAN_BITS[sym] - 1; b >= 0; --b) {
+                        int bit = (HPACK_HUFFMAN_CODES[sym] >> b) & 1;
+                        if (t[node].child[bit] == -1) {
+                            t[node].child[bit] = (int)t.size();
+                            t.emplace_back();
+                        }
+                        node = t[node].child[bit];
+                    }
+                    t[node].symbol = sym;
+                }
+                return t;
+            }();
+            return tree;
+        }
+
+        static bool huffman_decode(const uint8_t* p, size_t len, std::string& out) {
+            const std::vector<Node>& tree = huffman_tree();
+            int node = 0, depth = 0;
+            bool all_ones = true;
+            for (size_t i = 0; i < len; ++i) {
+                for (int b = 7; b >= 0; --b) {
+                    int bit = (p[i] >> b) & 1;
+                    node = tree[node].child[bit];
+                    if (node == -1) return false;
+                    ++depth;
+                    all_ones = all_ones && bit;
+                    if (tree[node].symbol != -1) {
+                        if (tree[node].symbol == 256) return false;
+                        out += (char)tree[node].symbol;
+                        node = depth = 0;
+                        all_ones = true;
+                    }
+                }
+            }
+            // Padding is a prefix of EOS: at most 7 one bits
+            return depth < 8 && all_ones;
+        }
+
+        static bool read_int(const uint8_t*& p, const uint8_t* end, int prefix_bits, uint64_t& v) {
+            if (p >= end) return false;
+            uint64_t max_prefix = (1u << prefix_bits) - 1;
+            v = *p++ & max_prefix;
+            if (v < max_prefix) return true;
+            for (int shift = 0; shift < 56; shift += 7) {
+                if (p >= end) return false;
+                uint8_t b = *p++;
+                v += (uint64_t)(b & 0x7f) << shift;
+                if (!(b & 0x80)) return true;
+            }
+            return false;
+        }
+
+        static bool read_string(const uint8_t*& p, const uint8_t* end, std::string& out) {
+            if (p >= end) return false;
+            bool huffman = *p & 0x80;
+            uint64_t len;
+            if (!read_int(p, end, 7, len) || len > (uint64_t)(end - p)) return false;
+            out.clear();
+            if (huffman) {
+                if (!huffman_decode(p, (size_t)len, out)) return false;
+            } else {
+                out.assign((const char*)p, (size_t)len);
+            }
+            p += len;
+            return true;
+        }
+
+        bool lookup(uint64_t index, std::pair<std::string, std::string>& field) const {
+            if (index == 0) return false;
+            if (index <= 61) {
+                field = {HPACK_STATIC_TABLE[index - 1][0], HPACK_STATIC_TABLE[index - 1][1]};
+                return true;
+            }
+            if (index - 62 >= dynamic.size()) return false;
+            field = dynamic[index - 62];
+            return true;
+        }
+
+        void evict_to(size_t target) {
+            while (size > target && !dynamic.empty()) {
+                size -= dynamic.back().first.size() + dynamic.back().second.size() + 32;
+                dynamic.pop_back();
+            }
+        }
+
+        void insert(const std::pair<std::string, std::string>& field) {
+            size_t entry = field.first.size() + field.second.size() + 32;
+            evict_to(entry > max_size ? 0 : max_size - entry);
+            if (entry > max_size) return;
+            dynamic.push_front(field);
+            size += entry;
+        }
+
+    public:
+        // Decodes one complete header block; false is a connection error.
+        bool decode(const std::string& block, Fields& fields) {
+            const uint8_t* p = (const uint8_t*)block.data();
+            const uint8_t* end = p + block.size();
+            while (p < end) {
+                uint8_t b = *p;
+                uint64_t index;
+                std::pair<std::string, std::string> field;
+                if (b & 0x80) {  // indexed field
+                    if (!read_int(p, end, 7, index) || !lookup(index, field)) return false;
+                } else if ((b & 0xe0) == 0x20) {  // dynamic table size update
+                    if (!read_int(p, end, 5, index) || index > limit) return false;
+                    max_size = (size_t)index;
+                    evict_to(max_size);
+                    continue;
+                } else {
+                    // literal: with incremental indexing (01), without (0000)
+                    // or never indexed (0001)
+                    bool indexing = (b & 0xc0) == 0x40;
+                    if (!read_int(p, end, indexing ? 6 : 4, index)) return false;
+                    if (index) {
+                        if (!lookup(index, field)) return false;
+                    } else if (!read_string(p, end, field.first)) {
+                        return false;
+                    }
+                    if (!read_string(p, end, field.second)) return false;
+                    if (indexing) insert(field);
+                }
+                fields.push_back(std::move(field));
+            }
+            return true;
+        }
+    };
+};
+
+#endif
@@ -13,326 +13,6293 @@
 #include <climits>
 #include <functional>
 #include <atomic>
+#include <cerrno>
+#include <iomanip>
+#include <sstream>
+#include <map>
+#include <csignal>
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <random>
+#include <memory>
+#include <set>
+#include <condition_variable>
+#include <poll.h>
+#include <deque>
+#include <list>
+#include <unordered_map>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <linux/errqueue.h>
+#include <netinet/tcp.h>
+#include <linux/net_tstamp.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <netdb.h>
+#include <linux/filter.h>
+#include <linux/bpf.h>
+#include <linux/sockios.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sched.h>
+#include <resolv.h>
+#include <arpa/nameser.h>
+#ifdef LB_WITH_TLS
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#endif
+#include "hpack.h"
 
 using namespace std;
 
-enum class LBAlgorithm { ROUND_ROBIN, LEAST_CONNECTIONS, IP_HASH };
+enum class LBAlgorithm { ROUND_ROBIN, LEAST_CONNECTIONS, IP_HASH, LEAST_RTT };
 
+// Proxy stages that hardware counters are attributed to in --perf mode.
+enum class ProxyStage { SELECT_BACKEND, CONNECT, FORWARD, HEALTH_SWEEP, COUNT };
+
+// Self-profiling with perf_event_open. A counter group (cycles, instructions,
+// cache misses, context switches) is read with a single read() at stage
+// entry and exit, and the deltas are summed per stage. Counters the kernel or
+// hypervisor does not provide are skipped. Readings are scaled by
+// enabled/running time, so a group the PMU had to multiplex still estimates
+// full counts.
+// Handler threads live for one connection, so per-thread groups would cost
+// every connection a round of perf_event_open/close. Where the kernel allows
+// it (perf_event_paranoid <= 0 or CAP_PERFMON), one long-lived group per CPU
+// (pid = -1) is opened at startup instead, and a stage is read from the group
+// of the CPU it runs on. A stage that migrates between CPUs is dropped. A
+// per-CPU group also counts whatever else ran on that CPU during the stage.
+// Otherwise each thread lazily opens its own group; that setup falls outside
+// every stage and is counted separately.
+class PerfProfiler {
+public:
+    enum Event { CYCLES, INSTRUCTIONS, CACHE_MISSES, CONTEXT_SWITCHES, EVENT_COUNT };
+
+private:
+    struct StageTotals {
+        atomic<uint64_t> calls{0};
+        atomic<uint64_t> values[EVENT_COUNT] = {};
+    };
+
+    struct CounterGroup {
+        int leader_fd = -1;
+        vector<int> fds;
+        int slot[EVENT_COUNT] = {-1, -1, -1, -1};
+
+        ~CounterGroup() {
+            for (int fd : fds) ::close(fd);
+        }
+
+        static int open_event(uint32_t type, uint64_t config, pid_t pid, int cpu, int group_fd) {
+            perf_event_attr attr{};
+            attr.size = sizeof(attr);
+            attr.type = type;
+            attr.config = config;
+            attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            attr.exclude_hv = 1;
+            int fd = (int)syscall(SYS_perf_event_open, &attr, pid, cpu, group_fd, 0);
+            if (fd == -1 && errno == EACCES) {
+                // perf_event_paranoid may only allow user-space counting
+                attr.exclude_kernel = 1;
+                fd = (int)syscall(SYS_perf_event_open, &attr, pid, cpu, group_fd, 0);
+            }
+            return fd;
+        }
+
+        // pid 0, cpu -1: the calling thread; pid -1, cpu N: everything on CPU N
+        bool open(pid_t pid, int cpu) {
+            const pair<uint32_t, uint64_t> events[EVENT_COUNT] = {
+                {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+                {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+                {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+                {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES}
+            };
+            for (int e = 0; e < EVENT_COUNT; ++e) {
+                int fd = open_event(events[e].first, events[e].second, pid, cpu, leader_fd);
+                if (fd == -1) continue;
+                if (leader_fd == -1) leader_fd = fd;
+                slot[e] = (int)fds.size();
+                fds.push_back(fd);
+            }
+            return leader_fd != -1;
+        }
+
+        int mask() const {
+            int m = 0;
+            for (int e = 0; e < EVENT_COUNT; ++e)
+                if (slot[e] >= 0) m |= 1 << e;
+            return m;
+        }
+
+        // Returns -1 on failure, else 1 if the reading had to be scaled up
+        int read(uint64_t out[EVENT_COUNT]) const {
+            if (leader_fd == -1) return -1;
+            // nr, time_enabled, time_running, then one value per event
+            uint64_t buf[3 + EVENT_COUNT];
+            if (::read(leader_fd, buf, sizeof(buf)) < (ssize_t)(3 * sizeof(uint64_t))) return -1;
+            uint64_t enabled = buf[1], running = buf[2];
+            if (running == 0) return -1;  // never scheduled onto the PMU
+            for (int e = 0; e < EVENT_COUNT; ++e) {
+                uint64_t raw = (slot[e] >= 0 && (uint64_t)slot[e] < buf[0]) ? buf[3 + slot[e]] : 0;
+                out[e] = running == enabled ? raw : (uint64_t)((unsigned __int128)raw * enabled / running);
+            }
+            return running < enabled ? 1 : 0;
+        }
+    };
+
+    struct ThreadCounters {
+        PerfProfiler* owner;
+        CounterGroup group;
+        bool opened = false;
+
+        explicit ThreadCounters(PerfProfiler* p): owner(p) {}
+
+        ~ThreadCounters() {
+            if (group.fds.empty()) return;
+            auto began = chrono::steady_clock::now();
+            for (int fd : group.fds) ::close(fd);
+            group.fds.clear();
+            owner->teardown_ns.fetch_add(elapsed_ns(began), memory_order_relaxed);
+            owner->groups_closed.fetch_add(1, memory_order_relaxed);
+        }
+
+        static uint64_t elapsed_ns(chrono::steady_clock::time_point began) {
+            return (uint64_t)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - began).count();
+        }
+
+        CounterGroup& get() {
+            if (opened) return group;
+            opened = true;
+            auto began = chrono::steady_clock::now();
+            if (group.open(0, -1)) owner->groups_opened.fetch_add(1, memory_order_relaxed);
+            owner->setup_ns.fetch_add(elapsed_ns(began), memory_order_relaxed);
+            return group;
+        }
+    };
+
+    atomic<bool> active{false};
+    atomic<uint64_t> requests{0};
+    atomic<int> available{0};  // bitmask of events at least one group could open
+    StageTotals stages[(int)ProxyStage::COUNT];
+    vector<unique_ptr<CounterGroup>> cpu_groups;  // per CPU; empty = per-thread groups
+    atomic<uint64_t> groups_opened{0}, groups_closed{0}, setup_ns{0}, teardown_ns{0};
+    atomic<uint64_t> multiplexed{0};  // readings scaled up because the group shared the PMU
+    atomic<uint64_t> migrated{0};     // stages dropped for ending on another CPU
+
+    ThreadCounters& thread_counters() {
+        thread_local ThreadCounters counters(this);
+        return counters;
+    }
+
+    // One group per CPU, or none if any CPU's group cannot be opened
+    void open_cpu_groups() {
+        long cpus = sysconf(_SC_NPROCESSORS_CONF);
+        for (long cpu = 0; cpu < cpus; ++cpu) {
+            auto g = make_unique<CounterGroup>();
+            if (!g->open(-1, (int)cpu)) {
+                cpu_groups.clear();
+                return;
+            }
+            available.fetch_or(g->mask(), memory_order_relaxed);
+            cpu_groups.push_back(move(g));
+        }
+    }
+
+public:
+    // Before any thread samples: the per-CPU groups are never resized
+    void enable() {
+        if (active.exchange(true)) return;
+        open_cpu_groups();
+    }
+
+    bool enabled() const { return active.load(memory_order_relaxed); }
+
+    void count_request() {
+        if (enabled()) requests.fetch_add(1, memory_order_relaxed);
+    }
+
+    // Reads the counters for the calling thread's stage; cpu identifies the
+    // per-CPU group used (-1 for the thread's own group)
+    bool sample(uint64_t out[EVENT_COUNT], int& cpu) {
+        const CounterGroup* g;
+        if (!cpu_groups.empty()) {
+            cpu = sched_getcpu();
+            if (cpu < 0 || (size_t)cpu >= cpu_groups.size()) return false;
+            g = cpu_groups[cpu].get();
+        } else {
+            cpu = -1;
+            CounterGroup& own = thread_counters().get();
+            available.fetch_or(own.mask(), memory_order_relaxed);
+            g = &own;
+        }
+        int scaled = g->read(out);
+        if (scaled < 0) return false;
+        if (scaled) multiplexed.fetch_add(1, memory_order_relaxed);
+        return true;
+    }
+
+    void record(ProxyStage stage, int start_cpu, const uint64_t start[EVENT_COUNT], int end_cpu,
+                const uint64_t end[EVENT_COUNT]) {
+        if (start_cpu != end_cpu) {
+            migrated.fetch_add(1, memory_order_relaxed);
+            return;
+        }
+        StageTotals& st = stages[(int)stage];
+        st.calls.fetch_add(1, memory_order_relaxed);
+        for (int e = 0; e < EVENT_COUNT; ++e)
+            st.values[e].fetch_add(end[e] - start[e], memory_order_relaxed);
+    }
+
+    void log_status(ostream& out) {
+        static const char* stage_names[] = {"select_backend", "connect", "forward", "health_sweep"};
+        static const char* event_names[] = {"Cycles", "Instructions", "CacheMisses", "CtxSwitches"};
+        int mask = available.load(memory_order_relaxed);
+        uint64_t reqs = requests.load(memory_order_relaxed);
+        uint64_t proxy_totals[EVENT_COUNT] = {};
+
+        out << "Perf Counters:\n";
+        if (mask == 0) {
+            out << "unavailable (perf_event_open failed)\n";
+            return;
+        }
+        out << fixed << setprecision(2);
+        for (int s = 0; s < (int)ProxyStage::COUNT; ++s) {
+            StageTotals& st = stages[s];
+            uint64_t calls = st.calls.load(memory_order_relaxed);
+            uint64_t v[EVENT_COUNT];
+            for (int e = 0; e < EVENT_COUNT; ++e) {
+                v[e] = st.values[e].load(memory_order_relaxed);
+                if (s != (int)ProxyStage::HEALTH_SWEEP) proxy_totals[e] += v[e];
+            }
+            out << stage_names[s] << " Calls: " << calls;
+            for (int e = 0; e < EVENT_COUNT; ++e) {
+                out << " " << event_names[e] << ": ";
+                if (mask & (1 << e)) out << v[e]; else out << "n/a";
+            }
+            if ((mask & (1 << CYCLES)) && (mask & (1 << INSTRUCTIONS)) && v[CYCLES] > 0)
+                out << " IPC: " << (double)v[INSTRUCTIONS] / (double)v[CYCLES];
+            out << "\n";
+        }
+        out << "Requests: " << reqs;
+        if ((mask & (1 << CYCLES)) && (mask & (1 << INSTRUCTIONS)) && proxy_totals[CYCLES] > 0)
+            out << " IPC: " << (double)proxy_totals[INSTRUCTIONS] / (double)proxy_totals[CYCLES];
+        if (reqs > 0) {
+            for (int e = CYCLES; e < EVENT_COUNT; ++e)
+                if (mask & (1 << e))
+                    out << " " << event_names[e] << "/req: " << (double)proxy_totals[e] / (double)reqs;
+        }
+        out << "\n";
+        if (!cpu_groups.empty()) {
+            out << "Groups: per-CPU (" << cpu_groups.size() << ") MigratedStages: " << migrated.load(memory_order_relaxed);
+        } else {
+            // Per-thread open()/close() of the counter group, outside the stages above
+            uint64_t opened = groups_opened.load(memory_order_relaxed);
+            uint64_t overhead_ns = setup_ns.load(memory_order_relaxed) + teardown_ns.load(memory_order_relaxed);
+            out << "Groups: per-thread Opened: " << opened << " Closed: " << groups_closed.load(memory_order_relaxed)
+                << " Setup+Teardown: " << overhead_ns / 1000 << "us";
+            if (opened > 0) out << " (" << (double)overhead_ns / 1000.0 / (double)opened << "us/thread)";
+        }
+        out << " Multiplexed Reads: " << multiplexed.load(memory_order_relaxed) << "\n";
+        out.unsetf(ios::floatfield);
+    }
+};
+
+static PerfProfiler perf_profiler;
+
+// RAII scope that attributes counter deltas to one proxy stage.
+class PerfStageScope {
+    ProxyStage stage;
+    bool sampled = false;
+    int start_cpu = -1;
+    uint64_t start[PerfProfiler::EVENT_COUNT];
+
+public:
+    explicit PerfStageScope(ProxyStage s): stage(s) {
+        if (perf_profiler.enabled()) sampled = perf_profiler.sample(start, start_cpu);
+    }
+
+    ~PerfStageScope() {
+        if (!sampled) return;
+        uint64_t end[PerfProfiler::EVENT_COUNT];
+        int end_cpu;
+        if (perf_profiler.sample(end, end_cpu)) perf_profiler.record(stage, start_cpu, start, end_cpu, end);
+    }
+};
+
+// SIGPROF-based stack sampler behind the admin /profile endpoint. ITIMER_PROF
+// fires on process CPU time, so samples land on whichever LB thread is busy.
+// The handler only calls backtrace() into a preallocated slot; symbolization
+// and folding into flame-graph stacks happen after the timer is stopped.
+class CpuProfiler {
+    static constexpr int MAX_DEPTH = 48;
+    static constexpr int SKIP_FRAMES = 2;  // signal handler + sigreturn trampoline
+
+    struct Sample {
+        int depth;
+        void* pcs[MAX_DEPTH];
+    };
+
+    static atomic<bool> collecting;
+    static atomic<size_t> next_sample;
+    static atomic<size_t> dropped;
+    static Sample* samples;
+    static size_t capacity;
+
+    atomic<bool> busy{false};
+    mutex wait_mutex;
+    condition_variable wait_cv;
+    bool cancelled = false;  // guarded by wait_mutex
+
+    static void on_sigprof(int) {
+        if (!collecting.load(memory_order_acquire)) return;
+        int saved_errno = errno;
+        size_t idx = next_sample.fetch_add(1, memory_order_relaxed);
+        if (idx < capacity) samples[idx].depth = backtrace(samples[idx].pcs, MAX_DEPTH);
+        else dropped.fetch_add(1, memory_order_relaxed);
+        errno = saved_errno;
+    }
+
+    static string symbolize(void* pc) {
+        Dl_info info{};
+        if (dladdr(pc, &info) && info.dli_sname) {
+            int status = 0;
+            char* demangled = abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+            string name = (status == 0 && demangled) ? demangled : info.dli_sname;
+            free(demangled);
+            // Drop the parameter list; frames read better as "Class::method"
+            size_t end = name.rfind(')');
+            if (end != string::npos && name.find_first_not_of(" const", end + 1) == string::npos) {
+                int depth = 0;
+                for (size_t i = end + 1; i-- > 0;) {
+                    if (name[i] == ')') ++depth;
+                    else if (name[i] == '(' && --depth == 0) { name.erase(i); break; }
+                }
+            }
+            replace(name.begin(), name.end(), ';', ':');
+            return name;
+        }
+        ostringstream out;
+        const char* module = (info.dli_fname && *info.dli_fname) ? strrchr(info.dli_fname, '/') : nullptr;
+        out << (module ? module + 1 : "??") << "+0x" << hex
+            << ((uintptr_t)pc - (uintptr_t)info.dli_fbase);
+        return out.str();
+    }
+
+public:
+    struct Result {
+        string folded;
+        size_t samples = 0;
+        size_t dropped = 0;
+    };
+
+    // Samples all threads for `seconds` at `hz` and returns folded stacks
+    // ("root;caller;callee count" per line). Returns false if a profile is
+    // already running.
+    bool profile(int seconds, int hz, Result& result) {
+        if (busy.exchange(true)) return false;
+        {
+            lock_guard<mutex> lock(wait_mutex);
+            if (cancelled) { busy = false; return false; }
+        }
+
+        capacity = (size_t)seconds * hz * max(1u, thread::hardware_concurrency()) + 64;
+        vector<Sample> storage(capacity);
+        samples = storage.data();
+        next_sample = 0;
+        dropped = 0;
+
+        // backtrace() loads libgcc lazily; do it here, not in the handler
+        void* warmup[4];
+        backtrace(warmup, 4);
+
+        struct sigaction sa{};
+        sa.sa_handler = on_sigprof;
+        sa.sa_flags = SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGPROF, &sa, nullptr);
+
+        itimerval timer{};
+        timer.it_interval.tv_usec = 1000000 / hz;
+        timer.it_value = timer.it_interval;
+        collecting.store(true, memory_order_release);
+        setitimer(ITIMER_PROF, &timer, nullptr);
+
+        {
+            unique_lock<mutex> lock(wait_mutex);
+            wait_cv.wait_for(lock, chrono::seconds(seconds), [this]() { return cancelled; });
+        }
+
+        itimerval off{};
+        setitimer(ITIMER_PROF, &off, nullptr);
+        collecting.store(false, memory_order_release);
+
+        size_t taken = min(next_sample.load(), capacity);
+        map<vector<void*>, size_t> stacks;
+        for (size_t i = 0; i < taken; ++i) {
+            const Sample& sm = storage[i];
+            if (sm.depth <= SKIP_FRAMES) continue;
+            stacks[vector<void*>(sm.pcs + SKIP_FRAMES, sm.pcs + sm.depth)]++;
+        }
+
+        map<void*, string> names;
+        map<string, size_t> folded;
+        for (const auto& [pcs, count] : stacks) {
+            string line;
+            for (auto it = pcs.rbegin(); it != pcs.rend(); ++it) {
+                auto found = names.find(*it);
+                if (found == names.end()) found = names.emplace(*it, symbolize(*it)).first;
+                if (!line.empty()) line += ';';
+                line += found->second;
+            }
+            folded[line] += count;
+        }
+
+        ostringstream out;
+        for (const auto& [line, count] : folded) out << line << " " << count << "\n";
+        result.folded = out.str();
+        result.samples = taken;
+        result.dropped = dropped.load();
+        samples = nullptr;
+        busy = false;
+        return true;
+    }
+
+    // Cuts a running profile short (used at shutdown); later profiles are refused.
+    void cancel() {
+        lock_guard<mutex> lock(wait_mutex);
+        cancelled = true;
+        wait_cv.notify_all();
+    }
+};
+
+atomic<bool> CpuProfiler::collecting{false};
+atomic<size_t> CpuProfiler::next_sample{0};
+atomic<size_t> CpuProfiler::dropped{0};
+CpuProfiler::Sample* CpuProfiler::samples = nullptr;
+size_t CpuProfiler::capacity = 0;
+
+static CpuProfiler cpu_profiler;
+
+static inline uint64_t mono_ns() {
+    return (uint64_t)chrono::duration_cast<chrono::nanoseconds>(
+        chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Steady-clock timestamps (ns) of one proxied request's stages; 0 = not reached.
+struct RequestTimings {
+    uint64_t accepted = 0, started = 0, head_read = 0, selected = 0, connected = 0;
+    uint64_t request_sent = 0, first_byte = 0, finished = 0;
+    // Kernel software timestamps (--kernel-timestamps), converted to the
+    // same steady-clock domain: first request segment received, our first
+    // read of it, last response byte sent, and the backend leg.
+    uint64_t kernel_rx_request = 0, first_read = 0, kernel_tx_response = 0;
+    uint64_t kernel_tx_upstream = 0, kernel_rx_upstream = 0;
+};
+
+// SO_TIMESTAMPING helpers for the --kernel-timestamps instrumentation mode.
+// RX timestamps ride along recvmsg() as SCM_TIMESTAMPING; TX timestamps of
+// each send's last byte are queued on the socket error queue.
+class KernelTimestamps {
+    struct Stat {
+        atomic<uint64_t> count{0}, sum_ns{0}, max_ns{0};
+
+        void add(uint64_t ns) {
+            count.fetch_add(1, memory_order_relaxed);
+            sum_ns.fetch_add(ns, memory_order_relaxed);
+            uint64_t cur = max_ns.load(memory_order_relaxed);
+            while (ns > cur && !max_ns.compare_exchange_weak(cur, ns, memory_order_relaxed)) {}
+        }
+
+        void log(ostream& out, const char* name) {
+            uint64_t n = count.load(memory_order_relaxed);
+            out << name << " Count: " << n << " Avg(us): " << (n ? sum_ns.load(memory_order_relaxed) / n / 1000.0 : 0.0)
+                << " Max(us): " << max_ns.load(memory_order_relaxed) / 1000.0 << "\n";
+        }
+    };
+
+    Stat kernel_latency, user_latency, pre_read_queue, upstream_kernel;
+
+public:
+    static constexpr int FLAGS = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_TX_SOFTWARE |
+                                 SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_OPT_ID |
+                                 SOF_TIMESTAMPING_OPT_TSONLY;
+
+    static constexpr int RX_FLAGS = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+
+    static bool enable(int fd, int flags = FLAGS) {
+        return setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) == 0;
+    }
+
+    // Kernel timestamps are CLOCK_REALTIME; map them onto mono_ns().
+    static uint64_t to_mono(const timespec& ts) {
+        timespec real{}, mono{};
+        clock_gettime(CLOCK_REALTIME, &real);
+        clock_gettime(CLOCK_MONOTONIC, &mono);
+        int64_t ts_ns = (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+        int64_t offset = ((int64_t)real.tv_sec - mono.tv_sec) * 1000000000LL + (real.tv_nsec - mono.tv_nsec);
+        return (uint64_t)(ts_ns - offset);
+    }
+
+    // Software timestamp carried by a control message, or 0.
+    static uint64_t from_cmsg(const cmsghdr* cm) {
+        if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_TIMESTAMPING) return 0;
+        const timespec* ts = (const timespec*)CMSG_DATA(cm);
+        return (ts[0].tv_sec || ts[0].tv_nsec) ? to_mono(ts[0]) : 0;
+    }
+
+    // recv() that also returns the RX timestamp of the data read (0 if none).
+    static ssize_t recv_stamped(int fd, char* buf, size_t len, uint64_t& rx_ns) {
+        char control[256];
+        iovec iov{buf, len};
+        msghdr msg{};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        ssize_t n;
+        do {
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+            n = ::recvmsg(fd, &msg, 0);
+        } while (n == -1 && errno == EINTR);
+        rx_ns = 0;
+        for (cmsghdr* cm = CMSG_FIRSTHDR(&msg); n > 0 && cm; cm = CMSG_NXTHDR(&msg, cm))
+            if (uint64_t ts = from_cmsg(cm)) rx_ns = ts;
+        return n;
+    }
+
+    // Empties the error queue, returning the latest TX timestamp on it. With
+    // wait_ms > 0, waits that long for the first notification.
+    static uint64_t drain_tx(int fd, int wait_ms = 0) {
+        uint64_t latest = 0;
+        if (wait_ms > 0) {
+            pollfd pfd{fd, 0, 0};
+            ::poll(&pfd, 1, wait_ms);
+        }
+        while (true) {
+            char control[256];
+            msghdr msg{};
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+            if (::recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) break;
+            for (cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+                latest = max(latest, from_cmsg(cm));
+        }
+        return latest;
+    }
+
+    void record(const RequestTimings& t) {
+        if (t.kernel_rx_request && t.kernel_tx_response > t.kernel_rx_request) {
+            kernel_latency.add(t.kernel_tx_response - t.kernel_rx_request);
+            user_latency.add(t.finished - t.first_read);
+        }
+        if (t.kernel_rx_request && t.first_read > t.kernel_rx_request)
+            pre_read_queue.add(t.first_read - t.kernel_rx_request);
+        if (t.kernel_tx_upstream && t.kernel_rx_upstream > t.kernel_tx_upstream)
+            upstream_kernel.add(t.kernel_rx_upstream - t.kernel_tx_upstream);
+    }
+
+    void log_status(ostream& out) {
+        out << "Kernel Timestamps:\n" << fixed << setprecision(2);
+        kernel_latency.log(out, "RequestLatency(kernel rx->tx)");
+        user_latency.log(out, "RequestLatency(userspace)");
+        pre_read_queue.log(out, "QueueBeforeFirstRead");
+        upstream_kernel.log(out, "UpstreamLatency(kernel)");
+        out.unsetf(ios::floatfield);
+    }
+};
+
+static KernelTimestamps kernel_timestamps;
+static atomic<bool> kernel_timestamping{false};
+
+// W3C Trace Context propagation plus sampled LB-side span export. Unsampled
+// requests only pay for id generation and a traceparent header splice;
+// sampled ones push a handful of fixed-size span records into a lock-free
+// ring that a background thread drains to a JSON-lines file.
+class Tracer {
+public:
+    struct Context {
+        uint8_t trace_id[16];
+        uint8_t span_id[8];    // the LB's own span, sent downstream as parent-id
+        uint8_t parent_id[8];  // the caller's span, when a traceparent came in
+        bool has_parent = false;
+        bool sampled = false;
+    };
+
+private:
+    struct SpanRecord {
+        uint8_t trace_id[16];
+        uint8_t span_id[8];
+        uint8_t parent_id[8];
+        bool has_parent;
+        const char* name;
+        uint64_t start_ns, end_ns;  // steady clock
+        char client[INET6_ADDRSTRLEN];
+        char backend[64];
+    };
+
+    // Bounded MPSC ring (Vyukov-style per-slot sequence numbers). Producers
+    // never block: when the exporter falls behind, spans are dropped.
+    struct Slot {
+        atomic<size_t> seq;
+        SpanRecord span;
+    };
+    static constexpr size_t RING_SIZE = 8192;
+
+    unique_ptr<Slot[]> ring;
+    atomic<size_t> enqueue_pos{0};
+    size_t dequeue_pos = 0;  // exporter thread only
+
+    double sample_rate = 0.0;
+    string path = "spans.jsonl";
+    int64_t unix_offset_ns = 0;
+    atomic<bool> running{false};
+    thread exporter;
+    atomic<uint64_t> exported{0}, dropped{0};
+
+    static mt19937_64& rng() {
+        thread_local mt19937_64 gen(random_device{}());
+        return gen;
+    }
+
+    static void random_bytes(uint8_t* out, size_t n) {
+        do {
+            for (size_t i = 0; i < n; i += 8) {
+                uint64_t r = rng()();
+                memcpy(out + i, &r, min<size_t>(8, n - i));
+            }
+        } while (all_of(out, out + n, [](uint8_t b) { return b == 0; }));
+    }
+
+    static void to_hex(const uint8_t* in, size_t n, char* out) {
+        static const char digits[] = "0123456789abcdef";
+        for (size_t i = 0; i < n; ++i) {
+            out[2 * i] = digits[in[i] >> 4];
+            out[2 * i + 1] = digits[in[i] & 0xf];
+        }
+    }
+
+    static int hex_digit(char c) {
+        return (c >= '0' && c <= '9') ? c - '0' : (c >= 'a' && c <= 'f') ? c - 'a' + 10 : -1;
+    }
+
+    // Decodes n bytes; all-zero ids are invalid per the spec.
+    static bool from_hex(const char* in, size_t n, uint8_t* out) {
+        for (size_t i = 0; i < n; ++i) {
+            int hi = hex_digit(in[2 * i]), lo = hex_digit(in[2 * i + 1]);
+            if (hi < 0 || lo < 0) return false;
+            out[i] = (uint8_t)(hi * 16 + lo);
+        }
+        return !all_of(out, out + n, [](uint8_t b) { return b == 0; });
+    }
+
+    // traceparent: 00-<32 hex trace-id>-<16 hex parent-id>-<2 hex flags>
+    static bool parse_traceparent(const string& v, Context& ctx) {
+        if (v.size() < 55 || v[2] != '-' || v[35] != '-' || v[52] != '-') return false;
+        int ver_hi = hex_digit(v[0]), ver_lo = hex_digit(v[1]);
+        int flags_hi = hex_digit(v[53]), flags_lo = hex_digit(v[54]);
+        if (ver_hi < 0 || ver_lo < 0 || flags_hi < 0 || flags_lo < 0) return false;
+        if (v.compare(0, 2, "ff") == 0 || (v.compare(0, 2, "00") == 0 && v.size() != 55)) return false;
+        if (!from_hex(v.data() + 3, 16, ctx.trace_id) || !from_hex(v.data() + 36, 8, ctx.parent_id)) return false;
+        ctx.has_parent = true;
+        ctx.sampled = (flags_lo & 0x01) != 0;
+        return true;
+    }
+
+    void push(const Context& ctx, const char* name, uint64_t start, uint64_t end, bool root,
+              const string& client, const string& backend) {
+        if (start == 0 || end == 0) return;
+        size_t pos = enqueue_pos.load(memory_order_relaxed);
+        Slot* slot;
+        while (true) {
+            slot = &ring[pos & (RING_SIZE - 1)];
+            size_t seq = slot->seq.load(memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if (diff == 0) {
+                if (enqueue_pos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) break;
+            } else if (diff < 0) {
+                dropped.fetch_add(1, memory_order_relaxed);
+                return;
+            } else {
+                pos = enqueue_pos.load(memory_order_relaxed);
+            }
+        }
+        SpanRecord& sp = slot->span;
+        memcpy(sp.trace_id, ctx.trace_id, sizeof(sp.trace_id));
+        if (root) {
+            memcpy(sp.span_id, ctx.span_id, sizeof(sp.span_id));
+            memcpy(sp.parent_id, ctx.parent_id, sizeof(sp.parent_id));
+            sp.has_parent = ctx.has_parent;
+        } else {
+            random_bytes(sp.span_id, sizeof(sp.span_id));
+            memcpy(sp.parent_id, ctx.span_id, sizeof(sp.parent_id));
+            sp.has_parent = true;
+        }
+        sp.name = name;
+        sp.start_ns = start;
+        sp.end_ns = end;
+        snprintf(sp.client, sizeof(sp.client), "%s", client.c_str());
+        snprintf(sp.backend, sizeof(sp.backend), "%s", backend.c_str());
+        slot->seq.store(pos + 1, memory_order_release);
+    }
+
+    void drain(ostream& out) {
+        while (true) {
+            Slot& slot = ring[dequeue_pos & (RING_SIZE - 1)];
+            if (slot.seq.load(memory_order_acquire) != dequeue_pos + 1) break;
+            const SpanRecord& sp = slot.span;
+            char trace_hex[33] = {}, span_hex[17] = {}, parent_hex[17] = {};
+            to_hex(sp.trace_id, 16, trace_hex);
+            to_hex(sp.span_id, 8, span_hex);
+            if (sp.has_parent) to_hex(sp.parent_id, 8, parent_hex);
+            out << "{\"trace_id\":\"" << trace_hex << "\",\"span_id\":\"" << span_hex
+                << "\",\"parent_span_id\":\"" << parent_hex << "\",\"name\":\"" << sp.name
+                << "\",\"start_time_unix_nano\":" << (int64_t)sp.start_ns + unix_offset_ns
+                << ",\"end_time_unix_nano\":" << (int64_t)sp.end_ns + unix_offset_ns
+                << ",\"attributes\":{\"lb.backend\":\"" << sp.backend
+                << "\",\"client.address\":\"" << sp.client << "\"}}\n";
+            slot.seq.store(dequeue_pos + RING_SIZE, memory_order_release);
+            ++dequeue_pos;
+            exported.fetch_add(1, memory_order_relaxed);
+        }
+        out.flush();
+    }
+
+public:
+    Tracer() {
+        ring.reset(new Slot[RING_SIZE]);
+        for (size_t i = 0; i < RING_SIZE; ++i) ring[i].seq.store(i, memory_order_relaxed);
+    }
+
+    void configure(double rate, const string& file) {
+        sample_rate = max(0.0, min(1.0, rate));
+        if (!file.empty()) path = file;
+    }
+
+    bool enabled() const { return sample_rate > 0.0; }
+
+    void start() {
+        if (!enabled()) return;
+        unix_offset_ns = (int64_t)chrono::duration_cast<chrono::nanoseconds>(
+                             chrono::system_clock::now().time_since_epoch()).count() - (int64_t)mono_ns();
+        running = true;
+        exporter = thread([this]() {
+            ofstream out(path, ios::app);
+            while (running) {
+                this_thread::sleep_for(chrono::seconds(1));
+                drain(out);
+            }
+            drain(out);
+        });
+    }
+
+    void stop() {
+        running = false;
+        if (exporter.joinable()) exporter.join();
+    }
+
+    // Continues the caller's trace when a valid traceparent came in (honouring
+    // its sampled flag), otherwise starts a new one sampled at sample_rate.
+    Context begin(const string& incoming) {
+        Context ctx;
+        if (!parse_traceparent(incoming, ctx)) {
+            random_bytes(ctx.trace_id, sizeof(ctx.trace_id));
+            ctx.has_parent = false;
+            ctx.sampled = uniform_real_distribution<double>(0.0, 1.0)(rng()) < sample_rate;
+        }
+        random_bytes(ctx.span_id, sizeof(ctx.span_id));
+        return ctx;
+    }
+
+    static string traceparent(const Context& ctx) {
+        char buf[56];
+        memcpy(buf, "00-", 3);
+        to_hex(ctx.trace_id, 16, buf + 3);
+        buf[35] = '-';
+        to_hex(ctx.span_id, 8, buf + 36);
+        memcpy(buf + 52, ctx.sampled ? "-01" : "-00", 3);
+        return string(buf, 55);
+    }
+
+    void record(const Context& ctx, const RequestTimings& t, const string& client, const string& backend) {
+        push(ctx, "lb.request", t.accepted, t.finished, true, client, backend);
+        push(ctx, "lb.queue", t.accepted, t.started, false, client, backend);
+        push(ctx, "lb.select", t.head_read, t.selected, false, client, backend);
+        push(ctx, "lb.connect", t.selected, t.connected, false, client, backend);
+        push(ctx, "lb.upstream_wait", t.request_sent, t.first_byte, false, client, backend);
+    }
+
+    void log_status(ostream& out) {
+        out << "Tracing:\nSampleRate: " << sample_rate << " Exported: " << exported.load()
+            << " Dropped: " << dropped.load() << " File: " << path << "\n";
+    }
+};
+
+static Tracer tracer;
+
+static atomic<bool> lock_profiling{false};
+
+// Drop-in std::mutex replacement that, while --lock-profile is on, records
+// acquisition counts, how long callers waited (as a decade histogram) and how
+// long the lock was held. With profiling off it costs one relaxed load.
+class ProfiledMutex {
+    static constexpr int WAIT_BUCKETS = 6;  // <1us, <10us, <100us, <1ms, <10ms, >=10ms
+
+    mutex m;
+    const char* name;
+    chrono::steady_clock::time_point acquired_at;  // guarded by m
+    bool timed = false;                             // guarded by m
+
+    atomic<uint64_t> acquisitions{0}, contended{0};
+    atomic<uint64_t> wait_ns{0}, max_wait_ns{0}, hold_ns{0}, max_hold_ns{0};
+    atomic<uint64_t> wait_hist[WAIT_BUCKETS] = {};
+
+    static mutex& registry_mutex() { static mutex rm; return rm; }
+    static vector<ProfiledMutex*>& registry() { static vector<ProfiledMutex*> r; return r; }
+
+    static void update_max(atomic<uint64_t>& target, uint64_t value) {
+        uint64_t cur = target.load(memory_order_relaxed);
+        while (value > cur && !target.compare_exchange_weak(cur, value, memory_order_relaxed)) {}
+    }
+
+    static uint64_t elapsed_ns(chrono::steady_clock::time_point since) {
+        return (uint64_t)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - since).count();
+    }
+
+public:
+    explicit ProfiledMutex(const char* lock_name): name(lock_name) {
+        lock_guard<mutex> lock(registry_mutex());
+        registry().push_back(this);
+    }
+
+    ~ProfiledMutex() {
+        lock_guard<mutex> lock(registry_mutex());
+        auto& r = registry();
+        r.erase(std::remove(r.begin(), r.end(), this), r.end());
+    }
+
+    ProfiledMutex(const ProfiledMutex&) = delete;
+    ProfiledMutex& operator=(const ProfiledMutex&) = delete;
+
+    void lock() {
+        if (!lock_profiling.load(memory_order_relaxed)) {
+            m.lock();
+            timed = false;
+            return;
+        }
+        uint64_t waited = 0;
+        if (!m.try_lock()) {
+            auto start = chrono::steady_clock::now();
+            m.lock();
+            waited = elapsed_ns(start);
+            contended.fetch_add(1, memory_order_relaxed);
+            wait_ns.fetch_add(waited, memory_order_relaxed);
+            update_max(max_wait_ns, waited);
+        }
+        int bucket = 0;
+        for (uint64_t limit = 1000; bucket < WAIT_BUCKETS - 1 && waited >= limit; limit *= 10) ++bucket;
+        wait_hist[bucket].fetch_add(1, memory_order_relaxed);
+        acquisitions.fetch_add(1, memory_order_relaxed);
+        timed = true;
+        acquired_at = chrono::steady_clock::now();
+    }
+
+    bool try_lock() {
+        if (!m.try_lock()) return false;
+        timed = lock_profiling.load(memory_order_relaxed);
+        if (timed) {
+            acquisitions.fetch_add(1, memory_order_relaxed);
+            wait_hist[0].fetch_add(1, memory_order_relaxed);
+            acquired_at = chrono::steady_clock::now();
+        }
+        return true;
+    }
+
+    void unlock() {
+        if (timed) {
+            uint64_t held = elapsed_ns(acquired_at);
+            hold_ns.fetch_add(held, memory_order_relaxed);
+            update_max(max_hold_ns, held);
+        }
+        m.unlock();
+    }
+
+    static void log_status(ostream& out) {
+        static const char* bucket_names[WAIT_BUCKETS] = {"<1us", "<10us", "<100us", "<1ms", "<10ms", ">=10ms"};
+        lock_guard<mutex> lock(registry_mutex());
+        out << "Lock Contention:\n" << fixed << setprecision(2);
+        for (ProfiledMutex* pm : registry()) {
+            uint64_t acq = pm->acquisitions.load(memory_order_relaxed);
+            uint64_t cont = pm->contended.load(memory_order_relaxed);
+            out << pm->name << " Acquired: " << acq << " Contended: " << cont
+                << " WaitTotal(us): " << pm->wait_ns.load(memory_order_relaxed) / 1000.0
+                << " WaitMax(us): " << pm->max_wait_ns.load(memory_order_relaxed) / 1000.0
+                << " HoldAvg(us): " << (acq ? pm->hold_ns.load(memory_order_relaxed) / 1000.0 / acq : 0.0)
+                << " HoldMax(us): " << pm->max_hold_ns.load(memory_order_relaxed) / 1000.0
+                << " Wait";
+            for (int b = 0; b < WAIT_BUCKETS; ++b)
+                out << " " << bucket_names[b] << ": " << pm->wait_hist[b].load(memory_order_relaxed);
+            out << "\n";
+        }
+        out.unsetf(ios::floatfield);
+    }
+};
+
+// Resolved backend address plus cold metadata. Addresses are parsed or
+// resolved once, so connects never touch the configured string.
+struct BackendEndpoint {
+    string host;   // as configured: IP literal or hostname
+    int port = 0;
+    string label;  // "ip:port", or "host/ip:port" for hostname backends
+    sockaddr_storage addr{};
+    socklen_t addr_len = 0;
+    bool tls = false;  // tls:// backend
+
+    void assign(const string& h, int p, const sockaddr* sa, socklen_t len, bool use_tls) {
+        host = h;
+        port = p;
+        tls = use_tls;
+        memcpy(&addr, sa, len);
+        addr_len = len;
+        if (addr.ss_family == AF_INET) ((sockaddr_in*)&addr)->sin_port = htons(p);
+        else ((sockaddr_in6*)&addr)->sin6_port = htons(p);
+        string ip = address();
+        label = (tls ? "tls://" : "") + (ip == h ? "" : h + "/") + (addr.ss_family == AF_INET6 ? "[" + ip + "]" : ip) +
+                ":" + to_string(p);
+    }
+
+    string address() const {
+        char buf[INET6_ADDRSTRLEN] = "";
+        if (addr.ss_family == AF_INET) inet_ntop(AF_INET, &((const sockaddr_in*)&addr)->sin_addr, buf, sizeof(buf));
+        else inet_ntop(AF_INET6, &((const sockaddr_in6*)&addr)->sin6_addr, buf, sizeof(buf));
+        return buf;
+    }
+
+    bool same_ip(const sockaddr* sa) const {
+        if (sa->sa_family != addr.ss_family) return false;
+        if (sa->sa_family == AF_INET)
+            return ((const sockaddr_in*)sa)->sin_addr.s_addr == ((const sockaddr_in*)&addr)->sin_addr.s_addr;
+        return memcmp(&((const sockaddr_in6*)sa)->sin6_addr, &((const sockaddr_in6*)&addr)->sin6_addr, 16) == 0;
+    }
+
+    // IP literal to sockaddr; false for hostnames
+    static bool parse_literal(const string& h, sockaddr_storage& out, socklen_t& len) {
+        out = sockaddr_storage{};
+        sockaddr_in* v4 = (sockaddr_in*)&out;
+        sockaddr_in6* v6 = (sockaddr_in6*)&out;
+        if (inet_pton(AF_INET, h.c_str(), &v4->sin_addr) == 1) {
+            v4->sin_family = AF_INET;
+            len = sizeof(sockaddr_in);
+            return true;
+        }
+        if (inet_pton(AF_INET6, h.c_str(), &v6->sin6_addr) == 1) {
+            v6->sin6_family = AF_INET6;
+            len = sizeof(sockaddr_in6);
+            return true;
+        }
+        return false;
+    }
+
+    // Blocking socket connected to the endpoint, or -1
+    int connect_socket() const {
+        if (!addr_len) return -1;
+        int fd = ::socket(addr.ss_family, SOCK_STREAM, 0);
+        if (fd == -1) return -1;
+        if (::connect(fd, (const sockaddr*)&addr, addr_len) == -1) {
+            ::close(fd);
+            return -1;
+        }
+        return fd;
+    }
+};
+
+// Backends live in a fixed-capacity slot table. Slots are only appended
+// (under slots_mutex, off the data path) and published by bumping count, so
+// request threads index them without locking. A hostname record that drops
+// out of DNS disables its slot rather than freeing it; if the address comes
+// back, the slot is re-enabled.
 class BackendManager {
 public:
-    vector<pair<string, int>> backend_servers = {
-        {"127.0.0.1", 9001},
-        {"127.0.0.1", 9002},
-        {"127.0.0.1", 9003}
-    };
+    static constexpr size_t MAX_BACKENDS = 64;
+
+    // Per-backend fields read or written on every request. One cache line
+    // per backend, so counters bumped by different threads never share one.
+    struct alignas(64) Hot {
+        atomic<bool> healthy{true};
+        atomic<bool> enabled{false};  // false until published, or once retired from DNS
+        atomic<int> active{0};
+        atomic<uint64_t> requests{0};
+        // Kernel-measured path quality from TCP_INFO on backend connections
+        atomic<uint32_t> srtt_us{0};  // EWMA of tcpi_rtt, 0 until the first sample
+        atomic<uint32_t> rttvar_us{0};
+        atomic<uint32_t> cwnd{0};
+        atomic<uint64_t> tcp_samples{0};
+        atomic<uint64_t> retransmits{0};  // summed over closed connections
+    };
+
+private:
+    unique_ptr<BackendEndpoint[]> endpoints{new BackendEndpoint[MAX_BACKENDS]};
+    unique_ptr<Hot[]> hot{new Hot[MAX_BACKENDS]};
+    atomic<size_t> count{0};
+    ProfiledMutex slots_mutex{"slots_mutex"};
+
+public:
+    // Slot for host/port at this address, adding one if needed. -1 if full.
+    int add_endpoint(const string& host, int port, const sockaddr* sa, socklen_t len, bool tls = false) {
+        lock_guard<ProfiledMutex> lock(slots_mutex);
+        size_t n = count.load(memory_order_relaxed);
+        for (size_t i = 0; i < n; ++i) {
+            const BackendEndpoint& ep = endpoints[i];
+            if (ep.host == host && ep.port == port && ep.tls == tls && ep.same_ip(sa)) {
+                hot[i].enabled.store(true, memory_order_relaxed);
+                return (int)i;
+            }
+        }
+        if (n == MAX_BACKENDS) return -1;
+        endpoints[n].assign(host, port, sa, len, tls);
+        hot[n].enabled.store(true, memory_order_relaxed);
+        count.store(n + 1, memory_order_release);
+        return (int)n;
+    }
+
+    void set_enabled(int index, bool enabled) {
+        hot[index].enabled.store(enabled, memory_order_relaxed);
+    }
+
+    bool is_enabled(int index) const { return hot[index].enabled.load(memory_order_relaxed); }
+    bool is_healthy(int index) const { return hot[index].healthy.load(memory_order_relaxed); }
+    size_t size() const { return count.load(memory_order_acquire); }
+    const BackendEndpoint& endpoint(int index) const { return endpoints[index]; }
+
+    // Per-backend connection limit (--max-conns); 0 = unlimited
+    atomic<int> max_active{0};
+
+    // Healthy backends below their connection limit, or all healthy ones if
+    // every backend is full
+    vector<int> get_available_indices() {
+        vector<int> healthy = get_healthy_indices();
+        int limit = max_active.load(memory_order_relaxed);
+        if (!limit) return healthy;
+        vector<int> available;
+        for (int idx : healthy)
+            if (hot[idx].active.load(memory_order_relaxed) < limit) available.push_back(idx);
+        return available.empty() ? healthy : available;
+    }
+
+    vector<int> get_healthy_indices() {
+        size_t n = size();
+        vector<int> indices;
+        indices.reserve(n);
+        for (size_t i = 0; i < n; ++i)
+            if (hot[i].healthy.load(memory_order_relaxed) && hot[i].enabled.load(memory_order_relaxed))
+                indices.push_back((int)i);
+        return indices;
+    }
+
+    void set_health(int index, bool healthy) {
+        hot[index].healthy.store(healthy, memory_order_relaxed);
+    }
+
+    void increment_requests(int index) {
+        hot[index].requests.fetch_add(1, memory_order_relaxed);
+    }
+
+    void increment_active(int index) {
+        hot[index].active.fetch_add(1, memory_order_relaxed);
+    }
+
+    void decrement_active(int index) {
+        hot[index].active.fetch_sub(1, memory_order_relaxed);
+    }
+
+    int get_least_connection_backend(const vector<int>& healthy) {
+        int min_conn = INT_MAX, selected = -1;
+        for (int idx : healthy) {
+            int active = hot[idx].active.load(memory_order_relaxed);
+            if (active < min_conn) {
+                min_conn = active;
+                selected = idx;
+            }
+        }
+        return selected;
+    }
+
+    // Runs on every connection release, so it only touches the slot's atomics
+    void record_tcp_info(int index, const tcp_info& ti) {
+        Hot& h = hot[index];
+        uint32_t rtt = max<uint32_t>(ti.tcpi_rtt, 1);
+        uint32_t old = h.srtt_us.load(memory_order_relaxed), next;
+        do {
+            next = old ? (uint32_t)((4ULL * old + rtt) / 5) : rtt;
+        } while (!h.srtt_us.compare_exchange_weak(old, next, memory_order_relaxed));
+        h.rttvar_us.store(ti.tcpi_rttvar, memory_order_relaxed);
+        h.cwnd.store(ti.tcpi_snd_cwnd, memory_order_relaxed);
+        h.tcp_samples.fetch_add(1, memory_order_relaxed);
+    }
+
+    void add_retransmits(int index, uint32_t count) {
+        hot[index].retransmits.fetch_add(count, memory_order_relaxed);
+    }
+
+    // Lowest kernel RTT scaled by load; backends without samples go first
+    int get_lowest_rtt_backend(const vector<int>& healthy) {
+        double best = 0;
+        int selected = -1;
+        for (int idx : healthy) {
+            const Hot& h = hot[idx];
+            double score = (h.srtt_us.load(memory_order_relaxed) + 1.0) *
+                           (h.active.load(memory_order_relaxed) + 1);
+            if (selected == -1 || score < best) {
+                best = score;
+                selected = idx;
+            }
+        }
+        return selected;
+    }
+
+    void log_status(ostream& out) {
+        for (size_t i = 0; i < size(); ++i) {
+            const Hot& h = hot[i];
+            string status = !h.enabled ? "retired" : h.healthy ? "healthy" : "unhealthy";
+            out << endpoints[i].label << " [" << status << "] Requests: "
+                << h.requests << " Active: " << h.active;
+            if (h.tcp_samples.load(memory_order_relaxed))
+                out << " RTT(us): " << h.srtt_us << " RTTVar(us): " << h.rttvar_us << " Cwnd: " << h.cwnd;
+            out << " Retrans: " << h.retransmits << "\n";
+        }
+    }
+};
+
+// Resolves hostname backends (--backend=name:port) on its own thread, so
+// lookups never block request handling. getaddrinfo supplies the addresses
+// (honouring /etc/hosts) and every A/AAAA record becomes its own backend
+// slot. The TTL comes from a res_nquery of the same name, clamped to
+// [MIN_TTL, MAX_TTL]; names with no DNS answer (e.g. /etc/hosts entries)
+// use DEFAULT_TTL. If a lookup fails, the previous addresses stay in
+// service and the name is retried after RETRY_SECONDS.
+class DnsResolver {
+    static constexpr uint32_t MIN_TTL = 5, MAX_TTL = 300, DEFAULT_TTL = 30, RETRY_SECONDS = 5;
+
+    struct Name {
+        string host;
+        int port;
+        bool tls;
+        vector<int> slots;  // slots currently published for this name
+        uint32_t ttl = 0;
+        uint64_t expires_ns = 0;
+        uint64_t resolutions = 0, failures = 0;
+        string last_error;
+    };
+
+    BackendManager* manager = nullptr;
+    vector<Name> names;
+    mutex names_mutex;  // names' bookkeeping vs log_status
+    atomic<bool> running{false};
+    thread worker;
+    mutex wake_mutex;
+    condition_variable wake;
+
+    // Smallest TTL over the A and AAAA answers, 0 if DNS has none
+    static uint32_t query_ttl(const string& host) {
+        struct __res_state st{};
+        if (res_ninit(&st) != 0) return 0;
+        st.retrans = 1;
+        st.retry = 1;
+        uint32_t ttl = 0;
+        for (int type : {ns_t_a, ns_t_aaaa}) {
+            unsigned char answer[4096];
+            int len = res_nquery(&st, host.c_str(), ns_c_in, type, answer, sizeof(answer));
+            ns_msg msg;
+            if (len <= 0 || ns_initparse(answer, len, &msg) != 0) continue;
+            for (int i = 0; i < ns_msg_count(msg, ns_s_an); ++i) {
+                ns_rr rr;
+                if (ns_parserr(&msg, ns_s_an, i, &rr) == 0 && ns_rr_type(rr) == type)
+                    ttl = ttl ? min(ttl, (uint32_t)ns_rr_ttl(rr)) : (uint32_t)ns_rr_ttl(rr);
+            }
+        }
+        res_nclose(&st);
+        return ttl;
+    }
+
+    void resolve(Name& name) {
+        addrinfo hints{};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo* res = nullptr;
+        int rc = getaddrinfo(name.host.c_str(), nullptr, &hints, &res);
+        if (rc != 0) {
+            lock_guard<mutex> lock(names_mutex);
+            name.failures++;
+            name.last_error = gai_strerror(rc);
+            name.expires_ns = mono_ns() + RETRY_SECONDS * 1000000000ULL;
+            cerr << "DNS lookup for " << name.host << " failed: " << name.last_error << "\n";
+            return;
+        }
+        vector<int> slots;
+        for (addrinfo* ai = res; ai; ai = ai->ai_next) {
+            int slot = manager->add_endpoint(name.host, name.port, ai->ai_addr, ai->ai_addrlen, name.tls);
+            if (slot == -1) cerr << "Backend table full; ignoring an address of " << name.host << "\n";
+            else if (find(slots.begin(), slots.end(), slot) == slots.end()) slots.push_back(slot);
+        }
+        freeaddrinfo(res);
+        for (int old : name.slots)
+            if (find(slots.begin(), slots.end(), old) == slots.end()) manager->set_enabled(old, false);
+
+        uint32_t ttl = query_ttl(name.host);
+        ttl = ttl ? min(max(ttl, MIN_TTL), MAX_TTL) : DEFAULT_TTL;
+        lock_guard<mutex> lock(names_mutex);
+        name.slots = slots;
+        name.ttl = ttl;
+        name.expires_ns = mono_ns() + ttl * 1000000000ULL;
+        name.resolutions++;
+        name.last_error.clear();
+    }
+
+    // Re-resolves expired names; returns ns until the next expiry
+    uint64_t refresh() {
+        uint64_t next = RETRY_SECONDS * 1000000000ULL;
+        for (Name& name : names) {
+            uint64_t now = mono_ns();
+            if (name.expires_ns <= now) resolve(name);
+            now = mono_ns();
+            next = min(next, name.expires_ns > now ? name.expires_ns - now : 0);
+        }
+        return next;
+    }
+
+public:
+    void add(const string& host, int port, bool tls) { names.push_back({host, port, tls}); }
+    bool enabled() const { return !names.empty(); }
+
+    // First pass runs inline so hostname backends are in place before the
+    // listener accepts.
+    void start(BackendManager* mgr) {
+        if (names.empty()) return;
+        manager = mgr;
+        refresh();
+        running = true;
+        worker = thread([this]() {
+            uint64_t wait_ns = 0;
+            while (running) {
+                {
+                    unique_lock<mutex> lock(wake_mutex);
+                    if (wake.wait_for(lock, chrono::nanoseconds(max<uint64_t>(wait_ns, 100000000ULL)),
+                                      [this]() { return !running; })) break;
+                }
+                wait_ns = refresh();
+            }
+        });
+    }
+
+    void stop() {
+        if (!running.exchange(false)) return;
+        {
+            lock_guard<mutex> lock(wake_mutex);
+        }
+        wake.notify_all();
+        if (worker.joinable()) worker.join();
+    }
+
+    void log_status(ostream& out) {
+        lock_guard<mutex> lock(names_mutex);
+        uint64_t now = mono_ns();
+        out << "DNS:\n";
+        for (const Name& name : names) {
+            out << name.host << ":" << name.port << " Addresses: " << name.slots.size()
+                << " TTL(s): " << name.ttl
+                << " ExpiresIn(s): " << (name.expires_ns > now ? (name.expires_ns - now) / 1000000000ULL : 0)
+                << " Resolutions: " << name.resolutions << " Failures: " << name.failures;
+            if (!name.last_error.empty()) out << " LastError: " << name.last_error;
+            out << "\n";
+        }
+    }
+};
+
+static DnsResolver dns_resolver;
+
+// Blocking writes that finish the whole buffer; false once the peer is gone
+static bool send_all(int fd, const char* buf, size_t len) {
+    size_t sent = 0;
+    while (sent < len) {
+        ssize_t n = ::send(fd, buf + sent, len - sent, MSG_NOSIGNAL);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        sent += (size_t)n;
+    }
+    return true;
+}
+
+static bool send_iov(int fd, iovec* iov, int count) {
+    while (count > 0) {
+        msghdr msg{};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = (size_t)count;
+        ssize_t n = ::sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        while (count > 0 && (size_t)n >= iov->iov_len) {
+            n -= (ssize_t)iov->iov_len;
+            ++iov;
+            --count;
+        }
+        if (count > 0) {
+            iov->iov_base = (char*)iov->iov_base + n;
+            iov->iov_len -= (size_t)n;
+        }
+    }
+    return true;
+}
+
+#ifdef LB_WITH_TLS
+// TLS to tls:// backends (built with make TLS=1). The handshake runs in
+// userspace with a per-backend cached session, so reconnects resume instead
+// of doing a full handshake. Afterwards the connection is handed to the rest
+// of the proxy as a plain fd, one of two ways:
+//  - kTLS (--upstream-ktls): the kernel takes over record encryption and
+//    the TCP socket itself is returned. TLS 1.2 is negotiated in this mode
+//    so that no post-handshake messages reach the kernel-owned stream.
+//  - otherwise a socketpair bridged by a pump thread running
+//    SSL_read/SSL_write. The thread lives as long as the pooled
+//    connection, so its cost is paid once per connection, not per request.
+class UpstreamTls {
+    SSL_CTX* ctx = nullptr;
+    bool want_ktls = false;
+    bool verify = false;
+    mutex session_mutex;
+    SSL_SESSION* sessions[BackendManager::MAX_BACKENDS] = {};
+    static int ex_index;
+
+    static int on_new_session(SSL* ssl, SSL_SESSION* session);
+
+    // Moves bytes between the app end of the socketpair and the TLS session
+    // until either side closes. Auto-retry is off, so a non-application
+    // record (e.g. a TLS 1.3 session ticket) returns to the poll loop
+    // instead of blocking the pump.
+    static void pump(SSL* ssl, int tcp_fd, int app_fd) {
+        char buf[16384];
+        bool open = true;
+        while (open) {
+            pollfd pfd[2] = {{tcp_fd, POLLIN, 0}, {app_fd, POLLIN, 0}};
+            if (SSL_pending(ssl) == 0 && ::poll(pfd, 2, -1) == -1) {
+                if (errno == EINTR) continue;
+                break;
+            }
+            if (SSL_pending(ssl) > 0 || (pfd[0].revents & (POLLIN | POLLHUP | POLLERR))) {
+                int n = SSL_read(ssl, buf, sizeof(buf));
+                if (n > 0) open = send_all(app_fd, buf, (size_t)n);
+                else open = SSL_get_error(ssl, n) == SSL_ERROR_WANT_READ;
+            }
+            if (open && (pfd[1].revents & (POLLIN | POLLHUP | POLLERR))) {
+                ssize_t n;
+                do n = ::recv(app_fd, buf, sizeof(buf), 0); while (n == -1 && errno == EINTR);
+                open = n > 0 && SSL_write(ssl, buf, (int)n) == (int)n;
+            }
+        }
+        SSL_shutdown(ssl);
+        SSL_free(ssl);
+        ::close(tcp_fd);
+        ::close(app_fd);
+    }
+
+public:
+    atomic<uint64_t> handshakes{0}, resumed{0}, ktls{0}, bridged{0}, failures{0};
+
+    // ca_file: verify backends against it, and against their name or IP
+    // address; empty disables verification. kTLS here is TLS 1.2 only, so
+    // use_ktls caps every backend connection at 1.2.
+    bool init(bool use_ktls, const string& ca_file) {
+        ctx = SSL_CTX_new(TLS_client_method());
+        if (!ctx) return false;
+        want_ktls = use_ktls;
+        SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+        if (want_ktls) {
+            SSL_CTX_set_max_proto_version(ctx, TLS1_2_VERSION);
+            SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+        }
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+        SSL_CTX_sess_set_new_cb(ctx, on_new_session);
+        ex_index = SSL_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+        if (!ca_file.empty()) {
+            if (SSL_CTX_load_verify_locations(ctx, ca_file.c_str(), nullptr) != 1) return false;
+            SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, nullptr);
+            verify = true;
+        }
+        return true;
+    }
+
+    bool enabled() const { return ctx != nullptr; }
+
+    void save_session(int index, SSL_SESSION* session) {
+        lock_guard<mutex> lock(session_mutex);
+        if (sessions[index]) SSL_SESSION_free(sessions[index]);
+        sessions[index] = session;
+    }
+
+    // Runs the handshake on a connected socket and returns the session, or
+    // nullptr; tcp_fd stays the caller's either way. Short exchanges such as
+    // health probes use the SSL* directly and SSL_free it, with no relay.
+    SSL* handshake(int tcp_fd, int index, const BackendEndpoint& ep) {
+        SSL* ssl = SSL_new(ctx);
+        SSL_set_fd(ssl, tcp_fd);
+        SSL_set_ex_data(ssl, ex_index, (void*)(intptr_t)index);
+        SSL_clear_mode(ssl, SSL_MODE_AUTO_RETRY);
+        sockaddr_storage literal;
+        socklen_t literal_len;
+        bool is_name = !BackendEndpoint::parse_literal(ep.host, literal, literal_len);
+        if (is_name) SSL_set_tlsext_host_name(ssl, ep.host.c_str());
+        // The certificate must name the backend: a DNS name, or an IP SAN for literals
+        if (verify && is_name) SSL_set1_host(ssl, ep.host.c_str());
+        else if (verify) X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), ep.host.c_str());
+        {
+            lock_guard<mutex> lock(session_mutex);
+            if (sessions[index]) SSL_set_session(ssl, sessions[index]);
+        }
+        handshakes.fetch_add(1, memory_order_relaxed);
+        if (SSL_connect(ssl) != 1) {
+            failures.fetch_add(1, memory_order_relaxed);
+            ERR_clear_error();
+            SSL_free(ssl);
+            // A session the backend rejects outright is not worth retrying
+            save_session(index, nullptr);
+            return nullptr;
+        }
+        if (SSL_session_reused(ssl)) resumed.fetch_add(1, memory_order_relaxed);
+        return ssl;
+    }
+
+    // Handshake for a long-lived (pooled) connection. Returns the fd the
+    // proxy should use from now on, or -1 (tcp_fd is closed) on failure.
+    int wrap(int tcp_fd, int index, const BackendEndpoint& ep) {
+        SSL* ssl = handshake(tcp_fd, index, ep);
+        if (!ssl) {
+            ::close(tcp_fd);
+            return -1;
+        }
+
+#ifndef OPENSSL_NO_KTLS
+        if (want_ktls && BIO_get_ktls_send(SSL_get_wbio(ssl)) && BIO_get_ktls_recv(SSL_get_rbio(ssl))) {
+            // The kernel owns the record layer now; the socket BIO does not close tcp_fd
+            SSL_free(ssl);
+            ktls.fetch_add(1, memory_order_relaxed);
+            return tcp_fd;
+        }
+#endif
+        int pair[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) == -1) {
+            SSL_free(ssl);
+            ::close(tcp_fd);
+            return -1;
+        }
+        bridged.fetch_add(1, memory_order_relaxed);
+        std::thread(pump, ssl, tcp_fd, pair[1]).detach();
+        return pair[0];
+    }
+
+    void log_status(ostream& out) {
+        out << "Upstream TLS:\n"
+            << "Handshakes: " << handshakes << " Resumed: " << resumed << " KTLS: " << ktls
+            << " Bridged: " << bridged << " Failures: " << failures << "\n";
+    }
+};
+
+int UpstreamTls::ex_index = -1;
+static UpstreamTls upstream_tls;
+
+int UpstreamTls::on_new_session(SSL* ssl, SSL_SESSION* session) {
+    upstream_tls.save_session((int)(intptr_t)SSL_get_ex_data(ssl, ex_index), session);
+    return 1;  // we keep the reference
+}
+#endif
+
+// Defined once every reporting component is declared.
+static void write_status(BackendManager* manager, ostream& out);
+
+static bool set_timeouts(int fd, int sec=2) {
+    timeval tv{sec, 0};
+    return setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == 0 &&
+           setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) == 0;
+}
+
+// Keep-alive connections to backends, reused across client requests. Idle
+// connections are dropped before the backend's own idle timeout (5s for
+// backend_server) and probed for EOF before reuse. TCP_INFO is read from
+// connections as they are returned, and periodically from idle ones, to
+// feed per-backend RTT into BackendManager.
+class ConnectionPool {
+    struct IdleConn {
+        int fd;
+        uint64_t idle_since;
+    };
+
+    BackendManager* manager;
+    size_t max_idle;
+    uint64_t idle_timeout_ns = 4000000000ULL;
+    ProfiledMutex pool_mutex{"pool_mutex"};
+    vector<vector<IdleConn>> idle;  // per backend, most recently used last
+
+    void sample(int index, int fd) {
+        tcp_info ti{};
+        socklen_t len = sizeof(ti);
+        if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &ti, &len) == 0) manager->record_tcp_info(index, ti);
+    }
+
+    // Closes a backend connection, crediting its retransmits to the backend
+    void close_conn(int index, int fd) {
+        tcp_info ti{};
+        socklen_t len = sizeof(ti);
+        if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &ti, &len) == 0 && ti.tcpi_total_retrans)
+            manager->add_retransmits(index, ti.tcpi_total_retrans);
+        ::close(fd);
+    }
+
+    static bool still_open(int fd) {
+        char c;
+        ssize_t n = ::recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+        return n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+    }
+
+public:
+    ConnectionPool(BackendManager* mgr, size_t max_idle_per_backend)
+        : manager(mgr), max_idle(max_idle_per_backend), idle(BackendManager::MAX_BACKENDS) {}
+
+    ~ConnectionPool() {
+        for (size_t i = 0; i < idle.size(); ++i)
+            for (const IdleConn& c : idle[i]) close_conn((int)i, c.fd);
+    }
+
+    bool enabled() const { return max_idle > 0; }
+
+    int connect(int index) {
+        PerfStageScope perf_scope(ProxyStage::CONNECT);
+        const BackendEndpoint& ep = manager->endpoint(index);
+        int fd = ep.connect_socket();
+        if (fd == -1) return -1;
+        set_timeouts(fd, 10);
+        int tcp_fd = fd;
+#ifdef LB_WITH_TLS
+        if (ep.tls) {
+            fd = upstream_tls.wrap(tcp_fd, index, ep);
+            if (fd != tcp_fd && fd != -1) set_timeouts(fd, 10);
+        }
+#endif
+        // A bridged TLS connection hands us the socketpair end, whose
+        // timestamps say nothing about the network; only time real TCP
+        if (kernel_timestamping && fd == tcp_fd) KernelTimestamps::enable(fd);
+        return fd;
+    }
+
+    // An idle pooled connection if one is usable, else a new one.
+    int acquire(int index, bool& reused) {
+        uint64_t now = mono_ns();
+        while (enabled()) {
+            IdleConn c;
+            {
+                lock_guard<ProfiledMutex> lock(pool_mutex);
+                if (idle[index].empty()) break;
+                c = idle[index].back();
+                idle[index].pop_back();
+            }
+            if (now - c.idle_since < idle_timeout_ns && still_open(c.fd)) {
+                reused = true;
+                return c.fd;
+            }
+            close_conn(index, c.fd);
+        }
+        reused = false;
+        return connect(index);
+    }
+
+    // Returns a connection after a request; keep it only if the exchange
+    // left it reusable and there is room.
+    void release(int index, int fd, bool reusable) {
+        sample(index, fd);
+        if (reusable && enabled()) {
+            lock_guard<ProfiledMutex> lock(pool_mutex);
+            if (idle[index].size() < max_idle) {
+                idle[index].push_back({fd, mono_ns()});
+                return;
+            }
+        }
+        close_conn(index, fd);
+    }
+
+    void discard(int index, int fd) { close_conn(index, fd); }
+
+    size_t idle_count(int index) {
+        lock_guard<ProfiledMutex> lock(pool_mutex);
+        return idle[index].size();
+    }
+
+    size_t max_idle_per_backend() const { return max_idle; }
+
+    // Drops every idle connection to a backend (e.g. when it turns unhealthy).
+    void drop(int index) {
+        vector<IdleConn> victims;
+        {
+            lock_guard<ProfiledMutex> lock(pool_mutex);
+            victims.swap(idle[index]);
+        }
+        for (const IdleConn& c : victims) close_conn(index, c.fd);
+    }
+
+    // Periodic pass from the health checker: expire idle connections and
+    // sample TCP_INFO on the ones that remain.
+    void maintain() {
+        uint64_t now = mono_ns();
+        for (size_t i = 0; i < idle.size(); ++i) {
+            vector<IdleConn> expired;
+            {
+                lock_guard<ProfiledMutex> lock(pool_mutex);
+                auto& list = idle[i];
+                for (auto it = list.begin(); it != list.end();) {
+                    if (now - it->idle_since >= idle_timeout_ns) {
+                        expired.push_back(*it);
+                        it = list.erase(it);
+                    } else {
+                        sample((int)i, it->fd);
+                        ++it;
+                    }
+                }
+            }
+            for (const IdleConn& c : expired) close_conn((int)i, c.fd);
+        }
+    }
+};
+
+// Also prewarms the pool: a backend that is healthy at startup, or that
+// turns healthy again, gets --prewarm keep-alive connections opened ahead
+// of traffic, each optionally primed with a GET of --warmup-path.
+class HealthChecker {
+    BackendManager* manager;
+    ConnectionPool* pool;
+    size_t prewarm_count = 0;
+    string warmup_path;
+    vector<bool> was_healthy = vector<bool>(BackendManager::MAX_BACKENDS, false);
+    atomic<bool> running{true};
+    thread worker;
+    mutex wake_mutex;
+    condition_variable wake;
+
+    static bool read_some(int fd, string& out) {
+        char buf[1024];
+        ssize_t n;
+        do n = ::recv(fd, buf, sizeof(buf), 0); while (n == -1 && errno == EINTR);
+        if (n <= 0) return false;
+        out.append(buf, buf + n);
+        return true;
+    }
+
+#ifdef LB_WITH_TLS
+    // One request/response straight over the session; a probe needs no relay thread
+    static bool tls_exchange(SSL* ssl, const string& req, string& resp) {
+        SSL_set_mode(ssl, SSL_MODE_AUTO_RETRY);  // skip over session tickets
+        if (SSL_write(ssl, req.data(), (int)req.size()) != (int)req.size()) return false;
+        char buf[1024];
+        int n = SSL_read(ssl, buf, sizeof(buf));
+        if (n <= 0) return false;
+        resp.append(buf, (size_t)n);
+        return true;
+    }
+#endif
+
+    // Sends a keep-alive warm-up request and reads the whole response; true
+    // if the connection is still usable afterwards.
+    bool warm_up(int fd, const BackendEndpoint& ep) {
+        string req = "GET " + warmup_path + " HTTP/1.1\r\nHost: " + ep.host + "\r\nConnection: keep-alive\r\n\r\n";
+        if (!send_all(fd, req.c_str(), req.size())) return false;
+        string resp;
+        size_t head_end;
+        while ((head_end = resp.find("\r\n\r\n")) == string::npos)
+            if (!read_some(fd, resp) || resp.size() > 64 * 1024) return false;
+        string head = resp.substr(0, head_end + 2);
+        transform(head.begin(), head.end(), head.begin(), ::tolower);
+        size_t cl = head.find("\r\ncontent-length:");
+        if (head.compare(0, 10, "http/1.1 2") != 0 || cl == string::npos ||
+            head.find("\r\nconnection: close") != string::npos)
+            return false;
+        size_t total = head_end + 4 + strtoul(head.c_str() + cl + 17, nullptr, 10);
+        while (resp.size() < total)
+            if (!read_some(fd, resp)) return false;
+        return resp.size() == total;
+    }
+
+    void prewarm(int index) {
+        const BackendEndpoint& ep = manager->endpoint(index);
+        int opened = 0;
+        for (size_t n = pool->idle_count(index); n < prewarm_count; ++n) {
+            int fd = pool->connect(index);
+            if (fd == -1) break;
+            if (!warmup_path.empty() && !warm_up(fd, ep)) {
+                pool->discard(index, fd);
+                break;
+            }
+            pool->release(index, fd, true);
+            opened++;
+        }
+        if (opened) cout << "Prewarmed " << opened << " connection(s) to " << ep.label << endl;
+    }
+
+    void sweep() {
+        PerfStageScope perf_scope(ProxyStage::HEALTH_SWEEP);
+        for (size_t i = 0; i < manager->size(); ++i) {
+            const BackendEndpoint& ep = manager->endpoint((int)i);
+            if (!manager->is_enabled((int)i)) {
+                if (pool) pool->drop((int)i);
+                continue;
+            }
+            int fd = ::socket(ep.addr.ss_family, SOCK_STREAM, 0);
+            if (fd == -1) { manager->set_health((int)i, false); continue; }
+
+            set_timeouts(fd, 2);
+            bool alive = false;
+
+            bool connected = ::connect(fd, (const sockaddr*)&ep.addr, ep.addr_len) != -1;
+            if (connected) {
+                // Real HTTP health check
+                string req = "GET /health HTTP/1.1\r\nHost: " + ep.host + "\r\nConnection: close\r\n\r\n";
+                string resp;
+                bool answered;
+#ifdef LB_WITH_TLS
+                if (ep.tls) {
+                    SSL* ssl = upstream_tls.handshake(fd, (int)i, ep);
+                    answered = ssl && tls_exchange(ssl, req, resp);
+                    if (ssl) {
+                        SSL_shutdown(ssl);
+                        SSL_free(ssl);
+                    }
+                } else
+#endif
+                // read just some bytes; we only need the status line
+                answered = send_all(fd, req.c_str(), req.size()) && read_some(fd, resp);
+                // Check for "HTTP/1.1 200"
+                if (answered && (resp.find("HTTP/1.1 200") != string::npos ||
+                                 resp.find("HTTP/1.0 200") != string::npos)) {
+                    alive = true;
+                }
+            }
+            ::close(fd);
+            manager->set_health((int)i, alive);
+            if (!alive && pool) pool->drop((int)i);
+            if (alive && !was_healthy[i] && prewarm_count) prewarm((int)i);
+            was_healthy[i] = alive;
+        }
+        if (pool) pool->maintain();
+    }
+
+public:
+    HealthChecker(BackendManager* mgr, ConnectionPool* conn_pool = nullptr): manager(mgr), pool(conn_pool) {}
+
+    void set_prewarm(size_t count, const string& path) {
+        prewarm_count = pool ? min(count, pool->max_idle_per_backend()) : 0;
+        warmup_path = path;
+    }
+
+    void start() {
+        worker = thread([this]() {
+            if (prewarm_count) {
+                for (size_t i = 0; i < manager->size(); ++i) {
+                    if (!manager->is_enabled((int)i) || !manager->is_healthy((int)i)) continue;
+                    prewarm((int)i);
+                    was_healthy[i] = true;
+                }
+            }
+            while (running) {
+                {
+                    unique_lock<mutex> lock(wake_mutex);
+                    if (wake.wait_for(lock, chrono::seconds(5), [this]() { return !running; })) break;
+                }
+                sweep();
+
+                ofstream out("status.txt");
+                write_status(manager, out);
+            }
+        });
+    }
+
+    void stop() {
+        {
+            lock_guard<mutex> lock(wake_mutex);
+            running = false;
+        }
+        wake.notify_all();
+        if (worker.joinable()) worker.join();
+    }
+};
+
+class LoadBalancer {
+    BackendManager* manager;
+    LBAlgorithm algorithm;
+    ProfiledMutex rr_mutex{"rr_mutex"};
+    size_t rr_index = 0;
+
+public:
+    LoadBalancer(BackendManager* mgr, LBAlgorithm algo = LBAlgorithm::ROUND_ROBIN)
+        : manager(mgr), algorithm(algo) {}
+
+    // Backends in exclude (already tried for this request) are skipped.
+    int select_backend(const string& client_ip, const vector<int>& exclude = {}) {
+        PerfStageScope perf_scope(ProxyStage::SELECT_BACKEND);
+        auto healthy = manager->get_available_indices();
+        for (int idx : exclude) healthy.erase(remove(healthy.begin(), healthy.end(), idx), healthy.end());
+        if (healthy.empty()) return -1;
+
+        if (algorithm == LBAlgorithm::ROUND_ROBIN) {
+            lock_guard<ProfiledMutex> lock(rr_mutex);
+            int index = healthy[rr_index % healthy.size()];
+            rr_index++;
+            return index;
+        } else if (algorithm == LBAlgorithm::LEAST_CONNECTIONS) {
+            return manager->get_least_connection_backend(healthy);
+        } else if (algorithm == LBAlgorithm::LEAST_RTT) {
+            return manager->get_lowest_rtt_backend(healthy);
+        } else { // IP_HASH
+            hash<string> hasher;
+            return healthy[hasher(client_ip) % healthy.size()];
+        }
+    }
+};
+
+// Parsed view of an HTTP/1.x message head. Field offsets point into the
+// buffer that was parsed, so callers can splice headers in or out with
+// iovecs instead of rebuilding the head.
+struct HttpHead {
+    static constexpr size_t MAX_HEAD = 64 * 1024;
+
+    struct Field {
+        string name;  // lower-cased
+        size_t line_start, line_end;  // line_end is past the CRLF
+        size_t value_start, value_end;
+    };
+
+    string method, target, version;  // request line
+    int status = 0;                  // response status line
+    size_t length = 0;               // through the blank line
+    long long content_length = -1;
+    bool chunked = false;
+    vector<Field> fields;
+
+    // 1 = complete head parsed, 0 = need more bytes, -1 = malformed/too large.
+    int parse(const string& buf, bool is_response) {
+        size_t end = buf.find("\r\n\r\n");
+        if (end == string::npos) return buf.size() > MAX_HEAD ? -1 : 0;
+        length = end + 4;
+
+        size_t eol = buf.find("\r\n");
+        size_t sp1 = buf.find(' ');
+        if (sp1 == string::npos || sp1 > eol) return -1;
+        if (is_response) {
+            version = buf.substr(0, sp1);
+            status = atoi(buf.c_str() + sp1 + 1);
+        } else {
+            size_t sp2 = buf.find(' ', sp1 + 1);
+            if (sp2 == string::npos || sp2 > eol) return -1;
+            method = buf.substr(0, sp1);
+            target = buf.substr(sp1 + 1, sp2 - sp1 - 1);
+            version = buf.substr(sp2 + 1, eol - sp2 - 1);
+        }
+
+        fields.clear();
+        content_length = -1;
+        chunked = false;
+        for (size_t pos = eol + 2; pos < end + 2;) {
+            size_t le = buf.find("\r\n", pos);
+            size_t colon = buf.find(':', pos);
+            if (colon == string::npos || colon > le) return -1;
+            Field f;
+            f.name = buf.substr(pos, colon - pos);
+            transform(f.name.begin(), f.name.end(), f.name.begin(), ::tolower);
+            f.line_start = pos;
+            f.line_end = le + 2;
+            f.value_start = buf.find_first_not_of(" \t", colon + 1);
+            if (f.value_start > le) f.value_start = le;
+            f.value_end = le;
+            while (f.value_end > f.value_start && (buf[f.value_end - 1] == ' ' || buf[f.value_end - 1] == '\t'))
+                --f.value_end;
+            if (f.name == "content-length") content_length = strtoll(buf.c_str() + f.value_start, nullptr, 10);
+            if (f.name == "transfer-encoding") {
+                string v = buf.substr(f.value_start, f.value_end - f.value_start);
+                transform(v.begin(), v.end(), v.begin(), ::tolower);
+                chunked = v.find("chunked") != string::npos;
+            }
+            fields.push_back(move(f));
+            pos = le + 2;
+        }
+        return 1;
+    }
+
+    const Field* find(const char* lower_name) const {
+        for (const Field& f : fields)
+            if (f.name == lower_name) return &f;
+        return nullptr;
+    }
+
+    string value(const string& buf, const char* lower_name) const {
+        const Field* f = find(lower_name);
+        return f ? buf.substr(f->value_start, f->value_end - f->value_start) : string();
+    }
+};
+
+// Incremental chunked transfer-coding parser used to find where a chunked
+// body ends while relaying it verbatim.
+class ChunkedTracker {
+    enum State { SIZE, DATA, DATA_CRLF, TRAILER, DONE } state = SIZE;
+    unsigned long long remaining = 0;
+    string line;
+
+public:
+    bool done() const { return state == DONE; }
+
+    // Consumes up to n bytes and returns how many belong to the body; stops
+    // at the end of the message. Returns npos on a malformed chunk header.
+    // Chunk data, without the framing, is appended to payload if given.
+    size_t feed(const char* data, size_t n, string* payload = nullptr) {
+        size_t i = 0;
+        while (i < n && state != DONE) {
+            if (state == DATA) {
+                size_t take = (size_t)min<unsigned long long>(remaining, n - i);
+                if (payload) payload->append(data + i, take);
+                i += take;
+                remaining -= take;
+                if (remaining == 0) state = DATA_CRLF;
+                continue;
+            }
+            char c = data[i++];
+            if (state == DATA_CRLF) {
+                if (c == '\n') state = SIZE;
+                continue;
+            }
+            if (c != '\n') {
+                if (line.size() > 4096) return string::npos;
+                line += c;
+                continue;
+            }
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            if (state == SIZE) {
+                char* end = nullptr;
+                remaining = strtoull(line.c_str(), &end, 16);
+                if (end == line.c_str()) return string::npos;
+                state = remaining ? DATA : TRAILER;
+            } else if (line.empty()) {  // TRAILER: blank line ends the message
+                state = DONE;
+            }
+            line.clear();
+        }
+        return i;
+    }
+};
+
+// Sends a buffered message with some header lines removed and `extra`
+// (complete header lines) appended to the head, as a single writev.
+static void splice_iov(const string& buf, const HttpHead& head, vector<const HttpHead::Field*> drop,
+                       const string& extra, vector<iovec>& iov) {
+    drop.erase(std::remove(drop.begin(), drop.end(), nullptr), drop.end());
+    sort(drop.begin(), drop.end(), [](const HttpHead::Field* a, const HttpHead::Field* b) {
+        return a->line_start < b->line_start;
+    });
+    char* base = const_cast<char*>(buf.data());
+    size_t head_end = head.length - 2;  // the blank line
+    size_t pos = 0;
+    for (const HttpHead::Field* f : drop) {
+        if (f->line_start > pos) iov.push_back({base + pos, f->line_start - pos});
+        pos = f->line_end;
+    }
+    if (head_end > pos) iov.push_back({base + pos, head_end - pos});
+    if (!extra.empty()) iov.push_back({const_cast<char*>(extra.data()), extra.size()});
+    iov.push_back({base + head_end, buf.size() - head_end});
+}
+
+static bool send_spliced(int fd, const string& buf, const HttpHead& head,
+                         vector<const HttpHead::Field*> drop, const string& extra) {
+    vector<iovec> iov;
+    splice_iov(buf, head, move(drop), extra, iov);
+    return send_iov(fd, iov.data(), (int)iov.size());
+}
+
+// Fixed-size blocks for the zero-copy send path. Blocks handed to the kernel
+// with MSG_ZEROCOPY come back here only after their completion arrives.
+class BufferPool {
+    mutex pool_mutex;
+    vector<char*> free_blocks;
+    size_t max_cached;
+
+public:
+    static constexpr size_t BLOCK_SIZE = 64 * 1024;
+
+    explicit BufferPool(size_t max_cached_blocks = 256): max_cached(max_cached_blocks) {}
+
+    ~BufferPool() {
+        for (char* b : free_blocks) delete[] b;
+    }
+
+    char* acquire() {
+        {
+            lock_guard<mutex> lock(pool_mutex);
+            if (!free_blocks.empty()) {
+                char* b = free_blocks.back();
+                free_blocks.pop_back();
+                return b;
+            }
+        }
+        return new char[BLOCK_SIZE];
+    }
+
+    void release(char* block) {
+        {
+            lock_guard<mutex> lock(pool_mutex);
+            if (free_blocks.size() < max_cached) {
+                free_blocks.push_back(block);
+                return;
+            }
+        }
+        delete[] block;
+    }
+};
+
+static BufferPool buffer_pool;
+
+struct ZeroCopyStats {
+    atomic<uint64_t> responses{0}, bytes{0}, sends{0}, completions{0};
+    atomic<uint64_t> copied{0}, fallbacks{0}, deferred{0}, reaped{0};
+
+    void log_status(ostream& out) {
+        out << "ZeroCopy:\nResponses: " << responses << " Bytes: " << bytes << " Sends: " << sends
+            << " Completions: " << completions << " KernelCopied: " << copied
+            << " Fallbacks: " << fallbacks << " DeferredBlocks: " << deferred << " ReapedLate: " << reaped << "\n";
+    }
+};
+
+static ZeroCopyStats zerocopy_stats;
+
+// MSG_ZEROCOPY bookkeeping for one socket. Every successful zero-copy
+// sendmsg() gets the next id from the kernel, numbered per socket, so this
+// outlives a single response; a pooled block is returned to the pool only
+// once the error queue reports all ids covering it.
+struct ZeroCopyTracker {
+    struct InFlight {
+        char* block;
+        uint32_t last_id;
+    };
+
+    deque<InFlight> in_flight;
+    uint32_t next_id = 0;      // id of the next zero-copy send
+    uint32_t done_below = 0;   // every id before this has completed
+    map<uint32_t, uint32_t> early;  // completed ranges past a gap (lo -> hi)
+    uint64_t last_tx_ns = 0;        // SO_TIMESTAMPING notifications share the queue
+
+    static bool before(uint32_t a, uint32_t b) { return (int32_t)(a - b) < 0; }
+
+    void complete(uint32_t lo, uint32_t hi) {
+        zerocopy_stats.completions.fetch_add(hi - lo + 1, memory_order_relaxed);
+        if (before(done_below, lo)) {
+            early[lo] = hi;
+            return;
+        }
+        if (!before(hi, done_below)) done_below = hi + 1;
+        for (auto it = early.begin(); it != early.end() && !before(done_below, it->first);) {
+            if (!before(it->second, done_below)) done_below = it->second + 1;
+            it = early.erase(it);
+        }
+    }
+
+    // Reads completion notifications, waiting up to timeout_ms for the
+    // first, and frees the blocks they cover. Returns how many were freed.
+    size_t reap(int fd, int timeout_ms) {
+        pollfd pfd{fd, 0, 0};
+        if (::poll(&pfd, 1, timeout_ms) <= 0 || !(pfd.revents & POLLERR)) return 0;
+        while (true) {
+            char control[256];
+            msghdr msg{};
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+            if (::recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) break;
+            for (cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+                last_tx_ns = max(last_tx_ns, KernelTimestamps::from_cmsg(cm));
+                if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                      (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)))
+                    continue;
+                auto* err = (sock_extended_err*)CMSG_DATA(cm);
+                if (err->ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+                if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) zerocopy_stats.copied.fetch_add(1, memory_order_relaxed);
+                complete(err->ee_info, err->ee_data);
+            }
+        }
+        size_t freed = 0;
+        while (!in_flight.empty() && before(in_flight.front().last_id, done_below)) {
+            buffer_pool.release(in_flight.front().block);
+            in_flight.pop_front();
+            ++freed;
+        }
+        return freed;
+    }
+
+    // Once the send queue is empty every byte sent from the blocks has been
+    // acknowledged and the kernel holds none of them, whether or not the
+    // notifications made it (drain_tx may have consumed them)
+    size_t release_if_sent(int fd) {
+        int outq = 0;
+        if (in_flight.empty() || ioctl(fd, SIOCOUTQ, &outq) != 0 || outq != 0) return 0;
+        size_t freed = in_flight.size();
+        for (const InFlight& f : in_flight) buffer_pool.release(f.block);
+        in_flight.clear();
+        early.clear();
+        done_below = next_id;
+        return freed;
+    }
+};
+
+// Keeps each zero-copy socket's tracker between responses, and frees the
+// blocks a response left pinned (a slow reader) as their completions arrive.
+// Entries are keyed by socket inode, which cannot be reused while the socket
+// is open. Blocks are watched through a dup() of the socket; when the
+// handler closes a socket that still has some, it is shut down for writing
+// instead, so the client gets its FIN after the data, and the dup keeps it
+// alive until the last block is back. TCP_USER_TIMEOUT bounds how long a
+// client that stopped reading can hold them.
+class ZeroCopyReaper {
+    static constexpr int TICK_MS = 100;
+    static constexpr unsigned CLOSE_TIMEOUT_MS = 60000;
+
+    struct Entry {
+        ZeroCopyTracker tracker;
+        int watch_fd = -1;  // our dup, while blocks are outstanding
+        bool borrowed = false;
+        bool closing = false;
+    };
+
+    mutex reaper_mutex;
+    condition_variable wake;
+    map<ino_t, Entry> entries;
+    atomic<size_t> count{0};
+    bool running = false;
+    thread worker;
+
+    static bool inode_of(int fd, ino_t& ino) {
+        struct stat st;
+        if (fstat(fd, &st) != 0) return false;
+        ino = st.st_ino;
+        return true;
+    }
+
+    static void forget(Entry& e) {
+        if (e.watch_fd != -1) ::close(e.watch_fd);
+        e.watch_fd = -1;
+    }
+
+    void sweep() {
+        lock_guard<mutex> lock(reaper_mutex);
+        for (auto it = entries.begin(); it != entries.end();) {
+            Entry& e = it->second;
+            if (!e.borrowed && e.watch_fd != -1) {
+                size_t freed = e.tracker.reap(e.watch_fd, 0) + e.tracker.release_if_sent(e.watch_fd);
+                zerocopy_stats.reaped.fetch_add(freed, memory_order_relaxed);
+                if (e.tracker.in_flight.empty()) forget(e);
+            }
+            if (e.closing && e.watch_fd == -1) {
+                it = entries.erase(it);
+                count.fetch_sub(1, memory_order_relaxed);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+public:
+    void start() {
+        lock_guard<mutex> lock(reaper_mutex);
+        if (running) return;
+        running = true;
+        worker = thread([this]() {
+            unique_lock<mutex> lock(reaper_mutex);
+            while (running) {
+                wake.wait_for(lock, chrono::milliseconds(TICK_MS));
+                if (!running) break;
+                lock.unlock();
+                sweep();
+                lock.lock();
+            }
+        });
+    }
+
+    void stop() {
+        {
+            lock_guard<mutex> lock(reaper_mutex);
+            if (!running) return;
+            running = false;
+        }
+        wake.notify_all();
+        worker.join();
+    }
+
+    // A sender takes the socket's tracker for the length of one response
+    ZeroCopyTracker borrow(int fd) {
+        ino_t ino;
+        if (!inode_of(fd, ino)) return {};
+        lock_guard<mutex> lock(reaper_mutex);
+        auto it = entries.find(ino);
+        if (it == entries.end()) {
+            it = entries.emplace(ino, Entry{}).first;
+            count.fetch_add(1, memory_order_relaxed);
+        }
+        it->second.borrowed = true;
+        return move(it->second.tracker);
+    }
+
+    // ...and hands it back, with whatever blocks are still pinned
+    void give_back(int fd, ZeroCopyTracker&& tracker) {
+        ino_t ino;
+        bool known = inode_of(fd, ino);
+        lock_guard<mutex> lock(reaper_mutex);
+        auto it = known ? entries.find(ino) : entries.end();
+        if (it == entries.end()) {
+            // Not registered: nothing better to do than keep the pages alive
+            zerocopy_stats.deferred.fetch_add(tracker.in_flight.size(), memory_order_relaxed);
+            return;
+        }
+        Entry& e = it->second;
+        e.tracker = move(tracker);
+        e.borrowed = false;
+        zerocopy_stats.deferred.fetch_add(e.tracker.in_flight.size(), memory_order_relaxed);
+        if (!e.tracker.in_flight.empty() && e.watch_fd == -1) e.watch_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+        else if (e.tracker.in_flight.empty()) forget(e);
+    }
+
+    // Called just before the handler closes a client socket
+    void closing(int fd) {
+        if (count.load(memory_order_relaxed) == 0) return;
+        ino_t ino;
+        if (!inode_of(fd, ino)) return;
+        lock_guard<mutex> lock(reaper_mutex);
+        auto it = entries.find(ino);
+        if (it == entries.end()) return;
+        Entry& e = it->second;
+        if (e.watch_fd == -1) {
+            entries.erase(it);
+            count.fetch_sub(1, memory_order_relaxed);
+            return;
+        }
+        // Our dup keeps the socket open, so the handler's close() alone
+        // would not end the connection
+        unsigned timeout = CLOSE_TIMEOUT_MS;
+        setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &timeout, sizeof(timeout));
+        ::shutdown(fd, SHUT_WR);
+        e.closing = true;
+    }
+};
+
+static ZeroCopyReaper zerocopy_reaper;
+
+// MSG_ZEROCOPY transmit path for one response body, on the socket's tracker
+// borrowed from zerocopy_reaper.
+class ZeroCopySender {
+    static constexpr size_t MAX_IN_FLIGHT = 32;  // blocks pinned per response
+
+    int fd;
+    ZeroCopyTracker tracker;
+
+public:
+    explicit ZeroCopySender(int client_fd): fd(client_fd), tracker(zerocopy_reaper.borrow(client_fd)) {}
+
+    ZeroCopySender(const ZeroCopySender&) = delete;
+    ZeroCopySender& operator=(const ZeroCopySender&) = delete;
+
+    ~ZeroCopySender() {
+        // Blocks the kernel may still read from go to the reaper
+        zerocopy_reaper.give_back(fd, move(tracker));
+    }
+
+    static bool enable(int fd) {
+        int one = 1;
+        return setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+    }
+
+    // Sends len bytes of a pooled block, taking ownership of it.
+    bool send_block(char* block, size_t len) {
+        while (tracker.in_flight.size() >= MAX_IN_FLIGHT) {
+            size_t before_reap = tracker.in_flight.size();
+            tracker.reap(fd, 10000);
+            if (tracker.in_flight.size() == before_reap) {
+                buffer_pool.release(block);
+                return false;
+            }
+        }
+
+        size_t sent = 0;
+        bool pinned = false;
+        while (sent < len) {
+            ssize_t n = ::send(fd, block + sent, len - sent, MSG_ZEROCOPY | MSG_NOSIGNAL);
+            if (n == -1 && errno == EINTR) continue;
+            if (n == -1 && errno == ENOBUFS) {
+                // Out of optmem for notifications: copy this remainder instead
+                zerocopy_stats.fallbacks.fetch_add(1, memory_order_relaxed);
+                if (!send_all(fd, block + sent, len - sent)) break;
+                sent = len;
+                break;
+            }
+            if (n <= 0) break;
+            sent += (size_t)n;
+            ++tracker.next_id;
+            pinned = true;
+            zerocopy_stats.sends.fetch_add(1, memory_order_relaxed);
+        }
+        if (pinned) tracker.in_flight.push_back({block, tracker.next_id - 1});
+        else buffer_pool.release(block);
+        tracker.reap(fd, 0);
+        return sent == len;
+    }
+
+    uint64_t latest_tx_timestamp() const { return tracker.last_tx_ns; }
+
+    // Waits until the kernel has released every block, up to timeout_ms.
+    bool finish(int timeout_ms) {
+        auto deadline = chrono::steady_clock::now() + chrono::milliseconds(timeout_ms);
+        while (!tracker.in_flight.empty() && chrono::steady_clock::now() < deadline) tracker.reap(fd, 100);
+        return tracker.in_flight.empty();
+    }
+};
+
+// One mmap'd, append-only slab file of the on-disk cache tier.
+struct CacheSlab {
+    int fd = -1;
+    char* map = nullptr;
+    size_t size = 0;
+    uint32_t gen = 0;  // bumped each time the slab is recycled
+
+    ~CacheSlab() {
+        if (map) munmap(map, size);
+        if (fd != -1) ::close(fd);
+    }
+};
+
+// In-LB cache of small GET responses that declare max-age or s-maxage.
+// Past freshness an entry is still served for its stale-while-revalidate
+// window while a single background request refreshes it, and for its
+// stale-if-error window when no backend produces a usable response
+// (RFC 5861). Windows the response does not declare fall back to
+// --cache-swr / --cache-sie. Entries are immutable; a refresh replaces them.
+// Entries evicted from memory move to an optional on-disk tier (DiskTier).
+class ResponseCache {
+public:
+    static constexpr size_t MAX_OBJECT = 1 << 20;
+
+    struct Entry {
+        string data;  // response head and body, or only the head for disk entries
+        HttpHead head;
+        shared_ptr<CacheSlab> slab;  // disk entries: pins the slab while the body is sent
+        off_t body_offset = 0;
+        size_t body_len = 0;
+        uint64_t stored_ns;
+        uint64_t fresh_ns, swr_ns, sie_ns;  // windows, relative to stored_ns
+
+        uint64_t age_ns(uint64_t now) const { return now > stored_ns ? now - stored_ns : 0; }
+        bool fresh(uint64_t now) const { return age_ns(now) < fresh_ns; }
+        bool revalidatable(uint64_t now) const { return age_ns(now) < fresh_ns + swr_ns; }
+        bool usable_on_error(uint64_t now) const { return age_ns(now) < fresh_ns + sie_ns; }
+    };
+
+    atomic<uint64_t> hits{0}, stale_hits{0}, error_hits{0}, misses{0}, stores{0}, refreshes{0}, evictions{0};
+
+private:
+    // Second tier: entries evicted from memory are appended to a ring of
+    // mmap'd slab files and indexed in memory by a 64-bit fingerprint of
+    // the key; the key itself is stored in the record and compared on
+    // lookup. Bodies are served from the file with sendfile(). When the ring
+    // wraps, the oldest slab is recycled and its index entries dropped; a
+    // slab still being sent from is not overwritten, the demotion is
+    // skipped instead. Slabs are truncated at startup, so the tier does not
+    // survive restarts. Callers hold cache_mutex.
+    class DiskTier {
+        struct Loc {
+            uint32_t slab, gen;
+            uint64_t offset;
+            uint32_t key_len, head_len, data_len;
+            uint64_t stored_ns, fresh_ns, swr_ns, sie_ns;
+        };
+
+        vector<shared_ptr<CacheSlab>> slabs;
+        size_t current = 0, write_pos = 0;
+        unordered_map<uint64_t, Loc> index;
+
+    public:
+        uint64_t hits = 0, writes = 0, skipped = 0, recycles = 0, bytes = 0;
+
+        bool open(const string& dir, size_t total_bytes) {
+            size_t slab_size = max<size_t>(total_bytes / 8, 4 * MAX_OBJECT);
+            size_t count = max<size_t>(total_bytes / slab_size, 2);
+            for (size_t i = 0; i < count; ++i) {
+                auto slab = make_shared<CacheSlab>();
+                char name[32];
+                snprintf(name, sizeof(name), "/slab-%03zu.dat", i);
+                slab->fd = ::open((dir + name).c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+                if (slab->fd == -1 || ftruncate(slab->fd, (off_t)slab_size) == -1) return false;
+                void* map = mmap(nullptr, slab_size, PROT_READ | PROT_WRITE, MAP_SHARED, slab->fd, 0);
+                if (map == MAP_FAILED) return false;
+                slab->map = (char*)map;
+                slab->size = slab_size;
+                slab->gen = i == 0;  // slab 0 is written first
+                slabs.push_back(slab);
+            }
+            return true;
+        }
+
+        bool enabled() const { return !slabs.empty(); }
+        size_t entries() const { return index.size(); }
+
+        void put(const string& key, const Entry& e) {
+            size_t record = 4 + key.size() + e.data.size();
+            if (e.slab || record > slabs[current]->size) return;
+            if (write_pos + record > slabs[current]->size) {
+                size_t next = (current + 1) % slabs.size();
+                if (slabs[next].use_count() > 1) {
+                    skipped++;
+                    return;
+                }
+                if (slabs[next]->gen++ > 0) recycles++;
+                for (auto it = index.begin(); it != index.end();) {
+                    if (it->second.slab == next) {
+                        bytes -= it->second.data_len;
+                        it = index.erase(it);
+                    } else {
+                        ++it;
+                    }
+                }
+                current = next;
+                write_pos = 0;
+            }
+            CacheSlab& slab = *slabs[current];
+            uint32_t key_len = (uint32_t)key.size();
+            memcpy(slab.map + write_pos, &key_len, 4);
+            memcpy(slab.map + write_pos + 4, key.data(), key.size());
+            memcpy(slab.map + write_pos + 4 + key.size(), e.data.data(), e.data.size());
+            uint64_t fp = hash<string>()(key);
+            auto old = index.find(fp);
+            if (old != index.end()) bytes -= old->second.data_len;
+            index[fp] = {(uint32_t)current, slab.gen, write_pos, key_len, (uint32_t)e.head.length,
+                         (uint32_t)e.data.size(), e.stored_ns, e.fresh_ns, e.swr_ns, e.sie_ns};
+            bytes += e.data.size();
+            write_pos = (write_pos + record + 7) & ~(size_t)7;
+            writes++;
+        }
+
+        shared_ptr<Entry> get(const string& key) {
+            auto it = index.find(hash<string>()(key));
+            if (it == index.end()) return nullptr;
+            const Loc& loc = it->second;
+            const shared_ptr<CacheSlab>& slab = slabs[loc.slab];
+            const char* rec = slab->map + loc.offset;
+            if (loc.gen != slab->gen || loc.key_len != key.size() || memcmp(rec + 4, key.data(), key.size()) != 0)
+                return nullptr;
+            auto e = make_shared<Entry>();
+            e->data.assign(rec + 4 + loc.key_len, loc.head_len);
+            if (e->head.parse(e->data, true) != 1) return nullptr;
+            e->slab = slab;
+            e->body_offset = (off_t)(loc.offset + 4 + loc.key_len + loc.head_len);
+            e->body_len = loc.data_len - loc.head_len;
+            e->stored_ns = loc.stored_ns;
+            e->fresh_ns = loc.fresh_ns;
+            e->swr_ns = loc.swr_ns;
+            e->sie_ns = loc.sie_ns;
+            hits++;
+            return e;
+        }
+    };
+
+    struct Slot {
+        shared_ptr<const Entry> entry;
+        list<string>::iterator lru;
+    };
+
+    size_t max_bytes = 0;
+    long default_swr = 0, default_sie = 0;
+    ProfiledMutex cache_mutex{"cache_mutex"};
+    unordered_map<string, Slot> entries;
+    list<string> lru;  // most recently used first
+    size_t bytes = 0;
+    set<string> refreshing;
+    DiskTier disk;
+
+    static string lower(string v) {
+        transform(v.begin(), v.end(), v.begin(), ::tolower);
+        return v;
+    }
+
+    // Seconds for name=N in a Cache-Control value, -1 if absent
+    static long directive(const string& cc, const string& name) {
+        for (size_t pos = 0; pos < cc.size();) {
+            size_t end = cc.find(',', pos);
+            if (end == string::npos) end = cc.size();
+            string item = cc.substr(pos, end - pos);
+            item.erase(0, item.find_first_not_of(" \t"));
+            if (item.compare(0, name.size(), name) == 0 &&
+                (item.size() == name.size() || item[name.size()] == '=' || item[name.size()] == ' '))
+                return item.size() > name.size() + 1 ? atol(item.c_str() + name.size() + 1) : 0;
+            pos = end + 1;
+        }
+        return -1;
+    }
+
+    static bool has_directive(const string& cc, const string& name) { return directive(cc, name) >= 0; }
+
+public:
+    void configure(size_t max_cache_bytes, long swr_seconds, long sie_seconds) {
+        max_bytes = max_cache_bytes;
+        default_swr = swr_seconds;
+        default_sie = sie_seconds;
+    }
+
+    bool enable_disk(const string& dir, size_t disk_bytes) { return disk.open(dir, disk_bytes); }
+
+    bool enabled() const { return max_bytes > 0 || disk.enabled(); }
+
+    // GETs without a body or credentials that don't ask to bypass caches
+    static bool cacheable_request(const string& buf, const HttpHead& req) {
+        if (req.method != "GET" || req.chunked || req.content_length > 0 || req.find("authorization")) return false;
+        string cc = lower(req.value(buf, "cache-control"));
+        return !has_directive(cc, "no-cache") && !has_directive(cc, "no-store");
+    }
+
+    static string key(const string& buf, const HttpHead& req) {
+        return lower(req.value(buf, "host")) + " " + req.target;
+    }
+
+    // Builds an entry if the response may be stored; null otherwise.
+    shared_ptr<Entry> make_entry(const string& buf, const HttpHead& resp) const {
+        int st = resp.status;
+        if (!(st == 200 || st == 203 || st == 301 || st == 404 || st == 410)) return nullptr;
+        if (resp.chunked || resp.content_length < 0 || resp.length + (size_t)resp.content_length > MAX_OBJECT)
+            return nullptr;
+        if (resp.find("set-cookie") || resp.find("vary")) return nullptr;
+        string cc = lower(resp.value(buf, "cache-control"));
+        if (has_directive(cc, "no-store") || has_directive(cc, "no-cache") || has_directive(cc, "private"))
+            return nullptr;
+        long max_age = directive(cc, "s-maxage");
+        if (max_age < 0) max_age = directive(cc, "max-age");
+        if (max_age < 0) return nullptr;
+        long swr = directive(cc, "stale-while-revalidate");
+        long sie = directive(cc, "stale-if-error");
+        auto e = make_shared<Entry>();
+        e->stored_ns = mono_ns();
+        e->fresh_ns = (uint64_t)max_age * 1000000000ULL;
+        e->swr_ns = (uint64_t)(swr < 0 ? default_swr : swr) * 1000000000ULL;
+        e->sie_ns = (uint64_t)(sie < 0 ? default_sie : sie) * 1000000000ULL;
+        return e;
+    }
+
+    bool storable(const string& buf, const HttpHead& resp) const { return enabled() && make_entry(buf, resp) != nullptr; }
+
+    // buf must hold the complete response
+    void store(const string& key, const string& buf, const HttpHead& resp) {
+        shared_ptr<Entry> e = make_entry(buf, resp);
+        if (!e) return;
+        e->data = buf.substr(0, resp.length + (size_t)resp.content_length);
+        e->head = resp;
+        stores.fetch_add(1, memory_order_relaxed);
+        lock_guard<ProfiledMutex> lock(cache_mutex);
+        auto it = entries.find(key);
+        if (it != entries.end()) {
+            bytes -= it->second.entry->data.size();
+            lru.erase(it->second.lru);
+            entries.erase(it);
+        }
+        lru.push_front(key);
+        entries[key] = {e, lru.begin()};
+        bytes += e->data.size();
+        while (bytes > max_bytes && !lru.empty()) {
+            auto victim = entries.find(lru.back());
+            bytes -= victim->second.entry->data.size();
+            if (disk.enabled()) disk.put(victim->first, *victim->second.entry);
+            entries.erase(victim);
+            lru.pop_back();
+            evictions.fetch_add(1, memory_order_relaxed);
+        }
+    }
+
+    shared_ptr<const Entry> lookup(const string& key) {
+        lock_guard<ProfiledMutex> lock(cache_mutex);
+        auto it = entries.find(key);
+        if (it == entries.end()) return disk.enabled() ? disk.get(key) : nullptr;
+        lru.splice(lru.begin(), lru, it->second.lru);
+        return it->second.entry;
+    }
+
+    // True for the one caller that gets to refresh key
+    bool begin_refresh(const string& key) {
+        lock_guard<ProfiledMutex> lock(cache_mutex);
+        return refreshing.insert(key).second;
+    }
+
+    void end_refresh(const string& key) {
+        lock_guard<ProfiledMutex> lock(cache_mutex);
+        refreshing.erase(key);
+    }
+
+    static bool send_entry(int fd, const Entry& e, const char* cache_status) {
+        string extra = "Connection: close\r\nAge: " + to_string(e.age_ns(mono_ns()) / 1000000000ULL) +
+                       "\r\nX-Cache: " + cache_status + "\r\n";
+        if (!send_spliced(fd, e.data, e.head, {e.head.find("connection"), e.head.find("age")}, extra)) return false;
+        // Disk entries: the body goes from the slab file without a copy
+        off_t offset = e.body_offset;
+        size_t left = e.slab ? e.body_len : 0;
+        while (left > 0) {
+            ssize_t n = ::sendfile(fd, e.slab->fd, &offset, left);
+            if (n == -1 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            left -= (size_t)n;
+        }
+        return true;
+    }
+
+    void log_status(ostream& out) {
+        lock_guard<ProfiledMutex> lock(cache_mutex);
+        out << "Response Cache:\n"
+            << "Entries: " << entries.size() << " Bytes: " << bytes << " Hits: " << hits
+            << " StaleWhileRevalidate: " << stale_hits << " StaleIfError: " << error_hits
+            << " Misses: " << misses << " Stores: " << stores << " Refreshes: " << refreshes
+            << " Evictions: " << evictions << "\n";
+        if (disk.enabled())
+            out << "Disk Tier: Entries: " << disk.entries() << " Bytes: " << disk.bytes << " Hits: " << disk.hits
+                << " Writes: " << disk.writes << " Recycled: " << disk.recycles << " Skipped: " << disk.skipped << "\n";
+    }
+};
+
+static ResponseCache response_cache;
+
+// Admission control for --max-conns. While every healthy backend is at its
+// connection limit, requests wait in per-class queues and are released by
+// self-clocked weighted fair queueing: each waiter is tagged
+// max(V, class's last tag) + 1/weight, the smallest tag goes next and V
+// advances to it. A weight-8 class is dispatched 8x as often as a weight-1
+// class while both are backlogged, so interactive traffic stays fast and
+// batch traffic absorbs the queueing. Inside a class, each client (IP or
+// --fair-key header) has its own queue and the class's turns are shared
+// between clients by deficit round robin, so one heavy client cannot starve
+// the others.
+class PriorityScheduler {
+    struct Rule {
+        enum Kind { ANY, PATH, HEADER, CIDR } kind = ANY;
+        string key, value;  // path prefix, or header name and optional value
+        uint32_t net = 0, mask = 0;
+    };
+
+    struct Waiter {
+        double tag;
+        uint64_t client;
+        int cost;
+        bool granted = false;
+        Waiter* next = nullptr;
+        condition_variable cv;
+    };
+
+    // Per-client FIFOs of one class in an open-addressing table (linear
+    // probing on the client key hash), served by deficit round robin. Slots
+    // of clients with nothing queued are dropped when the table is rebuilt,
+    // which only happens once it is 3/4 full, so each request costs O(1)
+    // amortised.
+    class ClientQueues {
+        static constexpr int QUANTUM = 1;
+
+        struct Slot {
+            uint64_t key = 0;
+            Waiter* head = nullptr;
+            Waiter* tail = nullptr;
+            int deficit = 0;
+            bool used = false;
+        };
+
+        vector<Slot> slots = vector<Slot>(64);
+        size_t used = 0;
+        deque<uint32_t> active;  // round-robin order of slots with waiters
+
+        uint32_t probe(uint64_t key) const {
+            size_t mask = slots.size() - 1;
+            size_t i = (size_t)(key * 0x9E3779B97F4A7C15ULL) & mask;
+            while (slots[i].used && slots[i].key != key) i = (i + 1) & mask;
+            return (uint32_t)i;
+        }
+
+        // Re-inserts the clients that have waiters, growing if they alone
+        // fill half the table; the round-robin order is kept.
+        void rebuild() {
+            size_t size = slots.size();
+            while (active.size() * 2 >= size) size *= 2;
+            vector<Slot> old(size);
+            old.swap(slots);
+            used = 0;
+            for (uint32_t& idx : active) {
+                const Slot& from = old[idx];
+                idx = probe(from.key);
+                slots[idx] = from;
+                used++;
+            }
+        }
+
+    public:
+        size_t clients() const { return active.size(); }
+
+        void push(Waiter* w) {
+            uint32_t i = probe(w->client);
+            if (!slots[i].used) {
+                if ((used + 1) * 4 > slots.size() * 3) {
+                    rebuild();
+                    i = probe(w->client);
+                }
+                slots[i].used = true;
+                slots[i].key = w->client;
+                used++;
+            }
+            Slot& slot = slots[i];
+            if (!slot.head) {
+                slot.head = slot.tail = w;
+                slot.deficit = 0;
+                active.push_back(i);
+            } else {
+                slot.tail->next = w;
+                slot.tail = w;
+            }
+        }
+
+        // Next waiter in DRR order: the client at the front is served while
+        // its deficit covers the cost of its next request, then it gets a
+        // quantum and moves to the back.
+        Waiter* pop() {
+            while (!active.empty()) {
+                Slot& slot = slots[active.front()];
+                if (slot.deficit >= slot.head->cost) {
+                    Waiter* w = slot.head;
+                    slot.deficit -= w->cost;
+                    slot.head = w->next;
+                    if (!slot.head) {
+                        slot.tail = nullptr;
+                        active.pop_front();
+                    }
+                    return w;
+                }
+                slot.deficit += QUANTUM;
+                active.push_back(active.front());
+                active.pop_front();
+            }
+            return nullptr;
+        }
+
+        // Unlinks a waiter that gave up.
+        void remove(Waiter* w) {
+            uint32_t i = probe(w->client);
+            Slot& slot = slots[i];
+            Waiter* prev = nullptr;
+            for (Waiter* cur = slot.head; cur && cur != w; cur = cur->next) prev = cur;
+            if (prev) prev->next = w->next;
+            else slot.head = w->next;
+            if (slot.tail == w) slot.tail = prev;
+            if (!slot.head) active.erase(find(active.begin(), active.end(), i));
+        }
+    };
+
+    struct Class {
+        string name;
+        double weight;
+        Rule rule;
+        double last_tag = 0;
+        deque<double> tags;  // WFQ tags of this class's waiters, in order
+        ClientQueues clients;
+        uint64_t admitted = 0, queued = 0, timeouts = 0, wait_sum_ns = 0, wait_max_ns = 0;
+    };
+
+    BackendManager* manager = nullptr;
+    int max_conns = 0;
+    int queue_timeout_ms = 5000;
+    string fair_header;  // lower-cased; empty = per client IP
+    vector<Class> classes;
+    mutex sched_mutex;
+    size_t in_service = 0;
+    double vtime = 0;
+
+    static bool parse_cidr(const string& text, uint32_t& net, uint32_t& mask) {
+        size_t slash = text.find('/');
+        int bits = slash == string::npos ? 32 : atoi(text.c_str() + slash + 1);
+        in_addr addr{};
+        if (bits < 0 || bits > 32 || inet_pton(AF_INET, text.substr(0, slash).c_str(), &addr) != 1) return false;
+        mask = bits ? htonl(~0U << (32 - bits)) : 0;
+        net = addr.s_addr & mask;
+        return true;
+    }
+
+    size_t capacity() const { return manager->get_healthy_indices().size() * (size_t)max_conns; }
+
+    // Hands free capacity to the waiters with the smallest tags.
+    void dispatch_locked() {
+        while (in_service < capacity()) {
+            Class* next = nullptr;
+            for (Class& c : classes)
+                if (!c.tags.empty() && (!next || c.tags.front() < next->tags.front())) next = &c;
+            if (!next) return;
+            // The class's turn goes to whichever of its clients DRR picks
+            vtime = next->tags.front();
+            next->tags.pop_front();
+            Waiter* w = next->clients.pop();
+            w->tag = vtime;
+            w->granted = true;
+            in_service++;
+            w->cv.notify_one();
+        }
+    }
+
+public:
+    // Held for the lifetime of an admitted request.
+    class Ticket {
+        PriorityScheduler* owner = nullptr;
+        friend class PriorityScheduler;
+
+    public:
+        Ticket() = default;
+        Ticket(const Ticket&) = delete;
+        Ticket& operator=(const Ticket&) = delete;
+        ~Ticket() {
+            if (owner) owner->release();
+        }
+    };
+
+    // NAME:WEIGHT[:MATCH], MATCH being path=/prefix, header=name[=value] or
+    // cidr=a.b.c.d/n. Rules are tried in the order given.
+    bool add_class(const string& spec) {
+        size_t c1 = spec.find(':');
+        size_t c2 = c1 == string::npos ? string::npos : spec.find(':', c1 + 1);
+        if (c1 == string::npos || c1 == 0) return false;
+        Class cls;
+        cls.name = spec.substr(0, c1);
+        cls.weight = atof(spec.substr(c1 + 1, c2 == string::npos ? string::npos : c2 - c1 - 1).c_str());
+        if (cls.weight <= 0) return false;
+        if (c2 != string::npos) {
+            string match = spec.substr(c2 + 1);
+            size_t eq = match.find('=');
+            if (eq == string::npos) return false;
+            string kind = match.substr(0, eq), arg = match.substr(eq + 1);
+            if (kind == "path") {
+                cls.rule.kind = Rule::PATH;
+                cls.rule.key = arg;
+            } else if (kind == "header") {
+                size_t veq = arg.find('=');
+                cls.rule.kind = Rule::HEADER;
+                cls.rule.key = arg.substr(0, veq);
+                transform(cls.rule.key.begin(), cls.rule.key.end(), cls.rule.key.begin(), ::tolower);
+                if (veq != string::npos) cls.rule.value = arg.substr(veq + 1);
+            } else if (kind == "cidr") {
+                cls.rule.kind = Rule::CIDR;
+                if (!parse_cidr(arg, cls.rule.net, cls.rule.mask)) return false;
+            } else {
+                return false;
+            }
+        }
+        classes.push_back(cls);
+        return true;
+    }
+
+    void configure(BackendManager* mgr, int max_conns_per_backend, int timeout_ms, const string& fair_key_header) {
+        manager = mgr;
+        fair_header = fair_key_header;
+        transform(fair_header.begin(), fair_header.end(), fair_header.begin(), ::tolower);
+        max_conns = max_conns_per_backend;
+        queue_timeout_ms = timeout_ms;
+        bool has_default = any_of(classes.begin(), classes.end(),
+                                  [](const Class& c) { return c.rule.kind == Rule::ANY; });
+        if (!has_default) add_class("default:1");
+    }
+
+    bool enabled() const { return max_conns > 0; }
+
+    int classify(const string& buf, const HttpHead& req, const string& client_ip) const {
+        in_addr addr{};
+        bool have_ip = inet_pton(AF_INET, client_ip.c_str(), &addr) == 1;
+        for (size_t i = 0; i < classes.size(); ++i) {
+            const Rule& rule = classes[i].rule;
+            switch (rule.kind) {
+            case Rule::ANY:
+                return (int)i;
+            case Rule::PATH:
+                if (req.target.compare(0, rule.key.size(), rule.key) == 0) return (int)i;
+                break;
+            case Rule::HEADER:
+                if (req.find(rule.key.c_str()) && (rule.value.empty() || req.value(buf, rule.key.c_str()) == rule.value))
+                    return (int)i;
+                break;
+            case Rule::CIDR:
+                if (have_ip && (addr.s_addr & rule.mask) == rule.net) return (int)i;
+                break;
+            }
+        }
+        return (int)classes.size() - 1;
+    }
+
+    // Fairness key: the --fair-key header when present, else the client IP.
+    uint64_t client_key(const string& buf, const HttpHead& req, const string& client_ip) const {
+        string key = fair_header.empty() ? string() : req.value(buf, fair_header.c_str());
+        return hash<string>()(key.empty() ? client_ip : "k:" + key);
+    }
+
+    // DRR cost of a request: one unit plus one per 64 KiB of body, capped.
+    static int request_cost(const HttpHead& req) {
+        return 1 + (int)min<long long>(max(0LL, req.content_length) / 65536, 15);
+    }
+
+    // Waits for capacity in class cls; false if queue_timeout_ms passed.
+    bool admit(int cls, uint64_t client, int cost, Ticket& ticket) {
+        unique_lock<mutex> lock(sched_mutex);
+        Class& c = classes[cls];
+        c.admitted++;
+        bool idle = all_of(classes.begin(), classes.end(), [](const Class& k) { return k.tags.empty(); });
+        if (idle && in_service < capacity()) {
+            in_service++;
+            ticket.owner = this;
+            return true;
+        }
+
+        Waiter w;
+        w.client = client;
+        w.cost = cost;
+        c.last_tag = max(vtime, c.last_tag) + 1.0 / c.weight;
+        c.tags.push_back(c.last_tag);
+        c.clients.push(&w);
+        c.queued++;
+        uint64_t start = mono_ns();
+        auto deadline = chrono::steady_clock::now() + chrono::milliseconds(queue_timeout_ms);
+        // Periodic wakeups re-check capacity, which grows when a backend recovers
+        while (!w.granted && chrono::steady_clock::now() < deadline) {
+            w.cv.wait_for(lock, chrono::milliseconds(100));
+            if (!w.granted) dispatch_locked();
+        }
+        uint64_t waited = mono_ns() - start;
+        c.wait_sum_ns += waited;
+        c.wait_max_ns = max(c.wait_max_ns, waited);
+        if (!w.granted) {
+            // Give up the class's latest turn; the remaining tags stay in order
+            c.clients.remove(&w);
+            c.tags.pop_back();
+            c.timeouts++;
+            return false;
+        }
+        ticket.owner = this;
+        return true;
+    }
+
+    void release() {
+        lock_guard<mutex> lock(sched_mutex);
+        in_service--;
+        dispatch_locked();
+    }
+
+    void log_status(ostream& out) {
+        lock_guard<mutex> lock(sched_mutex);
+        out << "Priority Classes (max " << max_conns << " conns/backend, in service " << in_service << "):\n"
+            << fixed << setprecision(2);
+        for (const Class& c : classes) {
+            out << c.name << " Weight: " << c.weight << " Admitted: " << c.admitted << " Queued: " << c.queued
+                << " Waiting: " << c.tags.size() << " Clients: " << c.clients.clients() << " Timeouts: " << c.timeouts
+                << " AvgWait(ms): " << (c.queued ? c.wait_sum_ns / (double)c.queued / 1e6 : 0.0)
+                << " MaxWait(ms): " << c.wait_max_ns / 1e6 << "\n";
+        }
+        out.unsetf(ios::floatfield);
+    }
+};
+
+static PriorityScheduler priority_scheduler;
+
+// One multiplexed h2c connection to a backend (--upstream-h2c). Request
+// threads open streams on it and block on their own stream; a reader thread
+// per connection demultiplexes frames and handles SETTINGS, PING, GOAWAY
+// and flow control. We advertise a 1 MiB stream window, credited back as a
+// stream's data is consumed, so a slow client stalls only its own stream.
+class H2Connection : public enable_shared_from_this<H2Connection> {
+public:
+    enum FrameType : uint8_t {
+        DATA = 0x0, HEADERS = 0x1, RST_STREAM = 0x3, SETTINGS = 0x4,
+        PING = 0x6, GOAWAY = 0x7, WINDOW_UPDATE = 0x8, CONTINUATION = 0x9
+    };
+    enum Flags : uint8_t { END_STREAM = 0x1, ACK = 0x1, END_HEADERS = 0x4, PADDED = 0x8, PRIORITY_FLAG = 0x20 };
+    static constexpr uint32_t REFUSED_STREAM = 0x7, CANCEL = 0x8;
+    static constexpr int64_t STREAM_WINDOW = 1 << 20;
+    static constexpr int64_t CONNECTION_WINDOW = 16 << 20;
+    static constexpr size_t MAX_FRAME = 16384;
+
+    struct Stream {
+        uint32_t id;
+        int64_t send_window;
+        int64_t unacked = 0;  // consumed bytes not yet credited back
+        condition_variable cv;
+        bool has_headers = false;
+        int status = 0;
+        Hpack::Fields headers;
+        deque<string> data;
+        bool end_stream = false;
+        bool reset = false;
+        bool refused = false;  // never processed by the backend; safe to retry
+    };
+
+private:
+    int fd;
+    mutex write_mutex;   // frame writes; taken before state_mutex
+    mutex state_mutex;   // everything below
+    condition_variable changed;  // windows, stream slots, liveness
+    unordered_map<uint32_t, shared_ptr<Stream>> streams;
+    uint32_t next_id = 1;
+    int64_t send_window = 65535;
+    int64_t peer_initial_window = 65535;
+    uint32_t peer_max_streams = 100;  // until the peer's SETTINGS say otherwise
+    size_t peer_max_frame = MAX_FRAME;
+    int64_t unacked = 0;
+    size_t opening = 0;  // open() calls holding a stream slot
+    string control;      // frames queued by the reader thread
+    bool dead = false;
+    bool draining = false;  // GOAWAY received
+    Hpack::Decoder decoder;  // reader thread only
+
+    static string frame_header(size_t len, uint8_t type, uint8_t flags, uint32_t stream) {
+        char h[9] = {(char)(len >> 16), (char)(len >> 8), (char)len, (char)type, (char)flags,
+                     (char)(stream >> 24), (char)(stream >> 16), (char)(stream >> 8), (char)stream};
+        return string(h, 9);
+    }
+
+    static string u32(uint32_t v) {
+        char b[4] = {(char)(v >> 24), (char)(v >> 16), (char)(v >> 8), (char)v};
+        return string(b, 4);
+    }
+
+    static uint32_t get_u32(const string& s, size_t off) {
+        return ((uint32_t)(uint8_t)s[off] << 24) | ((uint32_t)(uint8_t)s[off + 1] << 16) |
+               ((uint32_t)(uint8_t)s[off + 2] << 8) | (uint32_t)(uint8_t)s[off + 3];
+    }
+
+    bool write_locked(const string& frames) {
+        size_t sent = 0;
+        while (sent < frames.size()) {
+            ssize_t n = ::send(fd, frames.data() + sent, frames.size() - sent, MSG_NOSIGNAL);
+            if (n == -1 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            sent += (size_t)n;
+        }
+        return true;
+    }
+
+    bool write(const string& frames) {
+        lock_guard<mutex> lock(write_mutex);
+        {
+            lock_guard<mutex> state(state_mutex);
+            if (dead) return false;
+        }
+        return write_locked(frames) && flush_control_locked();
+    }
+
+    bool flush_control_locked() {
+        string frames;
+        {
+            lock_guard<mutex> lock(state_mutex);
+            frames.swap(control);
+        }
+        return frames.empty() || write_locked(frames);
+    }
+
+    // The reader never blocks on a write: if a request thread is stuck
+    // sending because the backend is not reading, the backend may itself be
+    // waiting for us to read. Its frames are queued and go out with the
+    // next write, or from the reader once the write lock is free.
+    void queue_control(const string& frames) {
+        {
+            lock_guard<mutex> lock(state_mutex);
+            control += frames;
+        }
+        try_flush_control();
+    }
+
+    bool try_flush_control() {
+        unique_lock<mutex> lock(write_mutex, try_to_lock);
+        if (lock.owns_lock()) flush_control_locked();
+        lock_guard<mutex> state(state_mutex);
+        return control.empty();
+    }
+
+    bool read_exact(char* buf, size_t len) {
+        size_t got = 0;
+        while (got < len) {
+            ssize_t n = ::recv(fd, buf + got, len - got, 0);
+            if (n == -1 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            got += (size_t)n;
+        }
+        return true;
+    }
+
+    // Frees connection-level receive window for frames nobody will consume
+    void credit_connection(int64_t n) {
+        if (n > 0) queue_control(frame_header(4, WINDOW_UPDATE, 0, 0) + u32((uint32_t)n));
+    }
+
+    void on_headers(uint32_t id, uint8_t flags, const string& block) {
+        Hpack::Fields fields;
+        if (!decoder.decode(block, fields)) throw runtime_error("HPACK");
+        lock_guard<mutex> lock(state_mutex);
+        auto it = streams.find(id);
+        if (it == streams.end()) return;
+        Stream& s = *it->second;
+        if (!s.has_headers) {
+            int status = 0;
+            for (const auto& f : fields)
+                if (f.first == ":status") status = atoi(f.second.c_str());
+            // 1xx responses are interim; the final one follows
+            if (status >= 200 || (flags & END_STREAM)) {
+                s.status = status;
+                s.headers = move(fields);
+                s.has_headers = true;
+            }
+        }
+        // A second HEADERS block carries trailers, which are dropped
+        if (flags & END_STREAM) s.end_stream = true;
+        s.cv.notify_all();
+    }
+
+    void on_data(uint32_t id, uint8_t flags, string payload, size_t frame_len) {
+        unique_lock<mutex> lock(state_mutex);
+        auto it = streams.find(id);
+        if (it == streams.end()) {
+            lock.unlock();
+            credit_connection((int64_t)frame_len);
+            return;
+        }
+        Stream& s = *it->second;
+        // Padding counts against flow control but is never consumed
+        s.unacked += (int64_t)(frame_len - payload.size());
+        unacked += (int64_t)(frame_len - payload.size());
+        if (!payload.empty()) s.data.push_back(move(payload));
+        if (flags & END_STREAM) s.end_stream = true;
+        s.cv.notify_all();
+    }
+
+    void on_settings(const string& p) {
+        {
+            lock_guard<mutex> lock(state_mutex);
+            for (size_t off = 0; off + 6 <= p.size(); off += 6) {
+                uint16_t id = (uint16_t)(((uint8_t)p[off] << 8) | (uint8_t)p[off + 1]);
+                uint32_t v = get_u32(p, off + 2);
+                if (id == 0x3) {
+                    peer_max_streams = v;
+                } else if (id == 0x4) {
+                    // Applies retroactively to every open stream's window
+                    int64_t delta = (int64_t)v - peer_initial_window;
+                    peer_initial_window = v;
+                    for (auto& s : streams) s.second->send_window += delta;
+                } else if (id == 0x5) {
+                    peer_max_frame = min<size_t>(v, 1 << 20);
+                }
+            }
+            changed.notify_all();
+        }
+        queue_control(frame_header(0, SETTINGS, ACK, 0));
+    }
+
+    void on_goaway(const string& p) {
+        uint32_t last = p.size() >= 4 ? get_u32(p, 0) & 0x7fffffff : 0;
+        lock_guard<mutex> lock(state_mutex);
+        draining = true;
+        // Streams above last_stream_id were never processed
+        for (auto& s : streams) {
+            if (s.first > last) {
+                s.second->reset = s.second->refused = true;
+                s.second->cv.notify_all();
+            }
+        }
+        changed.notify_all();
+    }
+
+    void on_window_update(uint32_t id, const string& p) {
+        if (p.size() < 4) return;
+        int64_t inc = get_u32(p, 0) & 0x7fffffff;
+        lock_guard<mutex> lock(state_mutex);
+        if (id == 0) {
+            send_window += inc;
+        } else {
+            auto it = streams.find(id);
+            if (it != streams.end()) it->second->send_window += inc;
+        }
+        changed.notify_all();
+    }
+
+    void reader() {
+        try {
+            string block;
+            bool in_block = false;
+            uint32_t block_stream = 0;
+            uint8_t block_flags = 0;
+            while (true) {
+                // Queued control frames wait for the write lock, but never
+                // keep us from reading
+                while (!try_flush_control()) {
+                    pollfd pfd{fd, POLLIN, 0};
+                    if (::poll(&pfd, 1, 10) > 0) break;
+                }
+                char h[9];
+                if (!read_exact(h, 9)) break;
+                size_t len = ((size_t)(uint8_t)h[0] << 16) | ((size_t)(uint8_t)h[1] << 8) | (uint8_t)h[2];
+                uint8_t type = (uint8_t)h[3], flags = (uint8_t)h[4];
+                uint32_t id = get_u32(string(h + 5, 4), 0) & 0x7fffffff;
+                if (len > MAX_FRAME) break;
+                string p(len, '\0');
+                if (len && !read_exact(&p[0], len)) break;
+
+                // A header block must continue on the same stream, uninterrupted
+                if (in_block != (type == CONTINUATION) || (in_block && id != block_stream)) break;
+                size_t payload_start = 0, payload_end = len;
+                if ((type == DATA || type == HEADERS) && (flags & PADDED)) {
+                    if (len < 1 || (uint8_t)p[0] >= len) break;
+                    payload_start = 1;
+                    payload_end = len - (uint8_t)p[0];
+                }
+                if (type == HEADERS && (flags & PRIORITY_FLAG)) payload_start += 5;
+                if (payload_start > payload_end) break;
+
+                switch (type) {
+                case DATA:
+                    on_data(id, flags, p.substr(payload_start, payload_end - payload_start), len);
+                    break;
+                case HEADERS:
+                case CONTINUATION:
+                    if (type == HEADERS) {
+                        block_stream = id;
+                        block_flags = flags;
+                    }
+                    block.append(p, payload_start, payload_end - payload_start);
+                    in_block = !(flags & END_HEADERS);
+                    if (block.size() > HttpHead::MAX_HEAD) throw runtime_error("header block too large");
+                    if (!in_block) {
+                        on_headers(block_stream, block_flags, block);
+                        block.clear();
+                    }
+                    break;
+                case RST_STREAM: {
+                    lock_guard<mutex> lock(state_mutex);
+                    auto it = streams.find(id);
+                    if (it != streams.end()) {
+                        it->second->reset = true;
+                        it->second->refused = len >= 4 && get_u32(p, 0) == REFUSED_STREAM;
+                        it->second->cv.notify_all();
+                        changed.notify_all();
+                    }
+                    break;
+                }
+                case SETTINGS:
+                    if (!(flags & ACK)) on_settings(p);
+                    break;
+                case PING:
+                    if (!(flags & ACK)) queue_control(frame_header(8, PING, ACK, 0) + p);
+                    break;
+                case GOAWAY:
+                    on_goaway(p);
+                    break;
+                case WINDOW_UPDATE:
+                    on_window_update(id, p);
+                    break;
+                default:
+                    break;  // PRIORITY, PUSH_PROMISE (disabled) and unknown types
+                }
+            }
+        } catch (const exception&) {
+        }
+        {
+            lock_guard<mutex> lock(state_mutex);
+            dead = true;
+            for (auto& s : streams) {
+                s.second->reset = true;
+                s.second->cv.notify_all();
+            }
+            changed.notify_all();
+        }
+        // Request threads may still hold this connection and try to write;
+        // the descriptor stays ours until the last reference goes, so those
+        // writes fail here instead of landing on a reused fd number
+        ::shutdown(fd, SHUT_RDWR);
+    }
+
+public:
+    const int backend;
+
+    H2Connection(int socket_fd, int backend_index) : fd(socket_fd), backend(backend_index) {}
+
+    ~H2Connection() { ::close(fd); }
+
+    // Sends the preface and our SETTINGS, then starts the reader thread.
+    bool start() {
+        // The reader blocks for as long as the connection lives
+        timeval none{0, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &none, sizeof(none));
+        string settings;
+        settings += string("\0\x2", 2) + u32(0);                       // ENABLE_PUSH = 0
+        settings += string("\0\x4", 2) + u32((uint32_t)STREAM_WINDOW);  // INITIAL_WINDOW_SIZE
+        string out = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n" + frame_header(settings.size(), SETTINGS, 0, 0) + settings +
+                     frame_header(4, WINDOW_UPDATE, 0, 0) + u32((uint32_t)(CONNECTION_WINDOW - 65535));
+        if (!write(out)) return false;
+        std::thread(&H2Connection::reader, shared_from_this()).detach();
+        return true;
+    }
+
+    bool usable() {
+        lock_guard<mutex> lock(state_mutex);
+        return !dead && !draining;
+    }
+
+    size_t active_streams() {
+        lock_guard<mutex> lock(state_mutex);
+        return streams.size();
+    }
+
+    // Ends a connection nobody has opened a stream on; the reader cleans up
+    void abandon() { ::shutdown(fd, SHUT_RDWR); }
+
+    // Opens a stream with a HEADERS (+ CONTINUATION) frame carrying an
+    // encoded header block. Waits while the peer's stream limit is reached.
+    shared_ptr<Stream> open(const string& block, bool end_stream, int timeout_ms) {
+        {
+            unique_lock<mutex> lock(state_mutex);
+            if (!changed.wait_for(lock, chrono::milliseconds(timeout_ms), [this]() {
+                    return dead || draining || streams.size() + opening < peer_max_streams;
+                }) || dead || draining)
+                return nullptr;
+            ++opening;
+        }
+        lock_guard<mutex> write_lock(write_mutex);
+        shared_ptr<Stream> s;
+        size_t max_frame;
+        {
+            lock_guard<mutex> lock(state_mutex);
+            --opening;
+            if (dead || draining) return nullptr;
+            s = make_shared<Stream>();
+            s->id = next_id;
+            next_id += 2;
+            // Out of stream ids: finish what is open and let the pool
+            // replace this connection
+            if (next_id > 0x7fffffff) {
+                draining = true;
+                changed.notify_all();
+            }
+            s->send_window = peer_initial_window;
+            streams[s->id] = s;
+            max_frame = peer_max_frame;
+        }
+        // Stream ids must reach the wire in increasing order, hence the
+        // write lock around both the id allocation and the send
+        string frames;
+        for (size_t off = 0; off < block.size() || off == 0; off += max_frame) {
+            size_t n = min(max_frame, block.size() - off);
+            bool last = off + n >= block.size();
+            uint8_t flags = (last ? END_HEADERS : 0) | (off == 0 && end_stream ? END_STREAM : 0);
+            frames += frame_header(n, off == 0 ? HEADERS : CONTINUATION, flags, s->id) + block.substr(off, n);
+            if (last) break;
+        }
+        if (!write_locked(frames) || !flush_control_locked()) {
+            ::shutdown(fd, SHUT_RDWR);
+            return nullptr;
+        }
+        return s;
+    }
+
+    // Sends request body bytes within the flow-control windows.
+    bool send_data(Stream& s, const char* data, size_t len, bool end_stream, int timeout_ms) {
+        do {
+            size_t n;
+            {
+                unique_lock<mutex> lock(state_mutex);
+                if (len > 0 &&
+                    !changed.wait_for(lock, chrono::milliseconds(timeout_ms), [&]() {
+                        return dead || s.reset || (send_window > 0 && s.send_window > 0);
+                    }))
+                    return false;
+                if (dead || s.reset) return false;
+                n = len ? (size_t)min<int64_t>({(int64_t)len, send_window, s.send_window, (int64_t)peer_max_frame}) : 0;
+                send_window -= (int64_t)n;
+                s.send_window -= (int64_t)n;
+            }
+            bool last = n == len && end_stream;
+            if (!write(frame_header(n, DATA, last ? END_STREAM : 0, s.id) + string(data, n))) return false;
+            data += n;
+            len -= n;
+        } while (len > 0);
+        return true;
+    }
+
+    // Waits for the final response headers; false on reset or timeout.
+    bool wait_headers(Stream& s, int timeout_ms) {
+        unique_lock<mutex> lock(state_mutex);
+        s.cv.wait_for(lock, chrono::milliseconds(timeout_ms), [&]() { return s.has_headers || s.reset; });
+        return s.has_headers;
+    }
+
+    // Next chunk of the response body: 1 with data in out, 0 at the end of
+    // the stream, -1 on reset or timeout. Consumed bytes are credited back
+    // to the backend once enough accumulate.
+    int read_data(Stream& s, string& out, int timeout_ms) {
+        int64_t stream_credit = 0, connection_credit = 0;
+        int rc;
+        {
+            unique_lock<mutex> lock(state_mutex);
+            s.cv.wait_for(lock, chrono::milliseconds(timeout_ms),
+                          [&]() { return !s.data.empty() || s.end_stream || s.reset; });
+            if (!s.data.empty()) {
+                out = move(s.data.front());
+                s.data.pop_front();
+                s.unacked += (int64_t)out.size();
+                unacked += (int64_t)out.size();
+                rc = 1;
+            } else {
+                rc = s.end_stream ? 0 : -1;
+            }
+            if (!s.end_stream && s.unacked >= STREAM_WINDOW / 4) swap(stream_credit, s.unacked);
+            if (unacked >= CONNECTION_WINDOW / 4) swap(connection_credit, unacked);
+        }
+        string frames;
+        if (stream_credit) frames += frame_header(4, WINDOW_UPDATE, 0, s.id) + u32((uint32_t)stream_credit);
+        if (connection_credit) frames += frame_header(4, WINDOW_UPDATE, 0, 0) + u32((uint32_t)connection_credit);
+        if (!frames.empty()) write(frames);
+        return rc;
+    }
+
+    // Forgets a stream, cancelling it if the response was not read to the end.
+    void close(Stream& s) {
+        bool cancel;
+        int64_t credit = 0;
+        {
+            lock_guard<mutex> lock(state_mutex);
+            cancel = !s.end_stream && !s.reset && !dead;
+            streams.erase(s.id);
+            // Data still queued for this stream will never be consumed
+            for (const string& d : s.data) credit += (int64_t)d.size();
+            changed.notify_all();
+        }
+        string frames;
+        if (cancel) frames += frame_header(4, RST_STREAM, 0, s.id) + u32(CANCEL);
+        if (credit > 0) frames += frame_header(4, WINDOW_UPDATE, 0, 0) + u32((uint32_t)credit);
+        if (!frames.empty()) write(frames);
+    }
+};
+
+// Up to --h2-conns long-lived h2c connections per backend. A request takes
+// the least loaded live connection, and a new one is opened only while
+// every existing one already carries streams.
+class H2Pool {
+    BackendManager* manager = nullptr;
+    ConnectionPool* connector = nullptr;
+    size_t per_backend = 0;  // 0 = HTTP/1.1 upstream
+    ProfiledMutex h2_mutex{"h2_mutex"};
+    vector<vector<shared_ptr<H2Connection>>> conns{BackendManager::MAX_BACKENDS};
+    // Connections being opened, per backend; they count against per_backend
+    vector<size_t> connecting = vector<size_t>(BackendManager::MAX_BACKENDS, 0);
+    condition_variable_any settled;  // a connect attempt finished
+
+public:
+    atomic<uint64_t> opened{0}, connect_failures{0}, streams{0}, retries{0}, resets{0};
+
+    void configure(BackendManager* mgr, ConnectionPool* pool, size_t conns_per_backend) {
+        manager = mgr;
+        connector = pool;
+        per_backend = conns_per_backend;
+    }
+
+    bool enabled() const { return per_backend > 0; }
+
+    shared_ptr<H2Connection> get(int index) {
+        shared_ptr<H2Connection> best;
+        {
+            unique_lock<ProfiledMutex> lock(h2_mutex);
+            auto& list = conns[index];
+            while (true) {
+                list.erase(remove_if(list.begin(), list.end(),
+                                     [](const shared_ptr<H2Connection>& c) { return !c->usable(); }),
+                           list.end());
+                best = nullptr;
+                size_t best_load = 0;
+                for (auto& c : list) {
+                    size_t load = c->active_streams();
+                    if (!best || load < best_load) {
+                        best = c;
+                        best_load = load;
+                    }
+                }
+                bool full = list.size() + connecting[index] >= per_backend;
+                if (best && (best_load == 0 || full)) return best;
+                if (!full) break;
+                // Every slot is taken by connections still being opened
+                settled.wait(lock);
+            }
+            connecting[index]++;
+        }
+        shared_ptr<H2Connection> conn;
+        int fd = connector->connect(index);
+        if (fd != -1) {
+            conn = make_shared<H2Connection>(fd, index);
+            if (!conn->start()) conn = nullptr;
+        }
+        lock_guard<ProfiledMutex> lock(h2_mutex);
+        connecting[index]--;
+        settled.notify_all();
+        if (!conn) {
+            connect_failures.fetch_add(1, memory_order_relaxed);
+            return best;
+        }
+        opened.fetch_add(1, memory_order_relaxed);
+        if (conns[index].size() >= per_backend) {
+            // Filled up meanwhile (the reservation makes this rare)
+            conn->abandon();
+            return best ? best : conns[index].front();
+        }
+        conns[index].push_back(conn);
+        return conn;
+    }
+
+    void log_status(ostream& out) {
+        out << "HTTP/2 Upstream (h2c, " << per_backend << " conns/backend):\n"
+            << "Opened: " << opened << " ConnectFailures: " << connect_failures << " Streams: " << streams
+            << " Retries: " << retries << " Resets: " << resets << "\n";
+        lock_guard<ProfiledMutex> lock(h2_mutex);
+        for (size_t i = 0; i < manager->size(); ++i) {
+            if (conns[i].empty()) continue;
+            size_t active = 0;
+            for (auto& c : conns[i]) active += c->active_streams();
+            out << manager->endpoint((int)i).label << " Connections: " << conns[i].size()
+                << " ActiveStreams: " << active << "\n";
+        }
+    }
+};
+
+static H2Pool h2_pool;
+
+// HTTP/1.1 pipelining to backends (--upstream-pipeline=DEPTH). GET and HEAD
+// requests without a body share keep-alive connections ("lanes") with up to
+// DEPTH requests outstanding on each. Requests that queue up while another
+// thread is writing to the lane go out with its next writev. Responses
+// return in request order, and each request thread reads its own when its
+// turn comes; bytes read past it are handed to the next one.
+class PipelinePool {
+public:
+    struct Lane {
+        const int fd;
+        const int backend;
+        mutex lane_mutex;
+        condition_variable turn_cv;
+        uint64_t next_seq = 0;   // given to the next queued request
+        uint64_t written = 0;    // requests [0, written) are on the wire
+        uint64_t read_turn = 0;  // request whose response is read next
+        bool writing = false;
+        bool broken = false;  // no more responses will come
+        uint64_t idle_since;
+        vector<pair<uint64_t, const vector<iovec>*>> queue;
+        string leftover;
+
+        Lane(int socket_fd, int index) : fd(socket_fd), backend(index), idle_since(mono_ns()) {}
+        ~Lane() { ::close(fd); }
+    };
+
+private:
+    ConnectionPool* connector = nullptr;
+    BackendManager* manager = nullptr;
+    size_t depth = 0;  // 0 = off
+    uint64_t idle_timeout_ns = 4000000000ULL;  // same as ConnectionPool
+    ProfiledMutex lanes_mutex{"lanes_mutex"};
+    vector<vector<shared_ptr<Lane>>> lanes{BackendManager::MAX_BACKENDS};
+
+    // Writes everything queued on the lane. Whoever finds the lane idle
+    // becomes its writer and keeps going while more requests arrive.
+    void write_queued(Lane& lane, unique_lock<mutex>& lock) {
+        lane.writing = true;
+        while (!lane.queue.empty() && !lane.broken) {
+            auto batch = move(lane.queue);
+            lane.queue.clear();
+            lock.unlock();
+            vector<iovec> iov;
+            for (auto& q : batch) iov.insert(iov.end(), q.second->begin(), q.second->end());
+            bool ok = true;
+            for (size_t off = 0; ok && off < iov.size(); off += IOV_MAX)
+                ok = send_iov(lane.fd, iov.data() + off, (int)min<size_t>(IOV_MAX, iov.size() - off));
+            batches.fetch_add(1, memory_order_relaxed);
+            uint64_t n = batch.size();
+            uint64_t prev = max_batch.load(memory_order_relaxed);
+            while (n > prev && !max_batch.compare_exchange_weak(prev, n, memory_order_relaxed)) {}
+            lock.lock();
+            if (ok) lane.written += batch.size();
+            else lane.broken = true;
+            lane.turn_cv.notify_all();
+        }
+        if (lane.broken) lane.queue.clear();
+        lane.writing = false;
+        lane.turn_cv.notify_all();
+    }
+
+public:
+    atomic<uint64_t> opened{0}, requests{0}, batches{0}, max_batch{0}, fallbacks{0};
+
+    void configure(BackendManager* mgr, ConnectionPool* pool, size_t pipeline_depth) {
+        manager = mgr;
+        connector = pool;
+        depth = pipeline_depth;
+    }
+
+    bool enabled() const { return depth > 0; }
+
+    // Queues a request (the iovecs must stay valid until its turn) on a
+    // lane with room, opening one if none has. Returns the lane and sets
+    // seq, or nullptr if the backend cannot be reached.
+    shared_ptr<Lane> submit(int index, const vector<iovec>& iov, uint64_t& seq) {
+        shared_ptr<Lane> lane;
+        {
+            lock_guard<ProfiledMutex> lock(lanes_mutex);
+            auto& list = lanes[index];
+            uint64_t now = mono_ns();
+            list.erase(remove_if(list.begin(), list.end(), [&](const shared_ptr<Lane>& l) {
+                lock_guard<mutex> lane_lock(l->lane_mutex);
+                // Idle lanes may have been closed by the backend meanwhile
+                bool idle = l->read_turn == l->next_seq;
+                return l->broken || (idle && now - l->idle_since > idle_timeout_ns);
+            }), list.end());
+            // Fill the busiest lane that has room, so requests batch up
+            size_t best_load = 0;
+            for (auto& l : list) {
+                lock_guard<mutex> lane_lock(l->lane_mutex);
+                size_t load = l->next_seq - l->read_turn;
+                if (load < depth && (!lane || load > best_load)) {
+                    lane = l;
+                    best_load = load;
+                }
+            }
+        }
+        if (!lane) {
+            int fd = connector->connect(index);
+            if (fd == -1) return nullptr;
+            lane = make_shared<Lane>(fd, index);
+            opened.fetch_add(1, memory_order_relaxed);
+            lock_guard<ProfiledMutex> lock(lanes_mutex);
+            lanes[index].push_back(lane);
+        }
+        requests.fetch_add(1, memory_order_relaxed);
+        unique_lock<mutex> lock(lane->lane_mutex);
+        seq = lane->next_seq++;
+        lane->queue.push_back({seq, &iov});
+        if (!lane->writing) write_queued(*lane, lock);
+        return lane;
+    }
+
+    // Waits until seq's response is next on the wire and takes the bytes
+    // already read past the previous one. False if the lane broke first;
+    // that waits for any writev still using this request's iovecs.
+    bool await_turn(Lane& lane, uint64_t seq, string& leftover) {
+        unique_lock<mutex> lock(lane.lane_mutex);
+        lane.turn_cv.wait(lock, [&]() {
+            return (lane.broken && !lane.writing) || (!lane.broken && lane.read_turn == seq && lane.written > seq);
+        });
+        if (lane.broken) return false;
+        leftover = move(lane.leftover);
+        lane.leftover.clear();
+        return true;
+    }
+
+    // Ends seq's turn. A response that did not end cleanly on a keep-alive
+    // message boundary breaks the lane for the requests queued behind it.
+    void finish(Lane& lane, bool reusable, string leftover) {
+        lock_guard<mutex> lock(lane.lane_mutex);
+        if (!reusable) {
+            lane.broken = true;
+            ::shutdown(lane.fd, SHUT_RDWR);
+        }
+        lane.leftover = move(leftover);
+        ++lane.read_turn;
+        lane.idle_since = mono_ns();
+        lane.turn_cv.notify_all();
+    }
+
+    void log_status(ostream& out) {
+        out << "Pipelining (depth " << depth << "):\n"
+            << "Lanes opened: " << opened << " Requests: " << requests << " Writes: " << batches
+            << " MaxBatch: " << max_batch << " Fallbacks: " << fallbacks << "\n";
+        lock_guard<ProfiledMutex> lock(lanes_mutex);
+        for (size_t i = 0; i < manager->size(); ++i) {
+            if (lanes[i].empty()) continue;
+            size_t outstanding = 0;
+            for (auto& l : lanes[i]) {
+                lock_guard<mutex> lane_lock(l->lane_mutex);
+                outstanding += l->next_seq - l->read_turn;
+            }
+            out << manager->endpoint((int)i).label << " Lanes: " << lanes[i].size()
+                << " Outstanding: " << outstanding << "\n";
+        }
+    }
+};
+
+static PipelinePool pipeline_pool;
+
+// Per-request proxy behaviour chosen on the command line.
+struct ProxyOptions {
+    bool server_timing = false;      // --server-timing
+    long long zerocopy_threshold = 0;  // --zerocopy-threshold, 0 = off
+    bool kernel_timestamps = false;    // --kernel-timestamps
+    int expect_timeout_ms = 200;       // --expect-timeout, wait for a backend's 100 Continue
+};
+
+class ClientHandler {
+    BackendManager* manager;
+    LoadBalancer* balancer;
+    ConnectionPool* pool;
+    ProxyOptions options;
+
+    // In-flight sessions, so shutdown can drain them. Sockets stay tracked
+    // until just before close, so a forced shutdown never hits a reused fd.
+    mutex session_mutex;
+    condition_variable session_cv;
+    set<int> session_fds;
+    int in_flight = 0;
+
+    struct SessionGuard {
+        ClientHandler* handler;
+        ~SessionGuard() {
+            lock_guard<mutex> lock(handler->session_mutex);
+            if (--handler->in_flight == 0) handler->session_cv.notify_all();
+        }
+    };
+
+    void track(int fd) {
+        lock_guard<mutex> lock(session_mutex);
+        session_fds.insert(fd);
+    }
+
+    void untrack(int fd) {
+        lock_guard<mutex> lock(session_mutex);
+        session_fds.erase(fd);
+    }
+
+    void close_tracked(int fd) {
+        untrack(fd);
+        zerocopy_reaper.closing(fd);
+        ::close(fd);
+    }
+
+    static ssize_t recv_some(int fd, char* buf, size_t len) {
+        ssize_t n;
+        do n = ::recv(fd, buf, len, 0); while (n == -1 && errno == EINTR);
+        return n;
+    }
+
+    // Reads until a complete message head is buffered; body bytes that arrived
+    // with it stay in buf after head.length.
+    static bool read_head(int fd, string& buf, HttpHead& head, bool is_response) {
+        char chunk[8192];
+        while (true) {
+            int r = head.parse(buf, is_response);
+            if (r != 0) return r == 1;
+            ssize_t n = recv_some(fd, chunk, sizeof(chunk));
+            if (n <= 0) return false;
+            buf.append(chunk, (size_t)n);
+        }
+    }
+
+    // Sends the buffered request head plus any body bytes already read. The
+    // head is spliced, not copied: traceparent is injected or re-parented
+    // when tracing, and Connection is forced to keep-alive when pooling.
+    bool send_request(int fd, const string& buf, const HttpHead& req, const Tracer::Context* trace) {
+        vector<const HttpHead::Field*> drop;
+        string extra;
+        if (trace) {
+            const HttpHead::Field* existing = req.find("traceparent");
+            // When not recording a span, pass the caller's context through untouched
+            if (!existing || trace->sampled) {
+                drop.push_back(existing);
+                extra += "traceparent: " + Tracer::traceparent(*trace) + "\r\n";
+            }
+        }
+        if (pool->enabled()) {
+            drop.push_back(req.find("connection"));
+            extra += "Connection: keep-alive\r\n";
+        }
+        if (extra.empty()) return send_all(fd, buf.data(), buf.size());
+        return send_spliced(fd, buf, req, drop, extra);
+    }
+
+    // Relays the rest of a message body from src to dst; the bytes buffered
+    // after the head were already sent with it. Without Content-Length or
+    // chunked framing the body runs to EOF when read_to_eof is set.
+    static bool relay_body(int src_fd, int dst_fd, const string& buf, const HttpHead& head, bool read_to_eof) {
+        char chunk[16384];
+        if (head.chunked) {
+            ChunkedTracker tracker;
+            if (tracker.feed(buf.data() + head.length, buf.size() - head.length) == string::npos) return false;
+            while (!tracker.done()) {
+                ssize_t n = recv_some(src_fd, chunk, sizeof(chunk));
+                if (n <= 0) return false;
+                size_t used = tracker.feed(chunk, (size_t)n);
+                if (used == string::npos || !send_all(dst_fd, chunk, used)) return false;
+            }
+            return true;
+        }
+        if (head.content_length < 0) {
+            if (!read_to_eof) return true;
+            while (true) {
+                ssize_t n = recv_some(src_fd, chunk, sizeof(chunk));
+                if (n == 0) return true;
+                if (n < 0 || !send_all(dst_fd, chunk, (size_t)n)) return false;
+            }
+        }
+        long long remaining = head.content_length - (long long)(buf.size() - head.length);
+        while (remaining > 0) {
+            ssize_t n = recv_some(src_fd, chunk, (size_t)min<long long>(remaining, sizeof(chunk)));
+            if (n <= 0 || !send_all(dst_fd, chunk, (size_t)n)) return false;
+            remaining -= n;
+        }
+        return true;
+    }
+
+    static string format_ms(uint64_t from, uint64_t to) {
+        char out[32];
+        snprintf(out, sizeof(out), "%.3f", (to > from ? to - from : 0) / 1e6);
+        return out;
+    }
+
+    // Server-Timing value with the LB's view of this request so far.
+    static string server_timing(const RequestTimings& t, const string& backend) {
+        return "lb-queue;dur=" + format_ms(t.accepted, t.started) +
+               ", lb-connect;dur=" + format_ms(t.selected, t.connected) +
+               ", upstream-ttfb;dur=" + format_ms(t.request_sent, t.first_byte) +
+               ", lb-total;dur=" + format_ms(t.accepted, mono_ns()) +
+               ", backend;desc=\"" + backend + "\"";
+    }
+
+    // UPSTREAM_ERROR: a 5xx head was read and nothing sent, because a stale
+    // cached copy can be served instead.
+    enum class RelayResult { NO_RESPONSE, UPSTREAM_ERROR, BROKEN, DONE, DONE_REUSABLE };
+
+    // Cache context of a cacheable request: where to store the response,
+    // and an expired entry still usable under stale-if-error.
+    struct CachePlan {
+        string key;
+        shared_ptr<const ResponseCache::Entry> stale;
+    };
+
+    static bool keeps_alive(const string& buf, const HttpHead& resp) {
+        string connection = resp.value(buf, "connection");
+        transform(connection.begin(), connection.end(), connection.begin(), ::tolower);
+        return connection.find("close") == string::npos &&
+               (resp.version == "HTTP/1.1" || connection.find("keep-alive") != string::npos);
+    }
+
+    // Reads the rest of a Content-Length body into buf.
+    static bool read_full_body(int fd, string& buf, const HttpHead& resp) {
+        char chunk[16384];
+        size_t total = resp.length + (size_t)resp.content_length;
+        while (buf.size() < total) {
+            ssize_t n = recv_some(fd, chunk, min(sizeof(chunk), total - buf.size()));
+            if (n <= 0) return false;
+            buf.append(chunk, (size_t)n);
+        }
+        return true;
+    }
+
+    // Relays the backend response to the client. The response head is spliced
+    // via iovec (Connection: close for the client, Server-Timing when
+    // enabled), never copied. DONE_REUSABLE means the backend connection
+    // ended on a message boundary and may go back to the pool.
+    // buf holds response bytes already read (by await_continue), if any.
+    // With a cache plan, storable responses are buffered whole and cached.
+    RelayResult relay_response(int backend_fd, int client_fd, const HttpHead& req, RequestTimings& t,
+                               const string& backend, string buf = string(), const CachePlan* cache = nullptr) {
+        HttpHead resp;
+        char chunk[16384];
+        if (buf.empty()) {
+            ssize_t n;
+            if (options.kernel_timestamps) {
+                n = KernelTimestamps::recv_stamped(backend_fd, chunk, sizeof(chunk), t.kernel_rx_upstream);
+                t.kernel_tx_upstream = KernelTimestamps::drain_tx(backend_fd);
+            } else {
+                n = recv_some(backend_fd, chunk, sizeof(chunk));
+            }
+            if (n <= 0) {
+                t.first_byte = mono_ns();
+                return RelayResult::NO_RESPONSE;
+            }
+            buf.append(chunk, (size_t)n);
+        }
+        t.first_byte = mono_ns();
+        if (!read_head(backend_fd, buf, resp, true)) {
+            // Not HTTP we understand: pass through whatever arrives
+            send_all(client_fd, buf.data(), buf.size()) && relay_body(backend_fd, client_fd, "", HttpHead(), true);
+            return RelayResult::BROKEN;
+        }
+
+        if (cache && cache->stale && resp.status >= 500) return RelayResult::UPSTREAM_ERROR;
+        bool fill = cache && response_cache.storable(buf, resp);
+        if (fill && !read_full_body(backend_fd, buf, resp)) return RelayResult::NO_RESPONSE;
+        bool backend_keeps_alive = keeps_alive(buf, resp);
+
+        string extra = "Connection: close\r\n";
+        if (options.server_timing) extra += "Server-Timing: " + server_timing(t, backend) + "\r\n";
+        if (!send_spliced(client_fd, buf, resp, {resp.find("connection")}, extra)) return RelayResult::BROKEN;
+
+        bool no_body = req.method == "HEAD" || resp.status == 204 || resp.status == 304 ||
+                       (resp.status >= 100 && resp.status < 200);
+        bool framed = no_body || resp.chunked || resp.content_length >= 0;
+        bool ok;
+        if (no_body) {
+            ok = buf.size() == resp.length;
+        } else if (options.zerocopy_threshold > 0 && !resp.chunked &&
+                   resp.content_length >= options.zerocopy_threshold && ZeroCopySender::enable(client_fd)) {
+            ok = relay_body_zerocopy(backend_fd, client_fd, resp.content_length - (long long)(buf.size() - resp.length), t);
+        } else {
+            ok = relay_body(backend_fd, client_fd, buf, resp, true);
+        }
+        if (!ok) return RelayResult::BROKEN;
+        if (fill) response_cache.store(cache->key, buf, resp);
+        return (framed && backend_keeps_alive) ? RelayResult::DONE_REUSABLE : RelayResult::DONE;
+    }
+
+    // Stale-while-revalidate: refetches a cached GET with no client
+    // attached. Counted as a session so shutdown waits for it.
+    void refresh_cached(string head, string key, string client_ip) {
+        SessionGuard session{this};
+        response_cache.refreshes.fetch_add(1, memory_order_relaxed);
+        HttpHead req;
+        int index = req.parse(head, false) == 1 ? balancer->select_backend(client_ip) : -1;
+        bool reused = false;
+        int fd = index == -1 ? -1 : pool->acquire(index, reused);
+        if (fd != -1) {
+            track(fd);
+            manager->increment_active(index);
+            string buf;
+            HttpHead resp;
+            bool reusable = false;
+            if (send_request(fd, head, req, nullptr) && read_head(fd, buf, resp, true) &&
+                response_cache.storable(buf, resp) && read_full_body(fd, buf, resp)) {
+                response_cache.store(key, buf, resp);
+                manager->increment_requests(index);
+                reusable = keeps_alive(buf, resp);
+            }
+            manager->decrement_active(index);
+            untrack(fd);
+            pool->release(index, fd, reusable);
+        }
+        response_cache.end_refresh(key);
+    }
+
+    // An HTTP/1.1 request announcing a body with Expect: 100-continue, none
+    // of which the client has sent yet.
+    static bool expects_continue(const string& buf, const HttpHead& req) {
+        string expect = req.value(buf, "expect");
+        transform(expect.begin(), expect.end(), expect.begin(), ::tolower);
+        return expect == "100-continue" && req.version == "HTTP/1.1" &&
+               (req.chunked || req.content_length > 0) && buf.size() == req.length;
+    }
+
+    enum class ContinueResult { CONTINUE, TIMEOUT, FINAL, FAILED };
+
+    // Waits for the backend's answer to an Expect: 100-continue head before
+    // any body is sent. CONTINUE consumes the 100 response; FINAL leaves the
+    // backend's final response in pending; TIMEOUT means the backend stayed
+    // silent (e.g. it ignores Expect) and the body should go anyway; FAILED
+    // means the connection broke, so nothing is lost by trying elsewhere.
+    ContinueResult await_continue(int backend_fd, string& pending) {
+        while (true) {
+            pollfd pfd{backend_fd, POLLIN, 0};
+            int rc;
+            do rc = ::poll(&pfd, 1, options.expect_timeout_ms); while (rc == -1 && errno == EINTR);
+            if (rc == 0 && pending.empty()) return ContinueResult::TIMEOUT;
+            HttpHead head;
+            if (!read_head(backend_fd, pending, head, true)) return ContinueResult::FAILED;
+            if (head.status >= 200) return ContinueResult::FINAL;
+            // 100 or another interim response: drop it and keep waiting
+            pending.erase(0, head.length);
+            if (head.status == 100) return ContinueResult::CONTINUE;
+        }
+    }
+
+    // Large bodies: recv into pooled blocks and send them with MSG_ZEROCOPY,
+    // so the kernel transmits from our pages instead of copying them.
+    static bool relay_body_zerocopy(int backend_fd, int client_fd, long long remaining, RequestTimings& t) {
+        zerocopy_stats.responses.fetch_add(1, memory_order_relaxed);
+        ZeroCopySender sender(client_fd);
+        bool ok = true;
+        while (ok && remaining > 0) {
+            char* block = buffer_pool.acquire();
+            ssize_t n = recv_some(backend_fd, block, (size_t)min<long long>(remaining, BufferPool::BLOCK_SIZE));
+            if (n <= 0) {
+                buffer_pool.release(block);
+                ok = false;
+                break;
+            }
+            remaining -= n;
+            zerocopy_stats.bytes.fetch_add((uint64_t)n, memory_order_relaxed);
+            ok = sender.send_block(block, (size_t)n);
+        }
+        sender.finish(5000);
+        t.kernel_tx_response = sender.latest_tx_timestamp();
+        return ok;
+    }
+
+
+    static const char* reason_phrase(int status) {
+        switch (status) {
+        case 200: return "OK";
+        case 201: return "Created";
+        case 202: return "Accepted";
+        case 204: return "No Content";
+        case 206: return "Partial Content";
+        case 301: return "Moved Permanently";
+        case 302: return "Found";
+        case 304: return "Not Modified";
+        case 400: return "Bad Request";
+        case 401: return "Unauthorized";
+        case 403: return "Forbidden";
+        case 404: return "Not Found";
+        case 405: return "Method Not Allowed";
+        case 429: return "Too Many Requests";
+        case 500: return "Internal Server Error";
+        case 502: return "Bad Gateway";
+        case 503: return "Service Unavailable";
+        case 504: return "Gateway Timeout";
+        default: return "";
+        }
+    }
+
+    // HTTP/2 header block for a request: pseudo-headers, then the other
+    // fields minus the HTTP/1.1 connection-specific ones h2 forbids.
+    static string h2_request_block(const string& buf, const HttpHead& req, const string& authority,
+                                   const Tracer::Context* trace) {
+        static const set<string> HOP_BY_HOP = {"connection", "keep-alive", "proxy-connection", "transfer-encoding",
+                                               "upgrade", "host", "expect"};
+        string block;
+        Hpack::encode_field(block, ":method", req.method, 2);
+        Hpack::encode_field(block, ":scheme", "http", 6);
+        Hpack::encode_field(block, ":path", req.target, 4);
+        Hpack::encode_field(block, ":authority", authority, 1);
+        bool new_traceparent = false;
+        if (trace) {
+            const HttpHead::Field* existing = req.find("traceparent");
+            new_traceparent = !existing || trace->sampled;
+            if (new_traceparent) Hpack::encode_field(block, "traceparent", Tracer::traceparent(*trace));
+        }
+        for (const HttpHead::Field& f : req.fields) {
+            if (HOP_BY_HOP.count(f.name) || (new_traceparent && f.name == "traceparent")) continue;
+            string value = buf.substr(f.value_start, f.value_end - f.value_start);
+            if (f.name == "te" && value != "trailers") continue;
+            Hpack::encode_field(block, f.name, value);
+        }
+        return block;
+    }
+
+    // Relays an h2 response to the client as HTTP/1.1.
+    RelayResult relay_h2_response(H2Connection& conn, H2Connection::Stream& s, int client_fd, const HttpHead& req,
+                                  RequestTimings& t, const string& backend, const CachePlan* cache) {
+        string buf = "HTTP/1.1 " + to_string(s.status) + " " + reason_phrase(s.status) + "\r\n";
+        for (const auto& f : s.headers) {
+            if (f.first.empty() || f.first[0] == ':' || f.first == "connection" || f.first == "transfer-encoding")
+                continue;
+            buf += f.first + ": " + f.second + "\r\n";
+        }
+        buf += "\r\n";
+        HttpHead resp;
+        if (resp.parse(buf, true) != 1) return RelayResult::NO_RESPONSE;
+        if (cache && cache->stale && resp.status >= 500) return RelayResult::UPSTREAM_ERROR;
+
+        bool no_body = req.method == "HEAD" || resp.status == 204 || resp.status == 304;
+        bool fill = !no_body && cache && response_cache.storable(buf, resp);
+        string chunk;
+        int rc = 1;
+        if (fill) {
+            while ((rc = conn.read_data(s, chunk, 10000)) == 1) buf += chunk;
+            if (rc != 0 || (long long)(buf.size() - resp.length) != resp.content_length) return RelayResult::NO_RESPONSE;
+        }
+
+        // Connection: close delimits a body the backend sent without
+        // content-length, so no chunked re-framing is needed
+        string extra = "Connection: close\r\n";
+        if (options.server_timing) extra += "Server-Timing: " + server_timing(t, backend) + "\r\n";
+        if (!send_spliced(client_fd, buf, resp, {}, extra)) return RelayResult::BROKEN;
+        if (fill) {
+            response_cache.store(cache->key, buf, resp);
+            return RelayResult::DONE;
+        }
+        if (no_body) return RelayResult::DONE;
+        while ((rc = conn.read_data(s, chunk, 10000)) == 1)
+            if (!send_all(client_fd, chunk.data(), chunk.size())) return RelayResult::BROKEN;
+        return rc == 0 ? RelayResult::DONE : RelayResult::BROKEN;
+    }
+
+    // Forwards a request as one stream on a shared h2c connection. A stream
+    // the backend refused (REFUSED_STREAM, or beyond a GOAWAY) never reached
+    // the application, so it is retried on another connection or backend as
+    // long as the whole body is still buffered.
+    RelayResult forward_h2(int client_fd, const string& buf, const HttpHead& req, RequestTimings& t,
+                           int& backend_index, const string& client_ip, const Tracer::Context* trace,
+                           const CachePlan* cache) {
+        string authority = req.value(buf, "host");
+        bool expect_continue = expects_continue(buf, req);
+        bool has_body = req.chunked || req.content_length > 0;
+
+        // Body bytes that came with the head, de-chunked
+        string body;
+        ChunkedTracker tracker;
+        long long remaining = 0;
+        if (req.chunked) {
+            if (tracker.feed(buf.data() + req.length, buf.size() - req.length, &body) == string::npos)
+                return RelayResult::BROKEN;
+        } else if (req.content_length > 0) {
+            body = buf.substr(req.length, (size_t)req.content_length);
+            remaining = req.content_length - (long long)body.size();
+        }
+        bool body_done = req.chunked ? tracker.done() : remaining == 0;
+        bool replayable = body_done;
+        bool continued = false;
+
+        vector<int> tried{backend_index};
+        for (int attempt = 0; attempt < 3; ++attempt) {
+            const BackendEndpoint& ep = manager->endpoint(backend_index);
+            string block = h2_request_block(buf, req, authority.empty() ? ep.host : authority, trace);
+            shared_ptr<H2Connection> conn = h2_pool.get(backend_index);
+            shared_ptr<H2Connection::Stream> s = conn ? conn->open(block, !has_body, 10000) : nullptr;
+            t.connected = mono_ns();
+            bool refused = !s;
+            if (s) {
+                h2_pool.streams.fetch_add(1, memory_order_relaxed);
+                bool sent = true;
+                if (has_body) {
+                    if (expect_continue && !continued) {
+                        // The body is read from the client only now; the h2
+                        // stream takes it without a 100 from the backend
+                        static const char CONTINUE_100[] = "HTTP/1.1 100 Continue\r\n\r\n";
+                        continued = true;
+                        sent = send_all(client_fd, CONTINUE_100, sizeof(CONTINUE_100) - 1);
+                    }
+                    sent = sent && conn->send_data(*s, body.data(), body.size(), body_done, 10000);
+                    char chunk[16384];
+                    while (sent && !body_done) {
+                        ssize_t n = recv_some(client_fd, chunk,
+                                              req.chunked ? sizeof(chunk) : (size_t)min<long long>(remaining, sizeof(chunk)));
+                        if (n <= 0) {
+                            sent = false;
+                            break;
+                        }
+                        string piece;
+                        if (req.chunked) {
+                            if (tracker.feed(chunk, (size_t)n, &piece) == string::npos) {
+                                sent = false;
+                                break;
+                            }
+                            body_done = tracker.done();
+                        } else {
+                            piece.assign(chunk, (size_t)n);
+                            remaining -= n;
+                            body_done = remaining == 0;
+                        }
+                        sent = conn->send_data(*s, piece.data(), piece.size(), body_done, 10000);
+                    }
+                }
+                t.request_sent = mono_ns();
+                if (sent && conn->wait_headers(*s, 10000)) {
+                    t.first_byte = mono_ns();
+                    RelayResult result = relay_h2_response(*conn, *s, client_fd, req, t, ep.label, cache);
+                    if (result == RelayResult::BROKEN) h2_pool.resets.fetch_add(1, memory_order_relaxed);
+                    conn->close(*s);
+                    return result;
+                }
+                refused = s->refused;
+                h2_pool.resets.fetch_add(1, memory_order_relaxed);
+                conn->close(*s);
+            }
+            if (!refused || !replayable || attempt == 2) break;
+            h2_pool.retries.fetch_add(1, memory_order_relaxed);
+            int next = balancer->select_backend(client_ip, tried);
+            if (next != -1) {
+                manager->decrement_active(backend_index);
+                manager->increment_active(next);
+                tried.push_back(next);
+                backend_index = next;
+            }
+        }
+        return RelayResult::NO_RESPONSE;
+    }
+
+    // Sends a GET/HEAD on a pipelined lane and relays its response once
+    // earlier responses on the lane have been read. NO_RESPONSE means
+    // nothing reached the client and the request can be sent again.
+    RelayResult forward_pipelined(int client_fd, const string& buf, const HttpHead& req, RequestTimings& t,
+                                  int backend_index, const Tracer::Context* trace, const CachePlan* cache) {
+        string head = buf.substr(0, req.length);
+        vector<const HttpHead::Field*> drop{req.find("connection")};
+        string extra = "Connection: keep-alive\r\n";
+        if (trace) {
+            const HttpHead::Field* existing = req.find("traceparent");
+            if (!existing || trace->sampled) {
+                drop.push_back(existing);
+                extra += "traceparent: " + Tracer::traceparent(*trace) + "\r\n";
+            }
+        }
+        vector<iovec> iov;
+        splice_iov(head, req, drop, extra, iov);
+        uint64_t seq;
+        shared_ptr<PipelinePool::Lane> lane = pipeline_pool.submit(backend_index, iov, seq);
+        t.connected = mono_ns();
+        string rbuf;
+        if (!lane || !pipeline_pool.await_turn(*lane, seq, rbuf)) return RelayResult::NO_RESPONSE;
+        t.request_sent = mono_ns();
+
+        HttpHead resp;
+        bool have_head = read_head(lane->fd, rbuf, resp, true);
+        t.first_byte = mono_ns();
+        if (!have_head || resp.status < 200 || (cache && cache->stale && resp.status >= 500)) {
+            pipeline_pool.finish(*lane, false, "");
+            return have_head && resp.status >= 200 ? RelayResult::UPSTREAM_ERROR : RelayResult::NO_RESPONSE;
+        }
+        bool no_body = req.method == "HEAD" || resp.status == 204 || resp.status == 304;
+        bool framed = no_body || resp.chunked || resp.content_length >= 0;
+        bool reusable = framed && keeps_alive(rbuf, resp);
+
+        // Bytes past this response belong to the next one on the lane
+        string leftover;
+        ChunkedTracker tracker;
+        size_t end = rbuf.size();
+        if (no_body) end = resp.length;
+        else if (resp.content_length >= 0) end = min(end, resp.length + (size_t)resp.content_length);
+        else if (resp.chunked) {
+            size_t used = tracker.feed(rbuf.data() + resp.length, rbuf.size() - resp.length);
+            end = used == string::npos ? string::npos : resp.length + used;
+        }
+        if (end == string::npos) {
+            pipeline_pool.finish(*lane, false, "");
+            return RelayResult::NO_RESPONSE;
+        }
+        leftover = rbuf.substr(end);
+        rbuf.resize(end);
+
+        bool fill = !no_body && cache && response_cache.storable(rbuf, resp);
+        if (fill && !read_full_body(lane->fd, rbuf, resp)) {
+            pipeline_pool.finish(*lane, false, "");
+            return RelayResult::NO_RESPONSE;
+        }
+        string client_extra = "Connection: close\r\n";
+        if (options.server_timing)
+            client_extra += "Server-Timing: " + server_timing(t, manager->endpoint(backend_index).label) + "\r\n";
+        bool ok = send_spliced(client_fd, rbuf, resp, {resp.find("connection")}, client_extra);
+
+        char chunk[16384];
+        if (ok && !no_body && !fill) {
+            if (resp.chunked) {
+                while (ok && !tracker.done()) {
+                    ssize_t n = recv_some(lane->fd, chunk, sizeof(chunk));
+                    size_t used = n > 0 ? tracker.feed(chunk, (size_t)n) : string::npos;
+                    ok = used != string::npos && send_all(client_fd, chunk, used);
+                    if (ok) leftover.assign(chunk + used, (size_t)n - used);
+                }
+            } else {
+                // Content-Length reads never go past the body; close-delimited
+                // bodies end the lane anyway
+                ok = relay_body(lane->fd, client_fd, rbuf, resp, true);
+            }
+        }
+        pipeline_pool.finish(*lane, ok && reusable, move(leftover));
+        if (!ok) return RelayResult::BROKEN;
+        if (fill) response_cache.store(cache->key, rbuf, resp);
+        return RelayResult::DONE;
+    }
+
+public:
+    ClientHandler(BackendManager* mgr, LoadBalancer* lb, ConnectionPool* conn_pool,
+                  const ProxyOptions& opts = ProxyOptions())
+        : manager(mgr), balancer(lb), pool(conn_pool), options(opts) {}
+
+    // Called by the accept loop before the handler thread starts, so a
+    // shutdown that races with accept still waits for this session.
+    void admit(int client_fd) {
+        lock_guard<mutex> lock(session_mutex);
+        ++in_flight;
+        session_fds.insert(client_fd);
+    }
+
+    // Waits for in-flight sessions to finish. At abort_at the remaining
+    // sockets are shut down so their handlers unblock and exit by deadline;
+    // returns false if that was needed.
+    bool drain(chrono::steady_clock::time_point abort_at, chrono::steady_clock::time_point deadline) {
+        unique_lock<mutex> lock(session_mutex);
+        if (session_cv.wait_until(lock, abort_at, [this]() { return in_flight == 0; })) return true;
+        for (int fd : session_fds) ::shutdown(fd, SHUT_RDWR);
+        session_cv.wait_until(lock, deadline, [this]() { return in_flight == 0; });
+        return false;
+    }
+
+    // --kernel-timestamps: the response's last TX timestamp, then the totals.
+    // h2c and pipelined requests share their backend connection, so only
+    // HTTP/1.1 connections of their own get the upstream leg.
+    void record_client_timestamps(int client_fd, RequestTimings& t) {
+        if (!options.kernel_timestamps) return;
+        t.kernel_tx_response = max(t.kernel_tx_response, KernelTimestamps::drain_tx(client_fd, 10));
+        kernel_timestamps.record(t);
+    }
+
+    int sessions_in_flight() {
+        lock_guard<mutex> lock(session_mutex);
+        return in_flight;
+    }
+
+    void handle(int client_fd, const string& client_ip, uint64_t accepted_ns) {
+        SessionGuard session{this};
+        RequestTimings t;
+        t.accepted = accepted_ns;
+        t.started = mono_ns();
+        perf_profiler.count_request();
+        set_timeouts(client_fd, 10);
+
+        string buf;
+        HttpHead req;
+        {
+            PerfStageScope perf_scope(ProxyStage::FORWARD);
+            if (options.kernel_timestamps) {
+                // First read separately so it carries the request's RX timestamp
+                char first[8192];
+                ssize_t n = KernelTimestamps::recv_stamped(client_fd, first, sizeof(first), t.kernel_rx_request);
+                t.first_read = mono_ns();
+                if (n > 0) buf.append(first, (size_t)n);
+            }
+            if (!read_head(client_fd, buf, req, false)) {
+                close_tracked(client_fd);
+                return;
+            }
+        }
+        t.head_read = mono_ns();
+
+        // Cached GETs are answered without touching a backend: fresh entries
+        // directly, stale ones within stale-while-revalidate while one
+        // background request refreshes them
+        CachePlan cache_plan;
+        bool use_cache = response_cache.enabled() && ResponseCache::cacheable_request(buf, req);
+        if (use_cache) {
+            cache_plan.key = ResponseCache::key(buf, req);
+            shared_ptr<const ResponseCache::Entry> cached = response_cache.lookup(cache_plan.key);
+            uint64_t now = mono_ns();
+            if (cached && (cached->fresh(now) || cached->revalidatable(now))) {
+                bool fresh = cached->fresh(now);
+                // A client that went away mid-send is neither a hit nor a reason to refresh
+                bool sent = ResponseCache::send_entry(client_fd, *cached, fresh ? "HIT" : "STALE");
+                if (sent) (fresh ? response_cache.hits : response_cache.stale_hits).fetch_add(1, memory_order_relaxed);
+                if (sent && !fresh && response_cache.begin_refresh(cache_plan.key)) {
+                    {
+                        lock_guard<mutex> lock(session_mutex);
+                        ++in_flight;
+                    }
+                    std::thread(&ClientHandler::refresh_cached, this, buf.substr(0, req.length),
+                                cache_plan.key, client_ip).detach();
+                }
+                close_tracked(client_fd);
+                return;
+            }
+            response_cache.misses.fetch_add(1, memory_order_relaxed);
+            if (cached && cached->usable_on_error(now)) cache_plan.stale = cached;
+        }
+        // Stale-if-error: a failed request gets the stale copy if there is one
+        auto serve_stale = [&]() {
+            if (!cache_plan.stale) return false;
+            if (ResponseCache::send_entry(client_fd, *cache_plan.stale, "STALE-IF-ERROR"))
+                response_cache.error_hits.fetch_add(1, memory_order_relaxed);
+            return true;
+        };
+
+        PriorityScheduler::Ticket ticket;
+        if (priority_scheduler.enabled() &&
+            !priority_scheduler.admit(priority_scheduler.classify(buf, req, client_ip),
+                                      priority_scheduler.client_key(buf, req, client_ip),
+                                      PriorityScheduler::request_cost(req), ticket)) {
+            string msg = "HTTP/1.1 503 Service Unavailable\r\nRetry-After: 1\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+            send_all(client_fd, msg.c_str(), msg.size());
+            close_tracked(client_fd);
+            return;
+        }
+
+        int backend_index = balancer->select_backend(client_ip);
+        t.selected = mono_ns();
+        if (backend_index == -1) {
+            string msg = "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+            if (!serve_stale()) send_all(client_fd, msg.c_str(), msg.size());
+            close_tracked(client_fd);
+            return;
+        }
+
+        if (h2_pool.enabled()) {
+            manager->increment_active(backend_index);
+            Tracer::Context trace;
+            bool traced = tracer.enabled();
+            if (traced) trace = tracer.begin(req.value(buf, "traceparent"));
+            RelayResult result;
+            {
+                PerfStageScope perf_scope(ProxyStage::FORWARD);
+                result = forward_h2(client_fd, buf, req, t, backend_index, client_ip, traced ? &trace : nullptr,
+                                    use_cache ? &cache_plan : nullptr);
+            }
+            t.finished = mono_ns();
+            if ((result == RelayResult::NO_RESPONSE || result == RelayResult::UPSTREAM_ERROR) && !serve_stale()) {
+                string msg = "HTTP/1.1 502 Bad Gateway\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+                send_all(client_fd, msg.c_str(), msg.size());
+            }
+            if (result == RelayResult::DONE) manager->increment_requests(backend_index);
+            manager->decrement_active(backend_index);
+            record_client_timestamps(client_fd, t);
+            close_tracked(client_fd);
+            if (traced && trace.sampled)
+                tracer.record(trace, t, client_ip, manager->endpoint(backend_index).label);
+            return;
+        }
+
+        // Pipelined requests that never got an answer (the lane broke, or
+        // the backend closed it) go again below on a connection of their own
+        if (pipeline_pool.enabled() && (req.method == "GET" || req.method == "HEAD") && !req.chunked &&
+            req.content_length <= 0) {
+            manager->increment_active(backend_index);
+            Tracer::Context trace;
+            bool traced = tracer.enabled();
+            if (traced) trace = tracer.begin(req.value(buf, "traceparent"));
+            RelayResult result;
+            {
+                PerfStageScope perf_scope(ProxyStage::FORWARD);
+                result = forward_pipelined(client_fd, buf, req, t, backend_index, traced ? &trace : nullptr,
+                                           use_cache ? &cache_plan : nullptr);
+            }
+            manager->decrement_active(backend_index);
+            if (result != RelayResult::NO_RESPONSE) {
+                t.finished = mono_ns();
+                if (result == RelayResult::UPSTREAM_ERROR && !serve_stale()) {
+                    string msg = "HTTP/1.1 502 Bad Gateway\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+                    send_all(client_fd, msg.c_str(), msg.size());
+                }
+                if (result == RelayResult::DONE) manager->increment_requests(backend_index);
+                record_client_timestamps(client_fd, t);
+                close_tracked(client_fd);
+                if (traced && trace.sampled)
+                    tracer.record(trace, t, client_ip, manager->endpoint(backend_index).label);
+                return;
+            }
+            pipeline_pool.fallbacks.fetch_add(1, memory_order_relaxed);
+        }
+
+        // Nothing has been sent yet, so a backend that refuses the connection
+        // is swapped for another healthy one
+        vector<int> tried{backend_index};
+        bool reused = false;
+        int backend_fd = pool->acquire(backend_index, reused);
+        while (backend_fd == -1 && (backend_index = balancer->select_backend(client_ip, tried)) != -1) {
+            tried.push_back(backend_index);
+            backend_fd = pool->acquire(backend_index, reused);
+        }
+        t.connected = mono_ns();
+        if (backend_fd == -1) {
+            string msg = "HTTP/1.1 503 Backend Connection Failed\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+            if (!serve_stale()) send_all(client_fd, msg.c_str(), msg.size());
+            close_tracked(client_fd);
+            return;
+        }
+        track(backend_fd);
+
+        manager->increment_active(backend_index);
+
+        Tracer::Context trace;
+        bool traced = tracer.enabled();
+        if (traced) trace = tracer.begin(req.value(buf, "traceparent"));
+
+        // A pooled connection may have been closed by the backend just as we
+        // reused it. If nothing came back and the whole request is still in
+        // buf, replay it once on a fresh connection. With Expect: 100-continue
+        // the body stays with the client until a backend accepts the head, so
+        // a backend that fails before then is swapped for another one.
+        bool expect_continue = expects_continue(buf, req);
+        bool replayable = expect_continue ||
+                          (!req.chunked && (long long)(buf.size() - req.length) >= max(0LL, req.content_length));
+        const string* backend_label = &manager->endpoint(backend_index).label;
+        RelayResult result = RelayResult::BROKEN;
+        for (int attempt = 0; attempt < 3; ++attempt) {
+            bool sent, body_refused = false;
+            string pending;
+            {
+                PerfStageScope perf_scope(ProxyStage::FORWARD);
+                sent = send_request(backend_fd, buf, req, traced ? &trace : nullptr);
+                if (sent && expect_continue) {
+                    ContinueResult cont = await_continue(backend_fd, pending);
+                    if (cont == ContinueResult::FAILED) {
+                        sent = false;
+                    } else if (cont == ContinueResult::FINAL) {
+                        body_refused = true;
+                    } else {
+                        static const char CONTINUE_100[] = "HTTP/1.1 100 Continue\r\n\r\n";
+                        replayable = false;
+                        sent = send_all(client_fd, CONTINUE_100, sizeof(CONTINUE_100) - 1);
+                    }
+                }
+                if (sent && !body_refused) sent = relay_body(client_fd, backend_fd, buf, req, false);
+            }
+            t.request_sent = mono_ns();
+            if (sent) {
+                // Read backend response and forward back
+                PerfStageScope perf_scope(ProxyStage::FORWARD);
+                result = relay_response(backend_fd, client_fd, req, t, *backend_label, pending,
+                                        use_cache ? &cache_plan : nullptr);
+                // The backend never got the body it may still be expecting
+                if (body_refused && result == RelayResult::DONE_REUSABLE) result = RelayResult::DONE;
+            }
+            bool retry = replayable && (reused || expect_continue) && (!sent || result == RelayResult::NO_RESPONSE);
+            if (!retry || attempt == 2) {
+                if (!sent) result = expect_continue && replayable ? RelayResult::NO_RESPONSE : RelayResult::BROKEN;
+                break;
+            }
+            untrack(backend_fd);
+            pool->discard(backend_index, backend_fd);
+            int next = expect_continue ? balancer->select_backend(client_ip, tried) : -1;
+            if (next != -1) {
+                manager->decrement_active(backend_index);
+                manager->increment_active(next);
+                tried.push_back(next);
+                backend_index = next;
+                backend_label = &manager->endpoint(backend_index).label;
+                backend_fd = pool->acquire(backend_index, reused);
+            } else {
+                reused = false;
+                backend_fd = pool->connect(backend_index);
+            }
+            if (backend_fd == -1) {
+                result = RelayResult::NO_RESPONSE;
+                break;
+            }
+            track(backend_fd);
+        }
+        t.finished = mono_ns();
+
+        if ((result == RelayResult::NO_RESPONSE || result == RelayResult::UPSTREAM_ERROR) && !serve_stale()) {
+            string msg = "HTTP/1.1 502 Bad Gateway\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+            send_all(client_fd, msg.c_str(), msg.size());
+        }
+        if (result == RelayResult::DONE || result == RelayResult::DONE_REUSABLE)
+            manager->increment_requests(backend_index);
+        manager->decrement_active(backend_index);
+
+        if (backend_fd != -1) {
+            if (options.kernel_timestamps) KernelTimestamps::drain_tx(backend_fd);
+            untrack(backend_fd);
+            pool->release(backend_index, backend_fd, result == RelayResult::DONE_REUSABLE);
+        }
+        record_client_timestamps(client_fd, t);
+        close_tracked(client_fd);
+
+        if (traced && trace.sampled)
+            tracer.record(trace, t, client_ip, *backend_label);
+    }
+};
+
+// Everything that goes into status.txt and the admin /status endpoint.
+// Samples the listeners' accept queues (TCP_INFO on a listening socket
+// reports the current depth in tcpi_unacked and the backlog in tcpi_sacked;
+// with --reuseport each socket has its own queue, summed here) and the
+// host-wide ListenOverflows/ListenDrops counters from
+// /proc/net/netstat. Overflows mean SYNs or completed handshakes were
+// dropped, which clients see as 1s/3s retransmit stalls.
+class ListenMonitor {
+    vector<int> listen_fds;
+    atomic<bool> running{false};
+    thread worker;
+    mutex wake_mutex;
+    condition_variable wake;
+    unsigned long long base_overflows = 0, base_drops = 0;
+    unsigned long long last_overflows = 0, last_drops = 0;
+
+    // A condition that lasts through an overload would otherwise print every
+    // sample: warn when it starts, then at most once per WARN_INTERVAL_NS
+    // with a count of the samples in between, and once more when it clears.
+    static constexpr uint64_t WARN_INTERVAL_NS = 10000000000ULL;
+    struct Throttle {
+        const char* name;
+        bool active = false;
+        uint64_t last_ns = 0;
+        unsigned long long suppressed = 0;
+    };
+    Throttle queue_full{"accept queue full"}, queue_overflow{"listen queue overflow"};
+
+    static void report(Throttle& t, bool active, const string& message) {
+        if (!active) {
+            if (t.active && t.suppressed)
+                cerr << "Warning cleared: " << t.name << " (" << t.suppressed << " more sample(s) since the last warning)\n";
+            t.active = false;
+            t.suppressed = 0;
+            return;
+        }
+        uint64_t now = mono_ns();
+        if (t.active && now - t.last_ns < WARN_INTERVAL_NS) {
+            ++t.suppressed;
+            return;
+        }
+        cerr << "Warning: " << message;
+        if (t.suppressed) cerr << " [" << t.suppressed << " similar warning(s) suppressed]";
+        cerr << "\n";
+        t.active = true;
+        t.last_ns = now;
+        t.suppressed = 0;
+    }
+
+public:
+    atomic<unsigned> depth{0}, max_depth{0}, backlog{0};
+    atomic<unsigned long long> overflows{0}, drops{0}, warnings{0};
+
+    // TcpExt ListenOverflows / ListenDrops; false if unavailable
+    static bool read_netstat(unsigned long long& overflows, unsigned long long& drops) {
+        ifstream in("/proc/net/netstat");
+        string names, values;
+        while (getline(in, names) && getline(in, values)) {
+            if (names.rfind("TcpExt:", 0) != 0) continue;
+            istringstream n(names), v(values);
+            string name, value;
+            bool found_o = false, found_d = false;
+            while (n >> name && v >> value) {
+                if (name == "ListenOverflows") { overflows = stoull(value); found_o = true; }
+                else if (name == "ListenDrops") { drops = stoull(value); found_d = true; }
+            }
+            return found_o && found_d;
+        }
+        return false;
+    }
+
+    static int somaxconn() {
+        ifstream in("/proc/sys/net/core/somaxconn");
+        int v = 0;
+        return (in >> v) ? v : 0;
+    }
+
+    void sample() {
+        unsigned total_depth = 0, total_backlog = 0;
+        string full;
+        for (int fd : listen_fds) {
+            tcp_info info{};
+            socklen_t len = sizeof(info);
+            if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) != 0) continue;
+            total_depth += info.tcpi_unacked;
+            total_backlog += info.tcpi_sacked;
+            if (info.tcpi_sacked && info.tcpi_unacked * 4 >= info.tcpi_sacked * 3) {
+                ++warnings;
+                if (full.empty())
+                    full = "accept queue " + to_string(info.tcpi_unacked) + "/" + to_string(info.tcpi_sacked) +
+                           " full; connections are being accepted too slowly";
+            }
+        }
+        report(queue_full, !full.empty(), full);
+        depth = total_depth;
+        backlog = total_backlog;
+        if (total_depth > max_depth) max_depth = total_depth;
+        unsigned long long o, d;
+        if (read_netstat(o, d)) {
+            bool overflowed = o > last_overflows || d > last_drops;
+            if (overflowed) ++warnings;
+            report(queue_overflow, overflowed,
+                   "listen queue overflowed (" + to_string(o - last_overflows) + " overflows, " +
+                       to_string(d - last_drops) + " drops since last sample)");
+            last_overflows = o;
+            last_drops = d;
+            overflows = o - base_overflows;
+            drops = d - base_drops;
+        }
+    }
+
+    void start(const vector<int>& fds, int requested_backlog, int interval_ms) {
+        listen_fds = fds;
+        int cap = somaxconn();
+        if (cap > 0 && requested_backlog > cap)
+            cerr << "Warning: backlog " << requested_backlog << " is capped by net.core.somaxconn=" << cap << "\n";
+        if (read_netstat(base_overflows, base_drops)) {
+            last_overflows = base_overflows;
+            last_drops = base_drops;
+        }
+        running = true;
+        worker = thread([this, interval_ms]() {
+            while (running) {
+                {
+                    unique_lock<mutex> lock(wake_mutex);
+                    if (wake.wait_for(lock, chrono::milliseconds(interval_ms), [this]() { return !running; })) break;
+                }
+                sample();
+            }
+        });
+    }
+
+    void stop() {
+        if (!running.exchange(false)) return;
+        {
+            lock_guard<mutex> lock(wake_mutex);
+        }
+        wake.notify_all();
+        if (worker.joinable()) worker.join();
+    }
+
+    bool enabled() const { return !listen_fds.empty(); }
+
+    void log_status(ostream& out) {
+        out << "Listen Queue:\n"
+            << "Depth: " << depth << " MaxDepth: " << max_depth << " Backlog: " << backlog
+            << " Overflows: " << overflows << " Drops: " << drops << " Warnings: " << warnings << "\n";
+    }
+};
+
+static ListenMonitor listen_monitor;
+
+// Per-core listeners (--reuseport[=N]): N sockets share port 8080 through
+// SO_REUSEPORT, each with its own accept queue and accept thread, so accepts
+// no longer serialize on one socket. The kernel's own pick hashes the
+// 4-tuple, which ignores the CPU the SYN arrived on and can load listeners
+// unevenly. A classic BPF program attached with SO_ATTACH_REUSEPORT_CBPF
+// makes the pick instead; its return value indexes the group in bind order
+// (out of range falls back to the hash):
+//   cpu  - the CPU running the receive softirq, modulo N. Listener i's
+//          thread, and the handler threads it starts, are pinned to the CPUs
+//          that map to i, so handshake, accept() and request stay on one
+//          core's caches.
+//   hash - a multiplicative hash of client address and port, modulo N.
+class ReusePortListeners {
+public:
+    enum Steering { KERNEL, CPU, HASH };
+
+private:
+    size_t count = 0;
+    Steering steering = CPU;
+    bool attached = false;
+    unique_ptr<atomic<uint64_t>[]> accepted;
+
+    static const char* steering_name(Steering s) {
+        return s == CPU ? "cpu" : s == HASH ? "hash" : "kernel";
+    }
+
+    // For TCP the filter runs with the packet positioned at the payload, so
+    // the IP and TCP headers are read through the SKF_NET_OFF window
+    vector<sock_filter> program() const {
+        uint32_t n = (uint32_t)count;
+        if (steering == CPU)
+            return {
+                BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (uint32_t)(SKF_AD_OFF + SKF_AD_CPU)),
+                BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, n),
+                BPF_STMT(BPF_RET | BPF_A, 0),
+            };
+        return {
+            BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (uint32_t)(SKF_NET_OFF + 12)),  // source address
+            BPF_STMT(BPF_ST, 0),
+            BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, (uint32_t)SKF_NET_OFF),        // X = IP header length
+            BPF_STMT(BPF_LD | BPF_H | BPF_IND, (uint32_t)SKF_NET_OFF),         // source port
+            BPF_STMT(BPF_MISC | BPF_TAX, 0),
+            BPF_STMT(BPF_LD | BPF_MEM, 0),
+            BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+            // Fibonacci hashing: the high half depends on every input bit
+            BPF_STMT(BPF_ALU | BPF_MUL | BPF_K, 0x9e3779b1u),
+            BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 16),
+            BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, n),
+            BPF_STMT(BPF_RET | BPF_A, 0),
+        };
+    }
+
+public:
+    bool configure(size_t listeners, const string& steer) {
+        if (steer == "cpu") steering = CPU;
+        else if (steer == "hash") steering = HASH;
+        else if (steer == "kernel") steering = KERNEL;
+        else return false;
+        count = listeners;
+        accepted.reset(new atomic<uint64_t>[count]());
+        return true;
+    }
+
+    bool enabled() const { return count > 0; }
+    size_t size() const { return count; }
+
+    // Called once every socket of the group is listening; any member
+    // carries the program for the whole group. Failure leaves the kernel's
+    // hash in charge, which still spreads the load
+    void attach(int fd) {
+        if (steering == KERNEL || count < 2) return;
+        vector<sock_filter> code = program();
+        sock_fprog prog{(unsigned short)code.size(), code.data()};
+        if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) == 0) attached = true;
+        else perror("SO_ATTACH_REUSEPORT_CBPF");
+    }
+
+    // cpu steering: binds the calling accept thread to the CPUs whose
+    // softirqs land on listener `index`. Threads it creates inherit this
+    void pin(size_t index) const {
+        if (!attached || steering != CPU) return;
+        cpu_set_t allowed, mine;
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return;
+        CPU_ZERO(&mine);
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+            if (CPU_ISSET(cpu, &allowed) && (size_t)cpu % count == index) CPU_SET(cpu, &mine);
+        if (CPU_COUNT(&mine) > 0) pthread_setaffinity_np(pthread_self(), sizeof(mine), &mine);
+    }
+
+    void count_accept(size_t index) { accepted[index].fetch_add(1, memory_order_relaxed); }
+
+    void log_status(ostream& out) {
+        out << "Reuseport Listeners:\n"
+            << "Listeners: " << count << " Steering: " << steering_name(steering)
+            << (attached || steering == KERNEL || count < 2 ? "" : " (not attached, kernel hash)") << " Accepted:";
+        for (size_t i = 0; i < count; ++i) out << " " << accepted[i];
+        out << "\n";
+    }
+};
+
+static ReusePortListeners reuseport_listeners;
+
+// IP access control (--acl=FILE), checked right after accept() so a refused
+// client costs no thread and no parsing. Each line is "allow CIDR" or
+// "deny CIDR" (IPv4 or IPv6). The longest matching prefix decides; an
+// address no rule covers is allowed unless the file has allow rules. The
+// listeners are IPv4-only today, so IPv6 rules load but match no client.
+// Rules compile into a poptrie: the first 16 bits index a direct table, and
+// every later 6-bit step finds its child or leaf by popcount over a 64-bit
+// bitmap, so a lookup touches a few cache lines however many rules there
+// are. SIGHUP wakes a reloader thread that rebuilds the table off the
+// accept path and publishes it with one atomic pointer store. A lookup only
+// bumps its thread's own reader counter, so acceptors on different CPUs share
+// no cache line; the reloader frees the old table once every counter has
+// been seen at zero after the swap.
+class AccessList {
+    using Key = unsigned __int128;  // address bits, left-aligned
+    enum : uint8_t { NO_MATCH = 0, ALLOW = 1, DENY = 2 };
+    static constexpr uint32_t NODE = 0x80000000u;  // direct entry holds a node index
+    static constexpr int DIRECT_BITS = 16;
+    static constexpr int STRIDE = 6;
+
+    struct Rule {
+        Key key;
+        int len;
+        uint8_t action;
+    };
+
+    struct Node {
+        uint64_t children;  // slots that continue in a child node
+        uint64_t leaves;    // leaf slots that start a run of equal leaves
+        uint32_t child_base, leaf_base;
+    };
+
+    struct Table {
+        vector<uint32_t> direct[2];  // IPv4, IPv6
+        vector<Node> nodes;
+        vector<uint8_t> leaf_values;
+        uint8_t fallback = ALLOW;
+        size_t rules[2] = {0, 0};
+    };
+
+    // Lookups in progress, per thread slot; threads beyond READER_SLOTS share
+    struct alignas(64) ReaderSlot {
+        atomic<uint32_t> active{0};
+    };
+    static constexpr size_t READER_SLOTS = 64;
+
+    atomic<const Table*> current{nullptr};
+    unique_ptr<const Table> live;  // owns *current; replaced under reload_mutex
+    ReaderSlot readers[READER_SLOTS];
+    atomic<size_t> next_slot{0};
+    mutex reload_mutex;
+    string path;
+
+    // SIGHUPs that arrive while a reload runs collapse into one more
+    mutex wake_mutex;
+    condition_variable wake;
+    bool reload_pending = false;
+    atomic<bool> running{false};
+    thread worker;
+
+    static unsigned slot(Key key, int depth, int width) { return (unsigned)((key << depth) >> (128 - width)); }
+
+    // Fills one trie level: `rules` all lie under the current node and are
+    // longer than depth. Rules ending within this level paint the slots they
+    // cover (shorter first, so longer ones win); longer rules go to a child.
+    static void expand(const vector<Rule>& rules, int depth, int width, uint8_t inherited,
+                       vector<uint8_t>& values, vector<vector<Rule>>& deeper) {
+        size_t slots = (size_t)1 << width;
+        values.assign(slots, inherited);
+        deeper.assign(slots, {});
+        vector<const Rule*> ending;
+        for (const Rule& r : rules) {
+            if (r.len <= depth + width) ending.push_back(&r);
+            else deeper[slot(r.key, depth, width)].push_back(r);
+        }
+        stable_sort(ending.begin(), ending.end(), [](const Rule* a, const Rule* b) { return a->len < b->len; });
+        for (const Rule* r : ending) {
+            size_t first = slot(r->key, depth, width);
+            size_t count = (size_t)1 << (depth + width - r->len);
+            fill(values.begin() + first, values.begin() + first + count, r->action);
+        }
+    }
+
+    static Node build_node(Table& t, const vector<Rule>& rules, int depth, uint8_t inherited) {
+        vector<uint8_t> values;
+        vector<vector<Rule>> deeper;
+        expand(rules, depth, STRIDE, inherited, values, deeper);
+        Node n{0, 0, 0, (uint32_t)t.leaf_values.size()};
+        int last_leaf = -1;
+        for (unsigned v = 0; v < 64; ++v) {
+            if (!deeper[v].empty()) {
+                n.children |= 1ULL << v;
+            } else if (last_leaf == -1 || values[v] != last_leaf) {
+                n.leaves |= 1ULL << v;
+                t.leaf_values.push_back(values[v]);
+                last_leaf = values[v];
+            }
+        }
+        // Children are contiguous: reserve their slots before recursing
+        n.child_base = (uint32_t)t.nodes.size();
+        t.nodes.resize(t.nodes.size() + (size_t)__builtin_popcountll(n.children));
+        uint32_t next = n.child_base;
+        for (unsigned v = 0; v < 64; ++v)
+            if (n.children >> v & 1) t.nodes[next++] = build_node(t, deeper[v], depth + STRIDE, values[v]);
+        return n;
+    }
+
+    static void build_family(Table& t, int family, const vector<Rule>& rules) {
+        vector<uint8_t> values;
+        vector<vector<Rule>> deeper;
+        expand(rules, 0, DIRECT_BITS, NO_MATCH, values, deeper);
+        t.direct[family].resize(values.size());
+        for (size_t i = 0; i < values.size(); ++i) {
+            if (deeper[i].empty()) {
+                t.direct[family][i] = values[i];
+            } else {
+                Node n = build_node(t, deeper[i], DIRECT_BITS, values[i]);
+                t.direct[family][i] = NODE | (uint32_t)t.nodes.size();
+                t.nodes.push_back(n);
+            }
+        }
+    }
+
+    static bool parse_rule(const string& line, Rule& rule, int& family) {
+        istringstream in(line);
+        string verb, cidr;
+        if (!(in >> verb >> cidr)) return false;
+        if (verb == "allow") rule.action = ALLOW;
+        else if (verb == "deny") rule.action = DENY;
+        else return false;
+        size_t slash = cidr.find('/');
+        string ip = cidr.substr(0, slash);
+        unsigned char bytes[16] = {};
+        if (inet_pton(AF_INET, ip.c_str(), bytes) == 1) family = 0;
+        else if (inet_pton(AF_INET6, ip.c_str(), bytes) == 1) family = 1;
+        else return false;
+        int bits = family == 0 ? 32 : 128;
+        rule.len = slash == string::npos ? bits : atoi(cidr.c_str() + slash + 1);
+        if (rule.len < 0 || rule.len > bits) return false;
+        rule.key = 0;
+        for (int i = 0; i < bits / 8; ++i) rule.key |= (Key)bytes[i] << (120 - 8 * i);
+        if (rule.len < 128) rule.key &= ~(~(Key)0 >> rule.len);  // host bits off
+        return true;
+    }
+
+    ReaderSlot& reader_slot() {
+        thread_local size_t slot = next_slot.fetch_add(1, memory_order_relaxed) % READER_SLOTS;
+        return readers[slot];
+    }
+
+    // Caller holds a reader slot, so *t outlives the call
+    static uint8_t lookup(const Table* t, int family, Key key) {
+        uint32_t e = t->direct[family][(size_t)(key >> (128 - DIRECT_BITS))];
+        int depth = DIRECT_BITS;
+        while (e & NODE) {
+            const Node& n = t->nodes[e & ~NODE];
+            unsigned v = slot(key, depth, STRIDE);
+            uint64_t upto = (2ULL << v) - 1;  // bits 0..v; all ones for v = 63
+            if (!(n.children >> v & 1)) {
+                uint8_t leaf = t->leaf_values[n.leaf_base + __builtin_popcountll(n.leaves & upto) - 1];
+                return leaf == NO_MATCH ? t->fallback : leaf;
+            }
+            e = NODE | (n.child_base + __builtin_popcountll(n.children & upto) - 1);
+            depth += STRIDE;
+        }
+        return e == NO_MATCH ? t->fallback : (uint8_t)e;
+    }
+
+public:
+    atomic<uint64_t> allowed{0}, denied{0}, reloads{0}, reload_failures{0};
+    atomic<uint64_t> build_us{0};
+
+    bool enabled() const { return current.load(memory_order_relaxed) != nullptr; }
+
+    // Parses and compiles the file, then swaps it in. On error the current
+    // table stays and error names the offending line.
+    bool load(const string& file, string& error) {
+        lock_guard<mutex> lock(reload_mutex);
+        uint64_t start = mono_ns();
+        ifstream in(file);
+        if (!in) {
+            error = "cannot open " + file;
+            return false;
+        }
+        vector<Rule> rules[2];
+        bool has_allow = false;
+        string line;
+        for (int lineno = 1; getline(in, line); ++lineno) {
+            size_t hash = line.find('#');
+            if (hash != string::npos) line.resize(hash);
+            if (line.find_first_not_of(" \t\r") == string::npos) continue;
+            Rule r;
+            int family;
+            if (!parse_rule(line, r, family)) {
+                error = file + ":" + to_string(lineno) + ": expected allow|deny CIDR";
+                return false;
+            }
+            has_allow = has_allow || r.action == ALLOW;
+            rules[family].push_back(r);
+        }
+        auto t = make_unique<Table>();
+        t->fallback = has_allow ? DENY : ALLOW;
+        for (int f = 0; f < 2; ++f) {
+            // A repeated prefix keeps its last rule
+            auto& list = rules[f];
+            stable_sort(list.begin(), list.end(),
+                        [](const Rule& a, const Rule& b) { return a.len != b.len ? a.len < b.len : a.key < b.key; });
+            vector<Rule> unique_rules;
+            for (const Rule& r : list) {
+                if (!unique_rules.empty() && unique_rules.back().len == r.len && unique_rules.back().key == r.key)
+                    unique_rules.back() = r;
+                else
+                    unique_rules.push_back(r);
+            }
+            t->rules[f] = unique_rules.size();
+            build_family(*t, f, unique_rules);
+        }
+        // Grace period: a reader that saw the old table has its slot above
+        // zero; one that gets in after the swap sees the new table
+        current.store(t.get(), memory_order_seq_cst);
+        for (ReaderSlot& r : readers)
+            while (r.active.load(memory_order_seq_cst) != 0) this_thread::yield();
+        live = move(t);
+        path = file;
+        build_us = (mono_ns() - start) / 1000;
+        return true;
+    }
+
+    // Re-reads the file the table came from
+    void reload() {
+        string file, error;
+        {
+            lock_guard<mutex> lock(reload_mutex);
+            file = path;
+        }
+        if (load(file, error)) {
+            reloads.fetch_add(1, memory_order_relaxed);
+            cout << "Access list reloaded from " << file << endl;
+        } else {
+            reload_failures.fetch_add(1, memory_order_relaxed);
+            cerr << "Access list reload failed, keeping the old one: " << error << endl;
+        }
+    }
+
+    void start() {
+        if (!enabled() || running.exchange(true)) return;
+        worker = thread([this]() {
+            while (true) {
+                {
+                    unique_lock<mutex> lock(wake_mutex);
+                    wake.wait(lock, [this]() { return reload_pending || !running; });
+                    if (!running) break;
+                    reload_pending = false;
+                }
+                reload();
+            }
+        });
+    }
+
+    // From the accept loop, on SIGHUP
+    void request_reload() {
+        {
+            lock_guard<mutex> lock(wake_mutex);
+            reload_pending = true;
+        }
+        wake.notify_one();
+    }
+
+    void stop() {
+        if (!running.exchange(false)) return;
+        {
+            lock_guard<mutex> lock(wake_mutex);
+        }
+        wake.notify_all();
+        if (worker.joinable()) worker.join();
+    }
+
+    bool permits(const sockaddr* sa) {
+        ReaderSlot& slot = reader_slot();
+        slot.active.fetch_add(1, memory_order_seq_cst);
+        const Table* t = current.load(memory_order_seq_cst);
+        uint8_t action;
+        if (sa->sa_family == AF_INET) {
+            action = lookup(t, 0, (Key)ntohl(((const sockaddr_in*)sa)->sin_addr.s_addr) << 96);
+        } else {
+            const unsigned char* b = ((const sockaddr_in6*)sa)->sin6_addr.s6_addr;
+            Key key = 0;
+            for (int i = 0; i < 16; ++i) key = (key << 8) | b[i];
+            // IPv4-mapped clients of a dual-stack socket use the IPv4 rules
+            bool mapped = (key >> 32) == 0xffff;
+            action = mapped ? lookup(t, 0, key << 96) : lookup(t, 1, key);
+        }
+        slot.active.fetch_sub(1, memory_order_release);
+        (action == DENY ? denied : allowed).fetch_add(1, memory_order_relaxed);
+        return action != DENY;
+    }
+
+    void log_status(ostream& out) {
+        lock_guard<mutex> lock(reload_mutex);
+        const Table* t = live.get();
+        size_t bytes = (t->direct[0].size() + t->direct[1].size()) * sizeof(uint32_t) + t->nodes.size() * sizeof(Node) +
+                       t->leaf_values.size();
+        out << "Access List (" << path << "):\n"
+            << "Rules: " << t->rules[0] << " IPv4, " << t->rules[1] << " IPv6 Default: "
+            << (t->fallback == ALLOW ? "allow" : "deny") << " Nodes: " << t->nodes.size()
+            << " Leaves: " << t->leaf_values.size() << " Memory(KiB): " << bytes / 1024
+            << " Build(ms): " << build_us / 1000.0 << "\n"
+            << "Allowed: " << allowed << " Denied: " << denied << " Reloads: " << reloads
+            << " ReloadFailures: " << reload_failures << "\n";
+    }
+};
+
+static AccessList access_list;
+
+// In-kernel relaying for passthrough tunnels (--sni-sockmap). Both sockets
+// of a tunnel go into a BPF sockhash with an sk_skb verdict program attached:
+// a segment arriving on one socket is looked up by that socket's addresses
+// and redirected to the send side of the socket stored under them, its peer.
+// Payload then never reaches this process. The program is twenty
+// hand-assembled instructions loaded with the raw bpf() syscall, so the
+// build needs neither libbpf nor clang.
+class SockmapRelay {
+    // The arriving socket as __sk_buff presents it
+    struct Key {
+        uint32_t remote_ip4, local_ip4;  // network order
+        uint32_t remote_port;            // network order, in the upper 16 bits
+        uint32_t local_port;             // host order
+    };
+
+    // glibc's tcp_info stops at tcpi_total_retrans; the kernel's goes on
+    // with these (linux/tcp.h clashes with netinet/tcp.h)
+    struct TcpCounters {
+        tcp_info base;
+        uint64_t pacing_rate, max_pacing_rate, bytes_acked, bytes_received;
+    };
+
+    static constexpr uint32_t MAX_SOCKETS = 65536;
+
+    int map_fd = -1;
+
+    static long bpf(int cmd, bpf_attr& attr) { return syscall(__NR_bpf, cmd, &attr, sizeof(attr)); }
+
+    static bpf_insn insn(uint8_t code, uint8_t dst, uint8_t src, int16_t off, int32_t imm) {
+        bpf_insn i{};
+        i.code = code;
+        i.dst_reg = dst;
+        i.src_reg = src;
+        i.off = off;
+        i.imm = imm;
+        return i;
+    }
+
+    static bool key_of(int fd, Key& key) {
+        sockaddr_in local{}, remote{};
+        socklen_t len = sizeof(local);
+        if (getsockname(fd, (sockaddr*)&local, &len) != 0 || local.sin_family != AF_INET) return false;
+        len = sizeof(remote);
+        if (getpeername(fd, (sockaddr*)&remote, &len) != 0 || remote.sin_family != AF_INET) return false;
+        key = {remote.sin_addr.s_addr, local.sin_addr.s_addr, (uint32_t)remote.sin_port << 16, ntohs(local.sin_port)};
+        return true;
+    }
+
+    bool update(const Key& key, int fd) {
+        uint32_t value = (uint32_t)fd;
+        bpf_attr attr{};
+        attr.map_fd = (uint32_t)map_fd;
+        attr.key = (uint64_t)(uintptr_t)&key;
+        attr.value = (uint64_t)(uintptr_t)&value;
+        attr.flags = BPF_ANY;
+        return bpf(BPF_MAP_UPDATE_ELEM, attr) == 0;
+    }
+
+    void remove(const Key& key) {
+        bpf_attr attr{};
+        attr.map_fd = (uint32_t)map_fd;
+        attr.key = (uint64_t)(uintptr_t)&key;
+        bpf(BPF_MAP_DELETE_ELEM, attr);
+    }
+
+public:
+    bool enabled() const { return map_fd != -1; }
+
+    // Creates the map and attaches the verdict program to it; false (with
+    // the reason printed) where the kernel lacks sockmap or privileges
+    bool open() {
+        bpf_attr attr{};
+        attr.map_type = BPF_MAP_TYPE_SOCKHASH;
+        attr.key_size = sizeof(Key);
+        attr.value_size = sizeof(uint32_t);
+        attr.max_entries = MAX_SOCKETS;
+        int map = (int)bpf(BPF_MAP_CREATE, attr);
+        if (map == -1) {
+            perror("sockhash");
+            return false;
+        }
 
-    vector<bool> backend_health;
-    vector<int> request_count;
-    vector<int> active_connections;
-    mutex health_mutex, active_mutex, request_mutex, log_mutex;
+        const int16_t key_at = -(int16_t)sizeof(Key);
+        vector<bpf_insn> code = {
+            insn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0),
+            // A bare FIN stays on its socket for the relay thread to see;
+            // redirected, its empty send would be reported as EPIPE on the peer
+            insn(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_6, offsetof(__sk_buff, len), 0),
+            insn(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_2, 0, 15, 0),
+            // Build the key on the stack
+            insn(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_6, offsetof(__sk_buff, remote_ip4), 0),
+            insn(BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_2, (int16_t)(key_at + (int)offsetof(Key, remote_ip4)), 0),
+            insn(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_6, offsetof(__sk_buff, local_ip4), 0),
+            insn(BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_2, (int16_t)(key_at + (int)offsetof(Key, local_ip4)), 0),
+            insn(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_6, offsetof(__sk_buff, remote_port), 0),
+            insn(BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_2, (int16_t)(key_at + (int)offsetof(Key, remote_port)), 0),
+            insn(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_6, offsetof(__sk_buff, local_port), 0),
+            insn(BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_2, (int16_t)(key_at + (int)offsetof(Key, local_port)), 0),
+            // bpf_sk_redirect_hash(skb, map, &key, 0): 0 sends out of the peer
+            insn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, BPF_REG_6, 0, 0),
+            insn(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_2, BPF_PSEUDO_MAP_FD, 0, map),
+            insn(0, 0, 0, 0, 0),
+            insn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_3, BPF_REG_10, 0, 0),
+            insn(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_3, 0, 0, key_at),
+            insn(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_4, 0, 0, 0),
+            insn(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_sk_redirect_hash),
+            // SK_PASS either way: with no peer in the map the data stays on
+            // this socket, where the relay thread reads it
+            insn(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, SK_PASS),
+            insn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+        };
+        char log[4096] = "";
+        attr = {};
+        attr.prog_type = BPF_PROG_TYPE_SK_SKB;
+        attr.insns = (uint64_t)(uintptr_t)code.data();
+        attr.insn_cnt = (uint32_t)code.size();
+        attr.license = (uint64_t)(uintptr_t)"GPL";
+        attr.log_buf = (uint64_t)(uintptr_t)log;
+        attr.log_size = sizeof(log);
+        attr.log_level = 1;
+        int prog = (int)bpf(BPF_PROG_LOAD, attr);
+        if (prog == -1) {
+            perror("sk_skb program");
+            if (log[0]) cerr << log;
+            ::close(map);
+            return false;
+        }
 
-    BackendManager() {
-        size_t n = backend_servers.size();
-        backend_health.resize(n, true);
-        request_count.resize(n, 0);
-        active_connections.resize(n, 0);
+        // No stream parser: every segment goes to the verdict as it arrives
+        attr = {};
+        attr.target_fd = (uint32_t)map;
+        attr.attach_bpf_fd = (uint32_t)prog;
+        attr.attach_type = BPF_SK_SKB_STREAM_VERDICT;
+        bool attached = bpf(BPF_PROG_ATTACH, attr) == 0;
+        if (!attached) perror("sk_skb attach");
+        // The map holds its own reference to the program
+        ::close(prog);
+        if (!attached) {
+            ::close(map);
+            return false;
+        }
+        map_fd = map;
+        return true;
     }
 
-    vector<int> get_healthy_indices() {
-        lock_guard<mutex> lock(health_mutex);
-        vector<int> indices;
-        for (size_t i = 0; i < backend_health.size(); ++i)
-            if (backend_health[i]) indices.push_back((int)i);
-        return indices;
+    // After this, segments on either socket go straight out of the other.
+    // Closing a socket takes it out of the map.
+    bool link(int a, int b) {
+        Key ka, kb;
+        if (!key_of(a, ka) || !key_of(b, kb)) return false;
+        // a's key holds b: a's segments leave through b
+        if (!update(ka, b)) return false;
+        if (!update(kb, a)) {
+            remove(ka);
+            return false;
+        }
+        return true;
     }
 
-    void set_health(int index, bool healthy) {
-        lock_guard<mutex> lock(health_mutex);
-        backend_health[index] = healthy;
+    // Bytes put on fd's send queue and bytes taken off the wire so far,
+    // counted by the kernel, so the relay can see what moved without it
+    static bool counters(int fd, uint64_t& written, uint64_t& received) {
+        TcpCounters tc{};
+        socklen_t len = sizeof(tc);
+        int outq = 0;
+        if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &tc, &len) != 0 || len < sizeof(tc) ||
+            ioctl(fd, SIOCOUTQ, &outq) != 0)
+            return false;
+        written = tc.bytes_acked + (uint64_t)outq;
+        received = tc.bytes_received;
+        return true;
     }
+};
 
-    void increment_requests(int index) {
-        lock_guard<mutex> lock(request_mutex);
-        request_count[index]++;
+// L4 TLS passthrough (--sni-port). The ClientHello is peeked, not read, so
+// the backend still receives the untouched handshake; only the SNI is used
+// to pick a route. The connection is then relayed with splice() through a
+// pipe per direction, or by the kernel alone with --sni-sockmap, and is never
+// decrypted here. Routes are
+// "name=host:port,..." where name is exact, "*.suffix" or "*" (fallback);
+// targets within a route are used round robin, skipping one that failed to
+// connect in the last few seconds.
+class SniRouter {
+    struct Target {
+        string label;
+        sockaddr_storage addr{};
+        socklen_t addr_len = 0;
+        atomic<uint64_t> down_until_ns{0};
+    };
+    struct Route {
+        string name;
+        vector<unique_ptr<Target>> targets;
+        atomic<size_t> next{0};
+        atomic<uint64_t> connections{0};
+    };
+
+    static constexpr size_t MAX_HELLO = 16384 + 5;
+    static constexpr int PEEK_TIMEOUT_MS = 5000;
+    static constexpr int IDLE_TIMEOUT_MS = 300000;
+    static constexpr uint64_t DOWN_NS = 5000000000ULL;
+
+    vector<unique_ptr<Route>> routes;
+    int listen_fd = -1;
+    atomic<bool> running{false};
+    thread worker;
+    mutex active_mutex;
+    condition_variable active_cv;
+    int active = 0;
+    atomic<uint64_t> accepted{0}, not_tls{0}, no_sni{0}, unmatched{0}, connect_failures{0};
+    atomic<uint64_t> bytes_in{0}, bytes_out{0};
+    SockmapRelay sockmap;
+    atomic<uint64_t> offloaded{0}, offload_fallbacks{0};
+
+    enum class Hello { NEED_MORE, INVALID, NO_SNI, FOUND };
+
+    static uint32_t be(const unsigned char* p, int n) {
+        uint32_t v = 0;
+        for (int i = 0; i < n; ++i) v = (v << 8) | p[i];
+        return v;
     }
 
-    void increment_active(int index) {
-        lock_guard<mutex> lock(active_mutex);
-        active_connections[index]++;
+    // Pulls the server_name out of a ClientHello, reassembling the handshake
+    // message if it spans several records. early_data is set when the client
+    // offers 0-RTT data, which it may send before the server answers.
+    static Hello parse_hello(const unsigned char* data, size_t len, string& sni, bool& early_data) {
+        string hs;
+        size_t off = 0;
+        while (hs.size() < 4 || hs.size() < 4 + be((const unsigned char*)hs.data() + 1, 3)) {
+            if (len - off < 5) return Hello::NEED_MORE;
+            if (data[off] != 0x16 || data[off + 1] != 0x03) return Hello::INVALID;
+            size_t rec = be(data + off + 3, 2);
+            if (rec == 0 || rec > 16384) return Hello::INVALID;
+            if (len - off - 5 < rec) return Hello::NEED_MORE;
+            hs.append((const char*)data + off + 5, rec);
+            off += 5 + rec;
+            if (hs[0] != 0x01) return Hello::INVALID;
+        }
+
+        const unsigned char* p = (const unsigned char*)hs.data() + 4;
+        const unsigned char* end = p + be((const unsigned char*)hs.data() + 1, 3);
+        // client_version, random, then variable-length session id, cipher
+        // suites and compression methods
+        p += 2 + 32;
+        for (int width : {1, 2, 1}) {
+            if (end - p < width) return Hello::INVALID;
+            p += width + be(p, width);
+        }
+        if (p == end) return Hello::NO_SNI;
+        if (end - p < 2 || end - p < 2 + (ptrdiff_t)be(p, 2)) return Hello::INVALID;
+        end = p + 2 + be(p, 2);
+        p += 2;
+        Hello result = Hello::NO_SNI;
+        while (end - p >= 4) {
+            uint32_t type = be(p, 2), ext_len = be(p + 2, 2);
+            p += 4;
+            if ((uint32_t)(end - p) < ext_len) return Hello::INVALID;
+            if (type == 42) early_data = true;
+            if (type == 0 && result == Hello::NO_SNI) {
+                // server_name_list: a 2-byte length, then (type, 2-byte length, name)
+                const unsigned char* q = p + 2;
+                const unsigned char* qend = p + ext_len;
+                while (qend - q >= 3) {
+                    uint32_t name_len = be(q + 1, 2);
+                    if ((uint32_t)(qend - q - 3) < name_len) return Hello::INVALID;
+                    if (q[0] == 0) {
+                        sni.assign((const char*)q + 3, name_len);
+                        transform(sni.begin(), sni.end(), sni.begin(), ::tolower);
+                        if (!sni.empty()) result = Hello::FOUND;
+                        break;
+                    }
+                    q += 3 + name_len;
+                }
+            }
+            p += ext_len;
+        }
+        return result;
     }
 
-    void decrement_active(int index) {
-        lock_guard<mutex> lock(active_mutex);
-        active_connections[index]--;
+    // Peeks until the whole ClientHello is queued on the socket
+    Hello peek_hello(int fd, string& sni, bool& early_data) {
+        vector<unsigned char> buf(MAX_HELLO);
+        int64_t deadline = mono_ns() + PEEK_TIMEOUT_MS * 1000000LL;
+        while (true) {
+            ssize_t n = ::recv(fd, buf.data(), buf.size(), MSG_PEEK);
+            if (n == -1 && errno == EINTR) continue;
+            if (n <= 0) return Hello::INVALID;
+            Hello h = parse_hello(buf.data(), (size_t)n, sni, early_data);
+            if (h != Hello::NEED_MORE) return h;
+            if ((size_t)n == buf.size()) return Hello::INVALID;
+            // The peeked bytes stay queued and keep the socket readable, so
+            // raise the low-water mark to wake only once more has arrived
+            int64_t left_ms = (deadline - mono_ns()) / 1000000;
+            int lowat = (int)n + 1;
+            setsockopt(fd, SOL_SOCKET, SO_RCVLOWAT, &lowat, sizeof(lowat));
+            pollfd pfd{fd, POLLIN, 0};
+            int r = left_ms > 0 ? ::poll(&pfd, 1, (int)left_ms) : 0;
+            lowat = 1;
+            setsockopt(fd, SOL_SOCKET, SO_RCVLOWAT, &lowat, sizeof(lowat));
+            if (r == 0 || (r == -1 && errno != EINTR)) return Hello::INVALID;
+        }
     }
 
-    int get_least_connection_backend(const vector<int>& healthy) {
-        lock_guard<mutex> lock(active_mutex);
-        int min_conn = INT_MAX, selected = -1;
-        for (int idx : healthy) {
-            if (active_connections[idx] < min_conn) {
-                min_conn = active_connections[idx];
-                selected = idx;
+    Route* match(const string& sni) {
+        Route* best = nullptr;
+        size_t best_len = 0;
+        for (auto& r : routes) {
+            if (r->name == sni) return r.get();
+            if (r->name == "*") {
+                if (!best) best = r.get();
+            } else if (r->name.rfind("*.", 0) == 0) {
+                // "*.example.com" matches any name ending in ".example.com"
+                const string suffix = r->name.substr(1);
+                if (sni.size() > suffix.size() && sni.compare(sni.size() - suffix.size(), suffix.size(), suffix) == 0 &&
+                    (!best || best->name == "*" || suffix.size() > best_len)) {
+                    best = r.get();
+                    best_len = suffix.size();
+                }
             }
         }
-        return selected;
+        return best;
     }
 
-    void log_status(ofstream& out) {
-        for (size_t i = 0; i < backend_servers.size(); ++i) {
-            const auto& [ip, port] = backend_servers[i];
-            string status = backend_health[i] ? "healthy" : "unhealthy";
-            out << ip << ":" << port << " [" << status << "] Requests: "
-                << request_count[i] << " Active: " << active_connections[i] << "\n";
+    int connect_route(Route& route) {
+        size_t n = route.targets.size();
+        size_t start = route.next.fetch_add(1, memory_order_relaxed);
+        for (int pass = 0; pass < 2; ++pass) {
+            // First pass skips targets that recently failed; the second
+            // tries them anyway rather than refusing the connection
+            for (size_t k = 0; k < n; ++k) {
+                Target& t = *route.targets[(start + k) % n];
+                if (pass == 0 && t.down_until_ns.load(memory_order_relaxed) > mono_ns()) continue;
+                int fd = ::socket(t.addr.ss_family, SOCK_STREAM, 0);
+                if (fd == -1) return -1;
+                set_timeouts(fd, 5);
+                if (::connect(fd, (const sockaddr*)&t.addr, t.addr_len) == 0) {
+                    t.down_until_ns.store(0, memory_order_relaxed);
+                    return fd;
+                }
+                ::close(fd);
+                connect_failures.fetch_add(1, memory_order_relaxed);
+                t.down_until_ns.store(mono_ns() + DOWN_NS, memory_order_relaxed);
+            }
         }
+        return -1;
     }
-};
 
-static bool set_timeouts(int fd, int sec=2) {
-    timeval tv{sec, 0};
-    return setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == 0 &&
-           setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) == 0;
-}
+    // One direction of the tunnel: bytes move socket -> pipe -> socket
+    // without entering userspace.
+    struct Leg {
+        int from, to;
+        int pipe_fds[2] = {-1, -1};
+        size_t pending = 0;
+        bool eof = false;
+        bool shut = false;
+        atomic<uint64_t>* bytes;
 
-class HealthChecker {
-    BackendManager* manager;
-    atomic<bool> running{true};
-    thread worker;
+        bool done() const { return eof && pending == 0; }
 
-    static bool send_all(int fd, const char* buf, size_t len) {
-        size_t sent = 0;
-        while (sent < len) {
-            ssize_t n = ::send(fd, buf + sent, len - sent, 0);
-            if (n <= 0) return false;
-            sent += (size_t)n;
+        // false on a hard error
+        bool fill() {
+            ssize_t n = ::splice(from, nullptr, pipe_fds[1], nullptr, 65536, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n > 0) pending += (size_t)n;
+            else if (n == 0) eof = true;
+            else if (errno != EAGAIN && errno != EINTR) return false;
+            return true;
+        }
+
+        bool drain() {
+            while (pending > 0) {
+                ssize_t n = ::splice(pipe_fds[0], nullptr, to, nullptr, pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+                if (n > 0) {
+                    pending -= (size_t)n;
+                    bytes->fetch_add((uint64_t)n, memory_order_relaxed);
+                } else if (n == -1 && (errno == EAGAIN || errno == EINTR)) {
+                    return true;
+                } else {
+                    return false;
+                }
+            }
+            if (eof && !shut) {
+                ::shutdown(to, SHUT_WR);
+                shut = true;
+            }
+            return true;
+        }
+    };
+
+    void relay(int client_fd, int backend_fd) {
+        Leg up{client_fd, backend_fd}, down{backend_fd, client_fd};
+        up.bytes = &bytes_in;
+        down.bytes = &bytes_out;
+        if (pipe2(up.pipe_fds, O_CLOEXEC) == -1 || pipe2(down.pipe_fds, O_CLOEXEC) == -1) {
+            for (int fd : {up.pipe_fds[0], up.pipe_fds[1]})
+                if (fd != -1) ::close(fd);
+            return;
+        }
+        fcntl(client_fd, F_SETFL, fcntl(client_fd, F_GETFL) | O_NONBLOCK);
+        fcntl(backend_fd, F_SETFL, fcntl(backend_fd, F_GETFL) | O_NONBLOCK);
+
+        bool ok = true;
+        while (ok && !(up.done() && down.done())) {
+            // Read from a side only once its pipe has been flushed, and wait
+            // for writability only while bytes are stuck in a pipe
+            pollfd pfd[2] = {{client_fd, 0, 0}, {backend_fd, 0, 0}};
+            if (!up.eof && up.pending == 0) pfd[0].events |= POLLIN;
+            if (!down.eof && down.pending == 0) pfd[1].events |= POLLIN;
+            if (up.pending) pfd[1].events |= POLLOUT;
+            if (down.pending) pfd[0].events |= POLLOUT;
+            int r = ::poll(pfd, 2, IDLE_TIMEOUT_MS);
+            if (r == -1 && errno == EINTR) continue;
+            if (r <= 0) break;
+            // POLLHUP on a side that already sent FIN means it can no
+            // longer receive either
+            if ((pfd[0].revents | pfd[1].revents) & (POLLERR | POLLNVAL)) break;
+            if (((pfd[0].revents & POLLHUP) && up.eof && !up.pending) ||
+                ((pfd[1].revents & POLLHUP) && down.eof && !down.pending))
+                break;
+
+            if (!up.eof && up.pending == 0 && (pfd[0].revents & (POLLIN | POLLHUP | POLLERR))) ok = up.fill();
+            if (ok && !down.eof && down.pending == 0 && (pfd[1].revents & (POLLIN | POLLHUP | POLLERR)))
+                ok = down.fill();
+            if (ok && (up.pending || up.eof)) ok = up.drain();
+            if (ok && (down.pending || down.eof)) ok = down.drain();
+        }
+        for (Leg* leg : {&up, &down}) {
+            ::close(leg->pipe_fds[0]);
+            ::close(leg->pipe_fds[1]);
         }
-        return true;
     }
 
-    static bool read_some(int fd, string& out) {
-        char buf[1024];
-        ssize_t n = ::recv(fd, buf, sizeof(buf), 0);
-        if (n <= 0) return false;
-        out.append(buf, buf + n);
-        return true;
+    // One direction of a sockmap tunnel, followed through the kernel's byte
+    // counters since its payload never passes through here
+    struct Flow {
+        int from, to;
+        uint64_t received_at_link = 0, written_at_link = 0;
+        uint64_t carried = 0;  // read before linking, written after
+        bool eof = false, shut = false;
+        uint64_t stalled_since_ns = 0, last_written = 0;
+        atomic<uint64_t>* bytes;
+
+        uint64_t written() const {
+            uint64_t w = written_at_link, r;
+            SockmapRelay::counters(to, w, r);
+            return w - written_at_link;
+        }
+
+        // Everything `from` received before its FIN has been queued on `to`;
+        // the FIN itself counts one in bytes_received
+        bool flushed() const {
+            uint64_t w, r, unused;
+            if (!SockmapRelay::counters(from, unused, r) || !SockmapRelay::counters(to, w, unused)) return true;
+            return w - written_at_link >= carried + (r - received_at_link) - 1;
+        }
+    };
+
+    // The ClientHello is taken off the client socket and written to the
+    // backend by hand once both sockets are linked; after that the kernel
+    // moves every byte. Nothing can be queued behind the hello: a client
+    // without early data waits for the server, and the server has not heard
+    // from it before the link. This thread only sleeps until a side sends
+    // FIN, then passes the FIN on once the bytes before it have reached the
+    // other socket's send queue. The verdict program parks them on the peer
+    // while its send buffer is full, and shutting the peer down early would
+    // drop them.
+    void relay_sockmap(int client_fd, int backend_fd) {
+        int queued = 0;
+        ioctl(client_fd, FIONREAD, &queued);
+        string hello((size_t)max(queued, 1), '\0');
+        ssize_t n = ::recv(client_fd, &hello[0], hello.size(), 0);
+        if (n <= 0) return;
+        hello.resize((size_t)n);
+
+        Flow up{client_fd, backend_fd}, down{backend_fd, client_fd};
+        up.bytes = &bytes_in;
+        down.bytes = &bytes_out;
+        uint64_t unused;
+        bool linked = SockmapRelay::counters(client_fd, down.written_at_link, up.received_at_link) &&
+                      SockmapRelay::counters(backend_fd, up.written_at_link, down.received_at_link) &&
+                      sockmap.link(client_fd, backend_fd);
+        if (!send_all(backend_fd, hello.data(), hello.size())) return;
+        if (!linked) {
+            offload_fallbacks.fetch_add(1, memory_order_relaxed);
+            bytes_in.fetch_add(hello.size(), memory_order_relaxed);
+            relay(client_fd, backend_fd);
+            return;
+        }
+        offloaded.fetch_add(1, memory_order_relaxed);
+        up.carried = hello.size();
+
+        uint64_t last_received = 0;
+        vector<char> buf(65536);
+        while (!(up.shut && down.shut)) {
+            Flow* flows[2] = {&up, &down};
+            bool flushing = (up.eof && !up.shut) || (down.eof && !down.shut);
+            // A side that sent FIN is left out: it stays readable for good
+            pollfd pfd[2] = {{up.eof ? -1 : client_fd, POLLIN, 0}, {down.eof ? -1 : backend_fd, POLLIN, 0}};
+            int r = ::poll(pfd, 2, flushing ? 10 : IDLE_TIMEOUT_MS);
+            if (r == -1 && errno == EINTR) continue;
+            if (r == -1 || ((pfd[0].revents | pfd[1].revents) & (POLLERR | POLLNVAL))) break;
+            if (r == 0 && !flushing) {
+                uint64_t a = 0, b = 0;
+                SockmapRelay::counters(client_fd, unused, a);
+                SockmapRelay::counters(backend_fd, unused, b);
+                if (a + b == last_received) break;  // idle
+                last_received = a + b;
+                continue;
+            }
+
+            bool ok = true;
+            for (int k = 0; k < 2 && ok; ++k) {
+                Flow& f = *flows[k];
+                if (!(pfd[k].revents & (POLLIN | POLLHUP))) continue;
+                // Either the FIN, or data that found no peer in the map
+                ssize_t got = ::recv(f.from, buf.data(), buf.size(), MSG_DONTWAIT);
+                if (got > 0) {
+                    ok = send_all(f.to, buf.data(), (size_t)got);
+                } else if (got == 0) {
+                    f.eof = true;
+                    f.stalled_since_ns = mono_ns();
+                } else if (errno != EAGAIN && errno != EINTR) {
+                    ok = false;
+                }
+            }
+            if (!ok) break;
+            for (Flow* f : flows) {
+                if (!f->eof || f->shut) continue;
+                uint64_t w = f->written();
+                if (w != f->last_written) {
+                    f->last_written = w;
+                    f->stalled_since_ns = mono_ns();
+                }
+                // Give up waiting if the peer stopped taking data
+                if (f->flushed() || mono_ns() - f->stalled_since_ns > (uint64_t)IDLE_TIMEOUT_MS * 1000000ULL) {
+                    ::shutdown(f->to, SHUT_WR);
+                    f->shut = true;
+                }
+            }
+        }
+        for (Flow* f : {&up, &down}) f->bytes->fetch_add(f->written(), memory_order_relaxed);
+    }
+
+    void serve(int client_fd) {
+        set_timeouts(client_fd, 5);
+        string sni;
+        bool early_data = false;
+        Hello hello = peek_hello(client_fd, sni, early_data);
+        Route* route = nullptr;
+        if (hello == Hello::INVALID) not_tls.fetch_add(1, memory_order_relaxed);
+        else if (hello == Hello::NO_SNI) no_sni.fetch_add(1, memory_order_relaxed);
+        // A ClientHello without SNI can still use the fallback route
+        if (hello == Hello::FOUND || hello == Hello::NO_SNI) {
+            route = match(sni);
+            if (!route) unmatched.fetch_add(1, memory_order_relaxed);
+        }
+        if (route) {
+            route->connections.fetch_add(1, memory_order_relaxed);
+            int backend_fd = connect_route(*route);
+            if (backend_fd != -1) {
+                if (sockmap.enabled() && !early_data) relay_sockmap(client_fd, backend_fd);
+                else relay(client_fd, backend_fd);
+                ::close(backend_fd);
+            }
+        }
+        ::close(client_fd);
     }
 
 public:
-    HealthChecker(BackendManager* mgr): manager(mgr) {}
+    // "name=host:port[,host:port...]", IPv6 literals as [addr]:port.
+    // Hostnames are resolved once here.
+    bool add_route(const string& spec) {
+        size_t eq = spec.find('=');
+        if (eq == string::npos || eq == 0) return false;
+        auto route = make_unique<Route>();
+        route->name = spec.substr(0, eq);
+        transform(route->name.begin(), route->name.end(), route->name.begin(), ::tolower);
+        stringstream targets(spec.substr(eq + 1));
+        string target;
+        while (getline(targets, target, ',')) {
+            size_t colon = target.rfind(':');
+            if (colon == string::npos || colon == 0) return false;
+            string host = target.substr(0, colon);
+            if (host.size() > 1 && host.front() == '[' && host.back() == ']') host = host.substr(1, host.size() - 2);
+            string port = target.substr(colon + 1);
+            addrinfo hints{}, *res = nullptr;
+            hints.ai_socktype = SOCK_STREAM;
+            if (getaddrinfo(host.c_str(), port.c_str(), &hints, &res) != 0 || !res) return false;
+            auto t = make_unique<Target>();
+            memcpy(&t->addr, res->ai_addr, res->ai_addrlen);
+            t->addr_len = res->ai_addrlen;
+            t->label = target;
+            freeaddrinfo(res);
+            route->targets.push_back(move(t));
+        }
+        if (route->targets.empty()) return false;
+        routes.push_back(move(route));
+        return true;
+    }
 
-    void start() {
+    bool enabled() const { return !routes.empty(); }
+
+    bool enable_sockmap() { return sockmap.open(); }
+
+    bool start(int port, int backlog) {
+        listen_fd = ::socket(AF_INET, SOCK_STREAM, 0);
+        if (listen_fd == -1) { perror("sni socket"); return false; }
+        int opt = 1;
+        setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = INADDR_ANY;
+        if (::bind(listen_fd, (sockaddr*)&addr, sizeof(addr)) == -1 || ::listen(listen_fd, backlog) == -1) {
+            perror("sni bind/listen failed");
+            ::close(listen_fd);
+            listen_fd = -1;
+            return false;
+        }
+
+        running = true;
         worker = thread([this]() {
             while (running) {
-                this_thread::sleep_for(chrono::seconds(5));
-                for (size_t i = 0; i < manager->backend_servers.size(); ++i) {
-                    const auto& [ip, port] = manager->backend_servers[i];
-                    int fd = ::socket(AF_INET, SOCK_STREAM, 0);
-                    if (fd == -1) { manager->set_health((int)i, false); continue; }
-
-                    sockaddr_in addr{};
-                    addr.sin_family = AF_INET;
-                    addr.sin_port = htons(port);
-                    inet_pton(AF_INET, ip.c_str(), &addr.sin_addr);
-
-                    set_timeouts(fd, 2);
-                    bool alive = false;
-
-                    if (::connect(fd, (sockaddr*)&addr, sizeof(addr)) != -1) {
-                        // Real HTTP health check
-                        string req = "GET /health HTTP/1.1\r\nHost: " + ip + "\r\nConnection: close\r\n\r\n";
-                        if (send_all(fd, req.c_str(), req.size())) {
-                            string resp;
-                            // read just some bytes; we only need the status line
-                            if (read_some(fd, resp)) {
-                                // Check for "HTTP/1.1 200"
-                                if (resp.find("HTTP/1.1 200") != string::npos ||
-                                    resp.find("HTTP/1.0 200") != string::npos) {
-                                    alive = true;
-                                }
-                            }
-                        }
-                    }
+                sockaddr_storage peer;
+                socklen_t peer_len = sizeof(peer);
+                int fd = ::accept(listen_fd, (sockaddr*)&peer, &peer_len);
+                if (fd == -1) continue;
+                if (access_list.enabled() && !access_list.permits((sockaddr*)&peer)) {
                     ::close(fd);
-                    manager->set_health((int)i, alive);
+                    continue;
                 }
-
-                ofstream out("status.txt");
-                out << "Health Status:\n";
-                manager->log_status(out);
+                accepted.fetch_add(1, memory_order_relaxed);
+                {
+                    lock_guard<mutex> lock(active_mutex);
+                    ++active;
+                }
+                std::thread([this, fd]() {
+                    serve(fd);
+                    lock_guard<mutex> lock(active_mutex);
+                    if (--active == 0) active_cv.notify_all();
+                }).detach();
             }
         });
+        return true;
     }
 
-    void stop() {
+    // Stops accepting and waits until deadline for open tunnels to close
+    void stop(chrono::steady_clock::time_point deadline) {
+        if (listen_fd == -1) return;
         running = false;
+        ::shutdown(listen_fd, SHUT_RDWR);
         if (worker.joinable()) worker.join();
+        ::close(listen_fd);
+        listen_fd = -1;
+        unique_lock<mutex> lock(active_mutex);
+        active_cv.wait_until(lock, deadline, [this]() { return active == 0; });
     }
-};
-
-class LoadBalancer {
-    BackendManager* manager;
-    LBAlgorithm algorithm;
-    mutex rr_mutex;
-    size_t rr_index = 0;
-
-public:
-    LoadBalancer(BackendManager* mgr, LBAlgorithm algo = LBAlgorithm::ROUND_ROBIN)
-        : manager(mgr), algorithm(algo) {}
-
-    int select_backend(const string& client_ip) {
-        auto healthy = manager->get_healthy_indices();
-        if (healthy.empty()) return -1;
 
-        if (algorithm == LBAlgorithm::ROUND_ROBIN) {
-            lock_guard<mutex> lock(rr_mutex);
-            int index = healthy[rr_index % healthy.size()];
-            rr_index++;
-            return index;
-        } else if (algorithm == LBAlgorithm::LEAST_CONNECTIONS) {
-            return manager->get_least_connection_backend(healthy);
-        } else { // IP_HASH
-            hash<string> hasher;
-            return healthy[hasher(client_ip) % healthy.size()];
+    void log_status(ostream& out) {
+        int open;
+        {
+            lock_guard<mutex> lock(active_mutex);
+            open = active;
+        }
+        out << "SNI Passthrough:\n"
+            << "Accepted: " << accepted << " Open: " << open << " NotTLS: " << not_tls << " NoSNI: " << no_sni
+            << " Unmatched: " << unmatched << " ConnectFailures: " << connect_failures << "\n"
+            << "BytesIn: " << bytes_in << " BytesOut: " << bytes_out << "\n";
+        if (sockmap.enabled())
+            out << "Sockmap: Offloaded: " << offloaded << " Fallbacks: " << offload_fallbacks << "\n";
+        for (auto& r : routes) {
+            out << r->name << " -> ";
+            for (size_t k = 0; k < r->targets.size(); ++k) {
+                const Target& t = *r->targets[k];
+                out << (k ? "," : "") << t.label
+                    << (t.down_until_ns.load(memory_order_relaxed) > mono_ns() ? "[down]" : "");
+            }
+            out << " Connections: " << r->connections << "\n";
         }
     }
 };
 
-class ClientHandler {
-    BackendManager* manager;
-    LoadBalancer* balancer;
+static SniRouter sni_router;
 
-    static bool send_all(int fd, const char* buf, size_t len) {
-        size_t sent = 0;
-        while (sent < len) {
-            ssize_t n = ::send(fd, buf + sent, len - sent, 0);
-            if (n <= 0) return false;
-            sent += (size_t)n;
-        }
-        return true;
-    }
+static void write_status(BackendManager* manager, ostream& out) {
+    out << "Health Status:\n";
+    manager->log_status(out);
+    if (perf_profiler.enabled()) perf_profiler.log_status(out);
+    if (lock_profiling) ProfiledMutex::log_status(out);
+    if (tracer.enabled()) tracer.log_status(out);
+    if (zerocopy_stats.responses) zerocopy_stats.log_status(out);
+    if (kernel_timestamping) kernel_timestamps.log_status(out);
+    if (dns_resolver.enabled()) dns_resolver.log_status(out);
+#ifdef LB_WITH_TLS
+    if (upstream_tls.enabled()) upstream_tls.log_status(out);
+#endif
+    if (priority_scheduler.enabled()) priority_scheduler.log_status(out);
+    if (response_cache.enabled()) response_cache.log_status(out);
+    if (listen_monitor.enabled()) listen_monitor.log_status(out);
+    if (reuseport_listeners.enabled()) reuseport_listeners.log_status(out);
+    if (h2_pool.enabled()) h2_pool.log_status(out);
+    if (pipeline_pool.enabled()) pipeline_pool.log_status(out);
+    if (sni_router.enabled()) sni_router.log_status(out);
+    if (access_list.enabled()) access_list.log_status(out);
+}
 
-    int create_connection(const string& ip, int port) {
-        int fd = ::socket(AF_INET, SOCK_STREAM, 0);
-        if (fd == -1) return -1;
-        sockaddr_in addr{};
-        addr.sin_family = AF_INET;
-        addr.sin_port = htons(port);
-        inet_pton(AF_INET, ip.c_str(), &addr.sin_addr);
-        if (::connect(fd, (sockaddr*)&addr, sizeof(addr)) == -1) {
-            ::close(fd);
-            return -1;
-        }
-        set_timeouts(fd, 10);
-        return fd;
+// Loopback-only admin listener (--admin-port). GET /status returns the same
+// report as status.txt; GET /profile?seconds=N&hz=H samples the LB's own
+// threads and returns folded stacks for flamegraph.pl / speedscope.
+class AdminServer {
+    BackendManager* manager;
+    int port;
+    int listen_fd = -1;
+    atomic<bool> running{false};
+    thread worker;
+    mutex serving_mutex;
+    condition_variable serving_cv;
+    int serving = 0;
+
+    static void respond(int fd, const string& status, const string& body, const string& extra_headers = "") {
+        string resp = "HTTP/1.1 " + status + "\r\n"
+                      "Content-Type: text/plain\r\n"
+                      "Content-Length: " + to_string(body.size()) + "\r\n" +
+                      extra_headers +
+                      "Connection: close\r\n\r\n" + body;
+        send_all(fd, resp.c_str(), resp.size());
     }
 
-    // Simple HTTP request-response forwarding with timeouts.
-    static bool forward_once(int src_fd, int dst_fd, bool& any_bytes) {
-        char buffer[8192];
-        ssize_t n = ::recv(src_fd, buffer, sizeof(buffer), 0);
-        if (n <= 0) return false;
-        any_bytes = true;
-        return send_all(dst_fd, buffer, (size_t)n);
+    static int query_int(const string& query, const string& key, int def, int lo, int hi) {
+        size_t p = ("&" + query).find("&" + key + "=");
+        if (p == string::npos) return def;
+        int v = atoi(query.c_str() + p + key.size() + 1);
+        return max(lo, min(hi, v));
     }
 
-public:
-    ClientHandler(BackendManager* mgr, LoadBalancer* lb)
-        : manager(mgr), balancer(lb) {}
+    void serve(int fd) {
+        set_timeouts(fd, 5);
+        string req;
+        char buf[1024];
+        while (req.find("\r\n\r\n") == string::npos && req.size() < 8192) {
+            ssize_t n = ::recv(fd, buf, sizeof(buf), 0);
+            if (n == -1 && errno == EINTR) continue;
+            if (n <= 0) break;
+            req.append(buf, buf + n);
+        }
 
-    void handle(int client_fd, const string& client_ip) {
-        int backend_index = balancer->select_backend(client_ip);
-        if (backend_index == -1) {
-            string msg = "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
-            send_all(client_fd, msg.c_str(), msg.size());
-            ::close(client_fd);
+        size_t sp1 = req.find(' ');
+        size_t sp2 = (sp1 == string::npos) ? string::npos : req.find(' ', sp1 + 1);
+        if (sp2 == string::npos) {
+            respond(fd, "400 Bad Request", "");
+            ::close(fd);
             return;
         }
+        string method = req.substr(0, sp1);
+        string target = req.substr(sp1 + 1, sp2 - sp1 - 1);
+        size_t q = target.find('?');
+        string path = target.substr(0, q);
+        string query = (q == string::npos) ? "" : target.substr(q + 1);
 
-        const auto& [ip, port] = manager->backend_servers[backend_index];
-        int backend_fd = create_connection(ip, port);
-        if (backend_fd == -1) {
-            string msg = "HTTP/1.1 503 Backend Connection Failed\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
-            send_all(client_fd, msg.c_str(), msg.size());
-            ::close(client_fd);
-            return;
+        if (method != "GET") {
+            respond(fd, "405 Method Not Allowed", "");
+        } else if (path == "/status") {
+            ostringstream out;
+            write_status(manager, out);
+            respond(fd, "200 OK", out.str());
+        } else if (path == "/profile") {
+            int seconds = query_int(query, "seconds", 10, 1, 60);
+            int hz = query_int(query, "hz", 99, 1, 1000);
+            CpuProfiler::Result result;
+            if (!cpu_profiler.profile(seconds, hz, result)) {
+                respond(fd, "409 Conflict", "profile already in progress\n");
+            } else {
+                respond(fd, "200 OK", result.folded,
+                        "X-Profile-Samples: " + to_string(result.samples) + "\r\n"
+                        "X-Profile-Dropped: " + to_string(result.dropped) + "\r\n");
+            }
+        } else {
+            respond(fd, "404 Not Found", "");
         }
+        ::close(fd);
+    }
 
-        manager->increment_active(backend_index);
+public:
+    AdminServer(BackendManager* mgr, int admin_port): manager(mgr), port(admin_port) {}
 
-        // Forward one HTTP request (whatever client sends right now)
-        bool got_req = false;
-        if (!forward_once(client_fd, backend_fd, got_req)) {
-            ::close(backend_fd);
-            ::close(client_fd);
-            manager->decrement_active(backend_index);
-            return;
-        }
+    bool start() {
+        listen_fd = ::socket(AF_INET, SOCK_STREAM, 0);
+        if (listen_fd == -1) { perror("admin socket"); return false; }
+        int opt = 1;
+        setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
 
-        // Read backend response and forward back
-        bool got_resp = false;
-        if (!forward_once(backend_fd, client_fd, got_resp)) {
-            // if backend sends nothing, try to be graceful
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (::bind(listen_fd, (sockaddr*)&addr, sizeof(addr)) == -1 || ::listen(listen_fd, 16) == -1) {
+            perror("admin bind/listen failed");
+            ::close(listen_fd);
+            listen_fd = -1;
+            return false;
         }
 
-        manager->increment_requests(backend_index);
-        manager->decrement_active(backend_index);
+        running = true;
+        worker = thread([this]() {
+            while (running) {
+                int fd = ::accept(listen_fd, nullptr, nullptr);
+                if (fd == -1) continue;
+                {
+                    lock_guard<mutex> lock(serving_mutex);
+                    ++serving;
+                }
+                std::thread([this, fd]() {
+                    serve(fd);
+                    lock_guard<mutex> lock(serving_mutex);
+                    if (--serving == 0) serving_cv.notify_all();
+                }).detach();
+            }
+        });
+        return true;
+    }
 
-        ::close(backend_fd);
-        ::close(client_fd);
+    void stop() {
+        running = false;
+        if (listen_fd != -1) ::shutdown(listen_fd, SHUT_RDWR);
+        if (worker.joinable()) worker.join();
+        if (listen_fd != -1) ::close(listen_fd);
+        listen_fd = -1;
+
+        cpu_profiler.cancel();
+        unique_lock<mutex> lock(serving_mutex);
+        serving_cv.wait_for(lock, chrono::seconds(5), [this]() { return serving == 0; });
     }
 };
 
+static atomic<bool> shutdown_requested{false};
+
+static void on_shutdown_signal(int) {
+    shutdown_requested = true;
+}
+
+static atomic<bool> reload_requested{false};
+
+static void on_reload_signal(int) {
+    reload_requested = true;
+}
+
 int main(int argc, char* argv[]) {
     LBAlgorithm algo = LBAlgorithm::ROUND_ROBIN;
-    if (argc > 1) {
-        string a = argv[1];
+    int admin_port = 0;
+    double trace_sample = 0.0;
+    string trace_file;
+    ProxyOptions proxy_options;
+    int drain_timeout = 30;
+    int pool_idle = 8;
+    int backlog = SOMAXCONN;
+    struct BackendSpec {
+        string host;
+        int port;
+        bool tls;
+    };
+    vector<BackendSpec> backends;
+#ifdef LB_WITH_TLS
+    bool upstream_ktls = false;
+    string upstream_ca;
+#endif
+    int max_conns = 0, queue_timeout = 5000;
+    string fair_key;
+    int prewarm = 0;
+    int sni_port = 8443;
+    bool sni_sockmap = false;
+    bool upstream_h2c = false;
+    int h2_conns = 2;
+    int pipeline_depth = 0;
+    string acl_file;
+    int reuseport = 0;
+    string reuseport_steer = "cpu";
+    string warmup_path;
+    long cache_mb = 0, cache_swr = 0, cache_sie = 0, cache_disk_mb = 1024;
+    string cache_disk_dir;
+    for (int i = 1; i < argc; ++i) {
+        string a = argv[i];
         transform(a.begin(), a.end(), a.begin(), ::tolower);
-        if (a == "least") algo = LBAlgorithm::LEAST_CONNECTIONS;
+        if (a == "--perf") perf_profiler.enable();
+        else if (a.rfind("--admin-port=", 0) == 0) admin_port = atoi(a.c_str() + 13);
+        else if (a.rfind("--trace-sample=", 0) == 0) trace_sample = atof(a.c_str() + 15);
+        else if (a.rfind("--trace-file=", 0) == 0) trace_file = argv[i] + 13;
+        else if (a == "--lock-profile") lock_profiling = true;
+        else if (a == "--server-timing") proxy_options.server_timing = true;
+        else if (a.rfind("--zerocopy-threshold=", 0) == 0) proxy_options.zerocopy_threshold = atoll(a.c_str() + 21);
+        else if (a.rfind("--drain-timeout=", 0) == 0) drain_timeout = atoi(a.c_str() + 16);
+        else if (a == "least") algo = LBAlgorithm::LEAST_CONNECTIONS;
         else if (a == "iphash") algo = LBAlgorithm::IP_HASH;
+        else if (a == "rtt") algo = LBAlgorithm::LEAST_RTT;
+        else if (a.rfind("--pool-idle=", 0) == 0) pool_idle = max(0, atoi(a.c_str() + 12));
+        else if (a == "--kernel-timestamps") proxy_options.kernel_timestamps = kernel_timestamping = true;
+        else if (a.rfind("--expect-timeout=", 0) == 0) proxy_options.expect_timeout_ms = max(0, atoi(a.c_str() + 17));
+        else if (a.rfind("--backlog=", 0) == 0) backlog = max(1, atoi(a.c_str() + 10));
+        else if (a.rfind("--max-conns=", 0) == 0) max_conns = max(0, atoi(a.c_str() + 12));
+        else if (a.rfind("--cache-size=", 0) == 0) cache_mb = max(0L, atol(a.c_str() + 13));
+#ifdef LB_WITH_TLS
+        else if (a == "--upstream-ktls") upstream_ktls = true;
+        else if (a.rfind("--upstream-ca=", 0) == 0) upstream_ca = argv[i] + 14;
+#endif
+        else if (a == "--upstream-h2c") upstream_h2c = true;
+        else if (a.rfind("--upstream-pipeline=", 0) == 0) pipeline_depth = max(0, atoi(a.c_str() + 20));
+        else if (a.rfind("--h2-conns=", 0) == 0) h2_conns = max(1, atoi(a.c_str() + 11));
+        else if (a.rfind("--acl=", 0) == 0) acl_file = argv[i] + 6;
+        else if (a == "--reuseport") reuseport = max(1, (int)thread::hardware_concurrency());
+        else if (a.rfind("--reuseport=", 0) == 0) reuseport = max(0, atoi(a.c_str() + 12));
+        else if (a.rfind("--reuseport-steer=", 0) == 0) reuseport_steer = a.substr(18);
+        else if (a.rfind("--sni-port=", 0) == 0) sni_port = atoi(a.c_str() + 11);
+        else if (a == "--sni-sockmap") sni_sockmap = true;
+        else if (a.rfind("--prewarm=", 0) == 0) prewarm = max(0, atoi(a.c_str() + 10));
+        else if (a.rfind("--warmup-path=", 0) == 0) warmup_path = argv[i] + 14;
+        else if (a.rfind("--cache-disk-dir=", 0) == 0) cache_disk_dir = argv[i] + 17;
+        else if (a.rfind("--cache-disk-size=", 0) == 0) cache_disk_mb = max(0L, atol(a.c_str() + 18));
+        else if (a.rfind("--cache-swr=", 0) == 0) cache_swr = max(0L, atol(a.c_str() + 12));
+        else if (a.rfind("--cache-sie=", 0) == 0) cache_sie = max(0L, atol(a.c_str() + 12));
+        else if (a.rfind("--fair-key=", 0) == 0) fair_key = a.substr(11);
+        else if (a.rfind("--queue-timeout=", 0) == 0) queue_timeout = max(0, atoi(a.c_str() + 16));
+        else if (a.rfind("--priority-class=", 0) == 0) {
+            if (!priority_scheduler.add_class(argv[i] + 17)) {
+                cerr << "Invalid --priority-class " << argv[i] + 17 << " (expected NAME:WEIGHT[:MATCH])\n";
+                return 1;
+            }
+        } else if (a.rfind("--sni-route=", 0) == 0) {
+            if (!sni_router.add_route(argv[i] + 12)) {
+                cerr << "Invalid --sni-route " << argv[i] + 12 << " (expected NAME=host:port[,host:port...])\n";
+                return 1;
+            }
+        } else if (a.rfind("--backend=", 0) == 0) {
+            // [tls://]host:port, with IPv6 literals as [addr]:port
+            string spec = a.substr(10);
+            bool tls = spec.rfind("tls://", 0) == 0;
+            if (tls) spec = spec.substr(6);
+#ifndef LB_WITH_TLS
+            if (tls) {
+                cerr << "tls:// backends need a TLS build (make TLS=1)\n";
+                return 1;
+            }
+#endif
+            size_t colon = spec.rfind(':');
+            string host = spec.substr(0, colon == string::npos ? 0 : colon);
+            if (host.size() > 1 && host.front() == '[' && host.back() == ']') host = host.substr(1, host.size() - 2);
+            int port = colon == string::npos ? 0 : atoi(spec.c_str() + colon + 1);
+            if (host.empty() || port <= 0 || port > 65535) {
+                cerr << "Invalid --backend " << spec << " (expected host:port)\n";
+                return 1;
+            }
+            backends.push_back({host, port, tls});
+        }
     }
 
+    // No SA_RESTART: a signal must interrupt poll() in the accept loop
+    struct sigaction sa{};
+    sa.sa_handler = on_shutdown_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGTERM, &sa, nullptr);
+    sigaction(SIGINT, &sa, nullptr);
+    sa.sa_handler = on_reload_signal;
+    sigaction(SIGHUP, &sa, nullptr);
+    signal(SIGPIPE, SIG_IGN);
+
+    if (backends.empty())
+        backends = {{"127.0.0.1", 9001, false}, {"127.0.0.1", 9002, false}, {"127.0.0.1", 9003, false}};
+#ifdef LB_WITH_TLS
+    if (any_of(backends.begin(), backends.end(), [](const BackendSpec& b) { return b.tls; }) &&
+        !upstream_tls.init(upstream_ktls, upstream_ca)) {
+        cerr << "Upstream TLS setup failed\n";
+        ERR_print_errors_fp(stderr);
+        return 1;
+    }
+    if (upstream_tls.enabled() && upstream_ktls)
+        cout << "Upstream TLS: --upstream-ktls limits backend connections to TLS 1.2" << endl;
+#endif
+    if (!acl_file.empty()) {
+        string error;
+        if (!access_list.load(acl_file, error)) {
+            cerr << "--acl: " << error << "\n";
+            return 1;
+        }
+    }
     BackendManager backendManager;
+    for (const BackendSpec& b : backends) {
+        sockaddr_storage ss;
+        socklen_t len;
+        if (BackendEndpoint::parse_literal(b.host, ss, len))
+            backendManager.add_endpoint(b.host, b.port, (sockaddr*)&ss, len, b.tls);
+        else
+            dns_resolver.add(b.host, b.port, b.tls);
+    }
+    response_cache.configure((size_t)cache_mb << 20, cache_swr, cache_sie);
+    if (!cache_disk_dir.empty() && !response_cache.enable_disk(cache_disk_dir, (size_t)cache_disk_mb << 20)) {
+        perror(("cache disk tier in " + cache_disk_dir).c_str());
+        return 1;
+    }
+    backendManager.max_active = max_conns;
+    priority_scheduler.configure(&backendManager, max_conns, queue_timeout, fair_key);
+    ConnectionPool connectionPool(&backendManager, (size_t)pool_idle);
+    h2_pool.configure(&backendManager, &connectionPool, upstream_h2c ? (size_t)h2_conns : 0);
+    pipeline_pool.configure(&backendManager, &connectionPool, (size_t)pipeline_depth);
+    // Shared backend connections relay from memory and carry many requests
+    if (h2_pool.enabled() && proxy_options.zerocopy_threshold > 0)
+        cerr << "Warning: --zerocopy-threshold does not apply to --upstream-h2c responses\n";
+    if (h2_pool.enabled() && proxy_options.kernel_timestamps)
+        cerr << "Warning: --kernel-timestamps skips the backend leg of --upstream-h2c requests\n";
+    if (pipeline_pool.enabled() && proxy_options.zerocopy_threshold > 0)
+        cerr << "Warning: --zerocopy-threshold does not apply to pipelined GET/HEAD responses\n";
+    if (pipeline_pool.enabled() && proxy_options.kernel_timestamps)
+        cerr << "Warning: --kernel-timestamps skips the backend leg of pipelined GET/HEAD requests\n";
     LoadBalancer balancer(&backendManager, algo);
-    ClientHandler clientHandler(&backendManager, &balancer);
-    HealthChecker checker(&backendManager);
+    ClientHandler clientHandler(&backendManager, &balancer, &connectionPool, proxy_options);
+    HealthChecker checker(&backendManager, &connectionPool);
+    checker.set_prewarm((size_t)prewarm, warmup_path);
 
-    checker.start();
-
-    int server_fd = ::socket(AF_INET, SOCK_STREAM, 0);
-    if (server_fd == -1) { perror("socket"); return 1; }
-    int opt = 1;
-    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    if (reuseport > 0 && !reuseport_listeners.configure((size_t)reuseport, reuseport_steer)) {
+        cerr << "Invalid --reuseport-steer " << reuseport_steer << " (expected cpu, hash or kernel)\n";
+        return 1;
+    }
 
     sockaddr_in addr{};
     addr.sin_family = AF_INET;
     addr.sin_port = htons(8080);
     addr.sin_addr.s_addr = INADDR_ANY;
 
-    if (::bind(server_fd, (sockaddr*)&addr, sizeof(addr)) == -1) {
-        perror("bind failed");
-        ::close(server_fd);
-        return 1;
+    auto open_listener = [&]() -> int {
+        int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+        if (fd == -1) { perror("socket"); return -1; }
+        int opt = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+        if (reuseport_listeners.enabled() && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) == -1) {
+            perror("SO_REUSEPORT");
+            ::close(fd);
+            return -1;
+        }
+        // Accepted sockets inherit RX stamping, so segments that arrive before
+        // accept() are stamped too; OPT_ID needs a connected socket
+        if (proxy_options.kernel_timestamps && !KernelTimestamps::enable(fd, KernelTimestamps::RX_FLAGS))
+            perror("SO_TIMESTAMPING");
+        if (::bind(fd, (sockaddr*)&addr, sizeof(addr)) == -1) {
+            perror("bind failed");
+            ::close(fd);
+            return -1;
+        }
+        if (::listen(fd, backlog) == -1) {
+            perror("listen failed");
+            ::close(fd);
+            return -1;
+        }
+        return fd;
+    };
+
+    vector<int> listen_fds;
+    for (size_t i = 0; i < max<size_t>(1, reuseport_listeners.size()); ++i) {
+        int fd = open_listener();
+        if (fd == -1) {
+            for (int open_fd : listen_fds) ::close(open_fd);
+            return 1;
+        }
+        listen_fds.push_back(fd);
     }
-    if (::listen(server_fd, 64) == -1) {
-        perror("listen failed");
-        ::close(server_fd);
-        return 1;
+    if (reuseport_listeners.enabled()) reuseport_listeners.attach(listen_fds[0]);
+
+    // Background threads start only once the listener is up, so a failed
+    // bind exits cleanly
+    dns_resolver.start(&backendManager);
+    checker.start();
+    listen_monitor.start(listen_fds, backlog, 1000);
+    tracer.configure(trace_sample, trace_file);
+    tracer.start();
+    access_list.start();
+    if (proxy_options.zerocopy_threshold > 0) zerocopy_reaper.start();
+
+    if (sni_router.enabled()) {
+        if (sni_sockmap && !sni_router.enable_sockmap())
+            cerr << "Sockmap unavailable; TLS passthrough relays with splice()\n";
+        if (!sni_router.start(sni_port, backlog)) return 1;
+        cout << "TLS passthrough on port " << sni_port << "\n";
     }
-    cout << "Load balancer running on port 8080...\n";
 
-    while (true) {
-        sockaddr_in client_addr{};
-        socklen_t len = sizeof(client_addr);
-        int client_fd = ::accept(server_fd, (sockaddr*)&client_addr, &len);
-        if (client_fd == -1) continue;
+    AdminServer admin(&backendManager, admin_port);
+    if (admin_port > 0 && admin.start())
+        cout << "Admin endpoint on 127.0.0.1:" << admin_port << " (/status, /profile)\n";
 
-        char client_ip[INET_ADDRSTRLEN];
-        inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, INET_ADDRSTRLEN);
+    cout << "Load balancer running on port 8080";
+    if (reuseport_listeners.enabled())
+        cout << " (" << listen_fds.size() << " reuseport listeners, " << reuseport_steer << " steering)";
+    cout << "...\n";
 
-        std::thread(&ClientHandler::handle, &clientHandler, client_fd, string(client_ip)).detach();
-    }
+    auto accept_loop = [&](size_t index) {
+        int server_fd = listen_fds[index];
+        reuseport_listeners.pin(index);
+        while (!shutdown_requested) {
+            // Rebuilding a large list takes a while; accepts carry on meanwhile
+            if (reload_requested.exchange(false) && access_list.enabled()) access_list.request_reload();
 
-    ::close(server_fd);
+            pollfd pfd{server_fd, POLLIN, 0};
+            if (::poll(&pfd, 1, 500) <= 0) continue;
+
+            sockaddr_in client_addr{};
+            socklen_t len = sizeof(client_addr);
+            int client_fd = ::accept(server_fd, (sockaddr*)&client_addr, &len);
+            if (client_fd == -1) continue;
+            if (reuseport_listeners.enabled()) reuseport_listeners.count_accept(index);
+            // Refused before any thread or parsing cost
+            if (access_list.enabled() && !access_list.permits((sockaddr*)&client_addr)) {
+                ::close(client_fd);
+                continue;
+            }
+            if (proxy_options.kernel_timestamps) KernelTimestamps::enable(client_fd);
+
+            char client_ip[INET_ADDRSTRLEN];
+            inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, INET_ADDRSTRLEN);
+
+            clientHandler.admit(client_fd);
+            std::thread(&ClientHandler::handle, &clientHandler, client_fd, string(client_ip), mono_ns()).detach();
+        }
+    };
+    // Listener 0 runs on the main thread, the rest get one thread each
+    vector<thread> acceptors;
+    for (size_t i = 1; i < listen_fds.size(); ++i) acceptors.emplace_back(accept_loop, i);
+    accept_loop(0);
+    for (thread& t : acceptors) t.join();
+
+    // Stop accepting, let in-flight requests finish, then flush and join
+    listen_monitor.stop();
+    for (int fd : listen_fds) ::close(fd);
+    cout << "Shutting down: draining " << clientHandler.sessions_in_flight()
+         << " in-flight request(s), up to " << drain_timeout << "s..." << endl;
+    admin.stop();
+    // One budget for everything: tunnels and sessions drain side by side, and
+    // the last second (at most a quarter) is kept for aborting stragglers
+    auto drain_deadline = chrono::steady_clock::now() + chrono::seconds(drain_timeout);
+    auto abort_at = drain_deadline - min<chrono::steady_clock::duration>(chrono::seconds(1),
+                                                                         chrono::seconds(drain_timeout) / 4);
+    sni_router.stop(abort_at);
+    if (!clientHandler.drain(abort_at, drain_deadline))
+        cerr << "Drain deadline reached; remaining sessions were aborted\n";
     checker.stop();
+    dns_resolver.stop();
+    tracer.stop();
+    zerocopy_reaper.stop();
+    access_list.stop();
+    {
+        ofstream out("status.txt");
+        write_status(&backendManager, out);
+    }
+    cout << "Load balancer stopped." << endl;
     return 0;
 }
@@ -7,8 +7,8 @@
 ALGO=${1:-roundrobin}
 
 echo "🔧 Building backend servers and load balancer..."
-g++ -std=c++17 backend_server.cpp -o backend_server -pthread
-g++ -std=c++17 load_balancer.cpp -o load_balancer -pthread
+# The Makefile carries the link flags (-rdynamic, -lresolv)
+make || exit 1
 
 echo "🚀 Starting backend servers..."
 ./backend_server 9001 &